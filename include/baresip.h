@@ -77,6 +77,8 @@ struct config {
 		uint32_t trans_bsize;   /**< SIP Transaction bucket size    */
 		char local[64];         /**< Local SIP Address              */
 		char cert[256];
+		uint32_t reg_rate;      /**< Max. REGISTER per second, 0=off*/
+		uint32_t reg_spread;    /**< Delay of REGISTER, % of regint */
 	} sip;
 
 	/** Audio */
@@ -92,6 +94,7 @@ struct config {
 		uint32_t srate_play;    /**< Opt. sampling rate for player  */
 		uint32_t srate_src;     /**< Opt. sampling rate for source  */
 		bool src_first;         /**< Audio source opened first      */
+		uint32_t mix_ptime;     /**< Conference mixer tick, 0=off   */
 	} audio;
 
 	/** Video */
@@ -107,12 +110,27 @@ struct config {
 	struct {
 		uint8_t rtp_tos;        /**< Type-of-Service for outg. RTP  */
 		struct range rtp_ports; /**< RTP port range                 */
+		struct range rtp_pool;  /**< Pre-bound sockets, watermarks  */
+		uint32_t rtp_rxbatch;   /**< RTP datagrams per socket read  */
+		uint32_t rtp_rxbuf;     /**< RTP socket receive buffer size */
+		uint32_t rtp_txbatch;   /**< RTP packets per send batch     */
 		struct range rtp_bw;    /**< RTP Bandwidth range [bit/s]    */
 		bool rtcp_enable;       /**< RTCP is enabled                */
 		bool rtcp_mux;          /**< RTP/RTCP multiplexing          */
 		struct range jbuf_del;  /**< Delay, number of frames        */
+		bool jbuf_adaptive;     /**< Adaptive jitter buffer (audio) */
+		uint32_t workers;       /**< Number of media worker threads */
 	} avt;
 
+	/** Call admission */
+	struct {
+		uint32_t max_calls;     /**< Max. calls per UA, 0=no limit  */
+		uint32_t max_total;     /**< Max. calls in total, 0=no limit*/
+		uint32_t max_load;      /**< Max. media load in [%], 0=off  */
+		uint32_t retry_after;   /**< Retry-After when full [s]      */
+		bool trace;             /**< Trace call setup latency       */
+	} call;
+
 	/* Network */
 	struct {
 		char ifname[16];        /**< Bind to interface (optional)   */
@@ -276,6 +294,21 @@ void aufilt_unregister(struct aufilt *af);
 struct list *aufilt_list(void);
 
 
+/*
+ * Audio Resampler
+ */
+
+int resamp_bench(struct re_printf *pf, void *unused);
+
+
+/*
+ * Audio Mixer
+ */
+
+int aumix_debug(struct re_printf *pf, void *unused);
+int aumix_bench(struct re_printf *pf, void *unused);
+
+
 /*
  * Menc - Media encryption
  */
@@ -319,6 +352,7 @@ int  net_dnssrv_add(const struct sa *sa);
 void net_change(uint32_t interval, net_change_h *ch, void *arg);
 bool net_check(void);
 int  net_debug(struct re_printf *pf, void *unused);
+int  rtppool_debug(struct re_printf *pf, void *unused);
 const struct sa *net_laddr_af(int af);
 const char      *net_domain(void);
 struct dnsc     *net_dnsc(void);
@@ -334,6 +368,8 @@ int  play_file(struct play **playp, const char *filename, int repeat);
 int  play_tone(struct play **playp, struct mbuf *tone, uint32_t srate,
 	       uint8_t ch, int repeat);
 void play_close(void);
+int  play_debug(struct re_printf *pf, void *unused);
+int  play_stress(struct re_printf *pf, void *unused);
 
 
 /*
@@ -716,6 +752,7 @@ void  video_mute(struct video *v, bool muted);
 void *video_view(const struct video *v);
 int   video_set_fullscreen(struct video *v, bool fs);
 int   video_set_orient(struct video *v, int orient);
+int   video_set_bitrate(struct video *v, unsigned bitrate);
 void  video_vidsrc_set_device(struct video *v, const char *dev);
 int   video_set_source(struct video *v, const char *name, const char *dev);
 int   video_debug(struct re_printf *pf, const struct video *v);
@@ -753,6 +790,7 @@ int mnat_register(struct mnat **mnatp, const char *id, const char *ftag,
  * Real-time
  */
 int realtime_enable(bool enable, int fps);
+uint64_t realtime_usec(void);
 
 
 /*
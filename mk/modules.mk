@@ -25,7 +25,6 @@
 #   USE_MPG123        Use mpg123
 #   USE_OPUS          Opus audio codec
 #   USE_OSS           OSS audio driver
-#   USE_PLC           Packet Loss Concealment
 #   USE_PORTAUDIO     Portaudio audio driver
 #   USE_SDL           libSDL video output
 #   USE_SILK          SILK (Skype) audio codec
@@ -100,9 +99,6 @@ USE_OPUS := $(shell [ -f $(SYSROOT)/include/opus/opus.h ] || \
 USE_OSS := $(shell [ -f $(SYSROOT)/include/soundcard.h ] || \
 	[ -f $(SYSROOT)/include/linux/soundcard.h ] || \
 	[ -f $(SYSROOT)/include/sys/soundcard.h ] && echo "yes")
-USE_PLC := $(shell [ -f $(SYSROOT)/include/spandsp/plc.h ] || \
-	[ -f $(SYSROOT_ALT)/include/spandsp/plc.h ] || \
-	[ -f $(SYSROOT)/local/include/spandsp/plc.h ] && echo "yes")
 USE_PORTAUDIO := $(shell [ -f $(SYSROOT)/local/include/portaudio.h ] || \
 		[ -f $(SYSROOT)/include/portaudio.h ] || \
 		[ -f $(SYSROOT_ALT)/include/portaudio.h ] && echo "yes")
@@ -189,7 +185,7 @@ endif
 # ------------------------------------------------------------------------- #
 
 MODULES   += $(EXTRA_MODULES) stun turn ice natbd auloop vidloop presence
-MODULES   += menu contact vumeter selfview mwi
+MODULES   += menu contact vumeter selfview mwi codecbench plc regstub
 
 ifneq ($(USE_ALSA),)
 MODULES   += alsa
@@ -270,9 +266,6 @@ endif
 ifneq ($(USE_OSS),)
 MODULES   += oss
 endif
-ifneq ($(USE_PLC),)
-MODULES   += plc
-endif
 ifneq ($(USE_PORTAUDIO),)
 MODULES   += portaudio
 endif
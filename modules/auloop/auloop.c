@@ -27,6 +27,7 @@ struct audio_loop {
 	const struct aucodec *ac;
 	struct auenc_state *enc;
 	struct audec_state *dec;
+	int16_t *sampv;
 	uint32_t srate;
 	uint32_t ch;
 	uint32_t fs;
@@ -61,6 +62,7 @@ static void auloop_destructor(void *arg)
 	mem_deref(al->ab);
 	mem_deref(al->enc);
 	mem_deref(al->dec);
+	mem_deref(al->sampv);
 }
 
 
@@ -77,31 +79,20 @@ static void print_stats(struct audio_loop *al)
 
 static int codec_read(struct audio_loop *al, uint8_t *buf, size_t sz)
 {
-	int16_t *sampv;
 	uint8_t x[1024];
 	size_t xlen = sizeof(x), sampc = sz/2;
 	int err;
 
-	sampv = mem_alloc(sz, NULL);
-	if (!sampv) {
-		err = ENOMEM;
-		goto out;
-	}
+	if (sampc > al->fs)
+		return EINVAL;
 
-	aubuf_read_samp(al->ab, sampv, sampc);
-
-	err = al->ac->ench(al->enc, x, &xlen, sampv, sampc);
-	if (err)
-		goto out;
+	aubuf_read_samp(al->ab, al->sampv, sampc);
 
-	err = al->ac->dech(al->dec, (void *)buf, &sampc, x, xlen);
+	err = al->ac->ench(al->enc, x, &xlen, al->sampv, sampc);
 	if (err)
-		goto out;
-
- out:
-	mem_deref(sampv);
+		return err;
 
-	return err;
+	return al->ac->dech(al->dec, (void *)buf, &sampc, x, xlen);
 }
 
 
@@ -196,6 +187,12 @@ static int auloop_reset(struct audio_loop *al)
 
 	(void)re_printf("Audio-loop: %uHz, %dch\n", al->srate, al->ch);
 
+	/* sample buffer for the codec, allocated once per format */
+	al->sampv = mem_deref(al->sampv);
+	al->sampv = mem_alloc(al->fs * sizeof(*al->sampv), NULL);
+	if (!al->sampv)
+		return ENOMEM;
+
 	err = aubuf_alloc(&al->ab, 320, 0);
 	if (err)
 		return err;
@@ -136,6 +136,11 @@ static struct vidcodec mpg4 = {
 };
 
 
+static const struct cmd cmdv[] = {
+	{'H', 0, "H.264 packetizer benchmark", h264_packetize_bench },
+};
+
+
 static int module_init(void)
 {
 #ifdef USE_X264
@@ -150,6 +155,9 @@ static int module_init(void)
 
 	avcodec_register_all();
 
+	encode_config(conf_cur());
+	decode_config(conf_cur());
+
 	if (avcodec_find_decoder(CODEC_ID_H264))
 		vidcodec_register(&h264);
 
@@ -159,12 +167,14 @@ static int module_init(void)
 	if (avcodec_find_decoder(CODEC_ID_MPEG4))
 		vidcodec_register(&mpg4);
 
-	return 0;
+	return cmd_register(cmdv, ARRAY_SIZE(cmdv));
 }
 
 
 static int module_close(void)
 {
+	cmd_unregister(cmdv);
+
 	vidcodec_unregister(&mpg4);
 	vidcodec_unregister(&h263);
 	vidcodec_unregister(&h264);
@@ -19,6 +19,7 @@ extern const uint8_t h264_level_idc;
 
 struct videnc_state;
 
+void encode_config(const struct conf *conf);
 int encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 		  struct videnc_param *prm, const char *fmtp);
 int encode(struct videnc_state *st, bool update, const struct vidframe *frame,
@@ -36,6 +37,7 @@ int encode_x264(struct videnc_state *st, bool update,
 
 struct viddec_state;
 
+void decode_config(const struct conf *conf);
 int decode_update(struct viddec_state **vdsp, const struct vidcodec *vc,
 		  const char *fmtp);
 int decode_h263(struct viddec_state *st, struct vidframe *frame,
@@ -50,8 +52,9 @@ int decode_h263_test(struct viddec_state *st, struct vidframe *frame,
 
 int decode_sdpparam_h264(struct videnc_state *st, const struct pl *name,
 			 const struct pl *val);
-int h264_packetize(struct mbuf *mb, size_t pktsize,
+int h264_packetize(struct mbuf *mb, size_t pktsize, bool stap_a,
 		   videnc_packet_h *pkth, void *arg);
+int h264_packetize_bench(struct re_printf *pf, void *arg);
 int h264_decode(struct viddec_state *st, struct mbuf *src);
 int h264_nal_send(bool first, bool last,
 		  bool marker, uint32_t ihdr, const uint8_t *buf,
@@ -3,6 +3,7 @@
  *
  * Copyright (C) 2010 - 2013 Creytiv.com
  */
+#include <string.h>
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
@@ -16,19 +17,151 @@
 #include <re_dbg.h>
 
 
+#if defined (AV_INPUT_BUFFER_PADDING_SIZE)
+#define INPUT_PADDING AV_INPUT_BUFFER_PADDING_SIZE
+#else
+#define INPUT_PADDING FF_INPUT_BUFFER_PADDING_SIZE
+#endif
+
+
+enum {
+	BUF_MINSZ = 65536,  /**< Initial size of the bitstream buffer   */
+	MB_BYTES  = 64,     /**< Reserved bytes per macroblock          */
+	MAX_FS    = 36864,  /**< Largest frame size in Table A-1 [MBs]  */
+};
+
+
+/*
+ * Decoder threading, from the config file:
+ *
+ *   avcodec_dec_threading   none, slice or frame
+ *   avcodec_dec_threads     Number of threads, 0 is automatic
+ *   avcodec_dec_max_delay   Maximum delay from frame threading [frames]
+ *
+ * Slice threading decodes the slices of one picture in parallel and adds
+ * no delay, but only helps if the peer encodes several slices. Frame
+ * threading decodes consecutive pictures in parallel and works for any
+ * stream, but each extra thread delays the output by one frame, so the
+ * number of threads is limited to the maximum delay plus one.
+ */
+
+enum threading {
+	THREAD_NONE,
+	THREAD_SLICE,
+	THREAD_FRAME,
+};
+
+static struct {
+	enum threading type;
+	uint32_t threads;
+	uint32_t max_delay;
+} dconf = {THREAD_SLICE, 0, 2};
+
+
+/*
+ * The RTP payloads of one access unit are assembled into the bitstream
+ * buffer "mb", which is only written once per byte. The buffer is sized
+ * from the max-fs parameter or the level of the SPS, and always has
+ * INPUT_PADDING zero bytes after the end, as libavcodec requires.
+ *
+ * A gap in the RTP sequence numbers, or a fragment without its start,
+ * marks the access unit as lost. The rest of it is then skipped, and it
+ * is dropped when the marker bit arrives instead of being decoded.
+ */
 struct viddec_state {
 	AVCodec *codec;
 	AVCodecContext *ctx;
 	AVFrame *pict;
 	struct mbuf *mb;
 	bool got_keyframe;
+	uint16_t seq;        /**< Next expected RTP sequence number    */
+	bool seq_valid;      /**< Expected sequence number is valid    */
+	bool frag;           /**< Inside a fragmented NAL unit         */
+	bool lost;           /**< Access unit is incomplete            */
+	uint32_t n_drop;     /**< Number of dropped access units       */
+	uint32_t n_grow;     /**< Number of bitstream buffer resizes   */
+	uint32_t n_pkt;      /**< Number of frames sent to decoder     */
+	uint32_t n_pict;     /**< Number of pictures from decoder      */
+	uint32_t delay_max;  /**< Maximum decoder delay [frames]       */
 };
 
 
+static const char *threading_name(enum threading type)
+{
+	switch (type) {
+
+	case THREAD_SLICE: return "slice";
+	case THREAD_FRAME: return "frame";
+	default:           return "none";
+	}
+}
+
+
+/**
+ * Read the decoder threading parameters from the config
+ *
+ * @param conf Configuration
+ */
+void decode_config(const struct conf *conf)
+{
+	struct pl pl;
+
+	if (0 == conf_get(conf, "avcodec_dec_threading", &pl)) {
+
+		if (0 == pl_strcasecmp(&pl, "frame"))
+			dconf.type = THREAD_FRAME;
+		else if (0 == pl_strcasecmp(&pl, "slice"))
+			dconf.type = THREAD_SLICE;
+		else if (0 == pl_strcasecmp(&pl, "none"))
+			dconf.type = THREAD_NONE;
+		else {
+			DEBUG_WARNING("unknown threading: %r\n", &pl);
+		}
+	}
+
+	(void)conf_get_u32(conf, "avcodec_dec_threads", &dconf.threads);
+	(void)conf_get_u32(conf, "avcodec_dec_max_delay", &dconf.max_delay);
+
+	if (dconf.type == THREAD_FRAME) {
+
+		/* each frame thread adds one frame of delay */
+		if (!dconf.threads || dconf.threads > dconf.max_delay + 1)
+			dconf.threads = dconf.max_delay + 1;
+	}
+}
+
+
+static void set_threading(AVCodecContext *ctx)
+{
+	if (dconf.type == THREAD_NONE) {
+		ctx->thread_count = 1;
+		return;
+	}
+
+	ctx->thread_count = dconf.threads;
+
+#ifdef FF_THREAD_FRAME
+	ctx->thread_type = dconf.type == THREAD_FRAME ? FF_THREAD_FRAME
+						      : FF_THREAD_SLICE;
+#endif
+
+	if (dconf.type == THREAD_SLICE)
+		ctx->flags |= CODEC_FLAG_LOW_DELAY;
+}
+
+
 static void destructor(void *arg)
 {
 	struct viddec_state *st = arg;
 
+	if (st->n_pkt) {
+		DEBUG_INFO("decoder: %u frames, %u pictures,"
+			   " max delay %u frames, %u dropped,"
+			   " buffer %zu bytes (%u resizes)\n",
+			   st->n_pkt, st->n_pict, st->delay_max,
+			   st->n_drop, st->mb->size, st->n_grow);
+	}
+
 	mem_deref(st->mb);
 
 	if (st->ctx) {
@@ -42,6 +175,82 @@ static void destructor(void *arg)
 }
 
 
+/* Make room for n more bytes in the bitstream buffer, plus padding */
+static int buf_reserve(struct viddec_state *st, size_t n)
+{
+	const size_t need = st->mb->end + n + INPUT_PADDING;
+	size_t sz = st->mb->size;
+	int err;
+
+	if (need <= sz)
+		return 0;
+
+	while (sz < need)
+		sz *= 2;
+
+	err = mbuf_resize(st->mb, sz);
+	if (err)
+		return err;
+
+	++st->n_grow;
+
+	return 0;
+}
+
+
+static int buf_append(struct viddec_state *st, const uint8_t *p, size_t n)
+{
+	int err;
+
+	err = buf_reserve(st, n);
+	if (err)
+		return err;
+
+	return mbuf_write_mem(st->mb, p, n);
+}
+
+
+/*
+ * Reserve room for a picture of a number of macroblocks. The frame size
+ * may come from the peer, and is limited to the largest H.264 level.
+ */
+static int buf_reserve_fs(struct viddec_state *st, uint32_t fs)
+{
+	const size_t sz = max((size_t)min(fs, MAX_FS) * MB_BYTES,
+			      (size_t)BUF_MINSZ);
+
+	if (sz <= st->mb->end)
+		return 0;
+
+	return buf_reserve(st, sz - st->mb->end);
+}
+
+
+/* Maximum frame size in macroblocks (H.264 Table A-1) */
+static uint32_t h264_level_maxfs(uint8_t level_idc)
+{
+	switch (level_idc) {
+
+	case 9:
+	case 10: return 99;
+	case 11:
+	case 12:
+	case 13:
+	case 20: return 396;
+	case 21: return 792;
+	case 22:
+	case 30: return 1620;
+	case 31: return 3600;
+	case 32: return 5120;
+	case 40:
+	case 41: return 8192;
+	case 42: return 8704;
+	case 50: return 22080;
+	default: return level_idc > 50 ? MAX_FS : 0;
+	}
+}
+
+
 static int init_decoder(struct viddec_state *st, const char *name)
 {
 	enum CodecID codec_id;
@@ -65,6 +274,8 @@ static int init_decoder(struct viddec_state *st, const char *name)
 	if (!st->ctx || !st->pict)
 		return ENOMEM;
 
+	set_threading(st->ctx);
+
 #if LIBAVCODEC_VERSION_INT >= ((53<<16)+(8<<8)+0)
 	if (avcodec_open2(st->ctx, st->codec, NULL) < 0)
 		return ENOENT;
@@ -89,25 +300,37 @@ int decode_update(struct viddec_state **vdsp, const struct vidcodec *vc,
 	if (*vdsp)
 		return 0;
 
-	(void)fmtp;
-
 	st = mem_zalloc(sizeof(*st), destructor);
 	if (!st)
 		return ENOMEM;
 
-	st->mb = mbuf_alloc(1024);
+	st->mb = mbuf_alloc(BUF_MINSZ);
 	if (!st->mb) {
 		err = ENOMEM;
 		goto out;
 	}
 
+	if (str_isset(fmtp)) {
+		struct pl pl, max_fs;
+
+		pl_set_str(&pl, fmtp);
+
+		if (fmt_param_get(&pl, "max-fs", &max_fs)) {
+			err = buf_reserve_fs(st, pl_u32(&max_fs));
+			if (err)
+				goto out;
+		}
+	}
+
 	err = init_decoder(st, vc->name);
 	if (err) {
 		DEBUG_WARNING("%s: could not init decoder\n", vc->name);
 		goto out;
 	}
 
-	re_printf("video decoder %s (%s)\n", vc->name, fmtp);
+	re_printf("video decoder %s (%s) threading=%s threads=%d\n",
+		  vc->name, fmtp, threading_name(dconf.type),
+		  st->ctx->thread_count);
 
  out:
 	if (err)
@@ -119,21 +342,17 @@ int decode_update(struct viddec_state **vdsp, const struct vidcodec *vc,
 }
 
 
-/*
- * TODO: check input/output size
- */
-static int ffdecode(struct viddec_state *st, struct vidframe *frame,
-		    bool eof, struct mbuf *src)
+/* Decode the access unit in the bitstream buffer */
+static int ffdecode(struct viddec_state *st, struct vidframe *frame)
 {
 	int i, got_picture, ret, err;
 
-	/* assemble packets in "mbuf" */
-	err = mbuf_write_mem(st->mb, mbuf_buf(src), mbuf_get_left(src));
+	/* libavcodec may read past the end of the bitstream */
+	err = buf_reserve(st, 0);
 	if (err)
-		return err;
+		goto out;
 
-	if (!eof)
-		return 0;
+	memset(st->mb->buf + st->mb->end, 0, INPUT_PADDING);
 
 	st->mb->pos = 0;
 
@@ -168,9 +387,24 @@ static int ffdecode(struct viddec_state *st, struct vidframe *frame,
 			     ret, mbuf_get_left(st->mb), got_picture);
 	}
 
-	mbuf_skip_to_end(src);
+	++st->n_pkt;
 
 	if (got_picture) {
+
+		++st->n_pict;
+
+		/* frames still in the decoder pipeline */
+		if (st->n_pkt - st->n_pict > st->delay_max) {
+
+			st->delay_max = st->n_pkt - st->n_pict;
+
+			if (st->delay_max > dconf.max_delay) {
+				DEBUG_NOTICE("decoder delay %u frames"
+					     " (max %u)\n", st->delay_max,
+					     dconf.max_delay);
+			}
+		}
+
 		for (i=0; i<4; i++) {
 			frame->data[i]     = st->pict->data[i];
 			frame->linesize[i] = st->pict->linesize[i];
@@ -181,17 +415,65 @@ static int ffdecode(struct viddec_state *st, struct vidframe *frame,
 	}
 
  out:
-	if (eof)
-		mbuf_rewind(st->mb);
+	mbuf_rewind(st->mb);
 
 	return err;
 }
 
 
+/* Append the rest of a packet to the bitstream buffer */
+static int append_src(struct viddec_state *st, struct mbuf *src)
+{
+	int err;
+
+	err = buf_append(st, mbuf_buf(src), mbuf_get_left(src));
+	if (err)
+		return err;
+
+	mbuf_skip_to_end(src);
+
+	return 0;
+}
+
+
+/* Append a complete NAL unit, with the H.264 start sequence */
+static int h264_nal_append(struct viddec_state *st, const uint8_t *nal,
+			   size_t len)
+{
+	static const uint8_t nal_seq[3] = {0, 0, 1};
+	int err;
+
+	switch (nal[0] & 0x1f) {
+
+	case H264_NAL_SPS:
+		/* profile_idc, constraint flags, level_idc */
+		if (len >= 4) {
+			err = buf_reserve_fs(st, h264_level_maxfs(nal[3]));
+			if (err)
+				return err;
+		}
+		/*@fallthrough@*/
+
+	case H264_NAL_PPS:
+		st->got_keyframe = true;
+		break;
+	}
+
+	err = buf_reserve(st, sizeof(nal_seq) + len);
+	if (err)
+		return err;
+
+	(void)mbuf_write_mem(st->mb, nal_seq, sizeof(nal_seq));
+	(void)mbuf_write_mem(st->mb, nal, len);
+
+	return 0;
+}
+
+
 int h264_decode(struct viddec_state *st, struct mbuf *src)
 {
 	struct h264_hdr h264_hdr;
-	const uint8_t nal_seq[3] = {0, 0, 1};
+	const uint8_t *nal = mbuf_buf(src);
 	int err;
 
 	err = h264_hdr_decode(&h264_hdr, src);
@@ -206,21 +488,24 @@ int h264_decode(struct viddec_state *st, struct mbuf *src)
 	/* handle NAL types */
 	if (1 <= h264_hdr.type && h264_hdr.type <= 23) {
 
-		if (!st->got_keyframe) {
-			switch (h264_hdr.type) {
+		err = h264_nal_append(st, nal, mbuf_get_left(src) + 1);
+		mbuf_skip_to_end(src);
+	}
+	else if (H264_NAL_STAP_A == h264_hdr.type) {
 
-			case H264_NAL_PPS:
-			case H264_NAL_SPS:
-				st->got_keyframe = true;
-				break;
-			}
-		}
+		while (mbuf_get_left(src) >= 2) {
 
-		/* prepend H.264 NAL start sequence */
-		mbuf_write_mem(st->mb, nal_seq, 3);
+			const size_t len = ntohs(mbuf_read_u16(src));
 
-		/* encode NAL header back to buffer */
-		err = h264_hdr_encode(&h264_hdr, st->mb);
+			if (!len || len > mbuf_get_left(src))
+				return EBADMSG;
+
+			err = h264_nal_append(st, mbuf_buf(src), len);
+			if (err)
+				return err;
+
+			mbuf_advance(src, len);
+		}
 	}
 	else if (H264_NAL_FU_A == h264_hdr.type) {
 		struct fu fu;
@@ -231,12 +516,37 @@ int h264_decode(struct viddec_state *st, struct mbuf *src)
 		h264_hdr.type = fu.type;
 
 		if (fu.s) {
+			if (st->frag) {
+				DEBUG_NOTICE("FU-A without end bit\n");
+				st->lost = true;
+			}
+
+			st->frag = true;
+
+			err = buf_reserve(st, 4 + mbuf_get_left(src));
+			if (err)
+				return err;
+
 			/* prepend H.264 NAL start sequence */
-			mbuf_write_mem(st->mb, nal_seq, 3);
+			(void)mbuf_write_u8(st->mb, 0);
+			(void)mbuf_write_u8(st->mb, 0);
+			(void)mbuf_write_u8(st->mb, 1);
 
 			/* encode NAL header back to buffer */
 			err = h264_hdr_encode(&h264_hdr, st->mb);
+			if (err)
+				return err;
+		}
+		else if (!st->frag) {
+			/* the start of this NAL unit was lost */
+			st->lost = true;
+			return 0;
 		}
+
+		if (fu.e)
+			st->frag = false;
+
+		err = append_src(st, src);
 	}
 	else {
 		DEBUG_WARNING("unknown NAL type %u\n", h264_hdr.type);
@@ -250,24 +560,47 @@ int h264_decode(struct viddec_state *st, struct mbuf *src)
 int decode_h264(struct viddec_state *st, struct vidframe *frame,
 		bool eof, uint16_t seq, struct mbuf *src)
 {
-	int err;
-
-	(void)seq;
+	int err = 0;
 
 	if (!src)
 		return 0;
 
-	err = h264_decode(st, src);
-	if (err)
+	if (st->seq_valid && seq != st->seq)
+		st->lost = true;
+
+	st->seq       = seq + 1;
+	st->seq_valid = true;
+
+	/* skip the rest of an incomplete access unit */
+	if (!st->lost) {
+		err = h264_decode(st, src);
+		if (err)
+			st->lost = true;
+	}
+
+	if (!eof)
 		return err;
 
-	return ffdecode(st, frame, eof, src);
+	if (st->lost) {
+		++st->n_drop;
+
+		mbuf_rewind(st->mb);
+		st->frag = false;
+		st->lost = false;
+
+		/* the caller requests a new keyframe */
+		return err ? err : EPROTO;
+	}
+
+	return ffdecode(st, frame);
 }
 
 
 int decode_mpeg4(struct viddec_state *st, struct vidframe *frame,
 		 bool eof, uint16_t seq, struct mbuf *src)
 {
+	int err;
+
 	if (!src)
 		return 0;
 
@@ -276,7 +609,11 @@ int decode_mpeg4(struct viddec_state *st, struct vidframe *frame,
 	/* let the decoder handle this */
 	st->got_keyframe = true;
 
-	return ffdecode(st, frame, eof, src);
+	err = append_src(st, src);
+	if (err || !eof)
+		return err;
+
+	return ffdecode(st, frame);
 }
 
 
@@ -343,8 +680,13 @@ int decode_h263(struct viddec_state *st, struct vidframe *frame,
 		const uint8_t mask  = (1 << (8 - hdr.sbit)) - 1;
 		const uint8_t sbyte = mbuf_read_u8(src) & mask;
 
-		st->mb->buf[st->mb->end - 1] |= sbyte;
+		if (st->mb->end)
+			st->mb->buf[st->mb->end - 1] |= sbyte;
 	}
 
-	return ffdecode(st, frame, marker, src);
+	err = append_src(st, src);
+	if (err || !marker)
+		return err;
+
+	return ffdecode(st, frame);
 }
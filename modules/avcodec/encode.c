@@ -24,6 +24,12 @@ enum {
 };
 
 
+/* H.264 packetizer, from the config file */
+static struct {
+	bool stap_a;  /**< Aggregate small NAL units into STAP-A */
+} econf;
+
+
 struct picsz {
 	enum h263_fmt fmt;  /**< Picture size */
 	uint8_t mpi;        /**< Minimum Picture Interval (1-32) */
@@ -64,6 +70,17 @@ struct videnc_state {
 };
 
 
+/**
+ * Read the encoder parameters from the config
+ *
+ * @param conf Configuration
+ */
+void encode_config(const struct conf *conf)
+{
+	(void)conf_get_bool(conf, "avcodec_h264_stap", &econf.stap_a);
+}
+
+
 static void destructor(void *arg)
 {
 	struct videnc_state *st = arg;
@@ -590,7 +607,8 @@ int encode(struct videnc_state *st, bool update, const struct vidframe *frame,
 		break;
 
 	case CODEC_ID_H264:
-		err = h264_packetize(st->mb, st->encprm.pktsize, pkth, arg);
+		err = h264_packetize(st->mb, st->encprm.pktsize,
+				     econf.stap_a, pkth, arg);
 		break;
 
 	case CODEC_ID_MPEG4:
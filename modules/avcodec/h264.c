@@ -3,6 +3,8 @@
  *
  * Copyright (C) 2010 Creytiv.com
  */
+#include <errno.h>
+#include <stdio.h>
 #include <string.h>
 #include <re.h>
 #include <rem.h>
@@ -23,6 +25,32 @@
 const uint8_t h264_level_idc = 0x0c;
 
 
+enum {
+	STAP_MAXNAL = 16,    /**< Maximum NAL units per STAP-A packet     */
+	STAP_MAXSZ  = 1500,  /**< Maximum size of a STAP-A packet         */
+	BENCH_PKTSZ = 1300,  /**< Packet size used by the benchmark       */
+};
+
+
+/**
+ * Single-time aggregation packet (STAP-A) being assembled. Consecutive
+ * small NAL units of one access unit are collected here, and sent in
+ * one RTP packet when the next one does not fit anymore.
+ */
+struct stap {
+	struct {
+		const uint8_t *p;  /**< NAL unit, including its header     */
+		size_t sz;         /**< Size of the NAL unit               */
+	} nalv[STAP_MAXNAL];
+	unsigned n;          /**< Number of pending NAL units             */
+	size_t sz;           /**< STAP-A payload size, with the lengths   */
+	size_t maxsz;        /**< Maximum STAP-A packet size              */
+	size_t pktsize;      /**< Maximum RTP payload size                */
+	videnc_packet_h *pkth;
+	void *arg;
+};
+
+
 int h264_hdr_encode(const struct h264_hdr *hdr, struct mbuf *mb)
 {
 	uint8_t v;
@@ -52,7 +80,7 @@ int h264_hdr_decode(struct h264_hdr *hdr, struct mbuf *mb)
 
 int fu_hdr_encode(const struct fu *fu, struct mbuf *mb)
 {
-	uint8_t v = fu->s<<7 | fu->s<<6 | fu->r<<5 | fu->type;
+	uint8_t v = fu->s<<7 | fu->e<<6 | fu->r<<5 | fu->type;
 	return mbuf_write_u8(mb, v);
 }
 
@@ -124,6 +152,10 @@ static int rtp_send_data(const uint8_t *hdr, size_t hdr_sz,
 }
 
 
+/*
+ * A NAL unit that does not fit into one packet is split into FU-A
+ * fragments of equal size, instead of full fragments and a small rest.
+ */
 int h264_nal_send(bool first, bool last,
 		  bool marker, uint32_t ihdr, const uint8_t *buf,
 		  size_t size, size_t maxsz,
@@ -132,7 +164,7 @@ int h264_nal_send(bool first, bool last,
 	uint8_t hdr = (uint8_t)ihdr;
 	int err = 0;
 
-	if (first && last && size <= maxsz) {
+	if (first && last && 1 + size <= maxsz) {
 		err = rtp_send_data(&hdr, 1, buf, size, marker,
 				    pkth, arg);
 	}
@@ -141,15 +173,19 @@ int h264_nal_send(bool first, bool last,
 		const uint8_t type = hdr & 0x1f;
 		const uint8_t nri  = hdr & 0x60;
 		const size_t sz = maxsz - 2;
+		size_t n = (size + sz - 1) / sz;  /* number of fragments */
 
 		fu_hdr[0] = nri | H264_NAL_FU_A;
 		fu_hdr[1] = first ? (1<<7 | type) : type;
 
-		while (size > sz) {
-			err |= rtp_send_data(fu_hdr, 2, buf, sz, false,
+		while (n > 1) {
+			const size_t fsz = (size + n - 1) / n;
+
+			err |= rtp_send_data(fu_hdr, 2, buf, fsz, false,
 					     pkth, arg);
-			buf += sz;
-			size -= sz;
+			buf += fsz;
+			size -= fsz;
+			--n;
 			fu_hdr[1] &= ~(1 << 7);
 		}
 
@@ -164,15 +200,98 @@ int h264_nal_send(bool first, bool last,
 }
 
 
-int h264_packetize(struct mbuf *mb, size_t pktsize,
-		   videnc_packet_h *pkth, void *arg)
+static int stap_flush(struct stap *stap, bool marker)
+{
+	uint8_t buf[STAP_MAXSZ];
+	uint8_t hdr = H264_NAL_STAP_A;
+	size_t len = 0;
+	unsigned i;
+	int err;
+
+	if (!stap->n)
+		return 0;
+
+	if (stap->n == 1) {
+		err = h264_nal_send(true, true, marker, stap->nalv[0].p[0],
+				    stap->nalv[0].p + 1, stap->nalv[0].sz - 1,
+				    stap->pktsize, stap->pkth, stap->arg);
+		goto out;
+	}
+
+	for (i=0; i<stap->n; i++) {
+
+		const uint8_t *p = stap->nalv[i].p;
+		const size_t sz  = stap->nalv[i].sz;
+
+		/* F is the OR, and NRI the maximum of all NAL units */
+		hdr |= p[0] & 0x80;
+		if ((p[0] & 0x60) > (hdr & 0x60))
+			hdr = (hdr & ~0x60) | (p[0] & 0x60);
+
+		buf[len++] = (uint8_t)(sz >> 8);
+		buf[len++] = (uint8_t)(sz & 0xff);
+		memcpy(&buf[len], p, sz);
+		len += sz;
+	}
+
+	err = rtp_send_data(&hdr, 1, buf, len, marker,
+			    stap->pkth, stap->arg);
+
+ out:
+	stap->n  = 0;
+	stap->sz = 0;
+
+	return err;
+}
+
+
+/* Send one NAL unit, or keep it back for the next STAP-A packet */
+static int stap_nal(struct stap *stap, const uint8_t *p, size_t sz,
+		    bool last)
+{
+	int err = 0;
+
+	/* room for at least one more small NAL unit in the STAP-A */
+	if (1 + 2 + sz + 2 + 2 <= stap->maxsz) {
+
+		if (stap->n == STAP_MAXNAL ||
+		    1 + stap->sz + 2 + sz > stap->maxsz)
+			err |= stap_flush(stap, false);
+
+		stap->nalv[stap->n].p  = p;
+		stap->nalv[stap->n].sz = sz;
+		++stap->n;
+		stap->sz += 2 + sz;
+
+		if (last)
+			err |= stap_flush(stap, true);
+	}
+	else {
+		err |= stap_flush(stap, false);
+		err |= h264_nal_send(true, true, last, p[0], p + 1, sz - 1,
+				     stap->pktsize, stap->pkth, stap->arg);
+	}
+
+	return err;
+}
+
+
+static int packetize(const uint8_t *start, const uint8_t *end,
+		     size_t pktsize, bool stap_a,
+		     videnc_packet_h *pkth, void *arg)
 {
-	const uint8_t *start = mb->buf;
-	const uint8_t *end   = start + mb->end;
+	struct stap stap;
 	const uint8_t *r;
 	int err = 0;
 
-	r = h264_find_startcode(mb->buf, end);
+	stap.n       = 0;
+	stap.sz      = 0;
+	stap.maxsz   = min(pktsize, (size_t)STAP_MAXSZ);
+	stap.pktsize = pktsize;
+	stap.pkth    = pkth;
+	stap.arg     = arg;
+
+	r = h264_find_startcode(start, end);
 
 	while (r < end) {
 		const uint8_t *r1;
@@ -183,11 +302,197 @@ int h264_packetize(struct mbuf *mb, size_t pktsize,
 
 		r1 = h264_find_startcode(r, end);
 
-		err |= h264_nal_send(true, true, (r1 >= end), r[0],
-				     r+1, r1-r-1, pktsize,
-				     pkth, arg);
+		if (stap_a) {
+			err |= stap_nal(&stap, r, r1 - r, r1 >= end);
+		}
+		else {
+			err |= h264_nal_send(true, true, (r1 >= end), r[0],
+					     r+1, r1-r-1, pktsize,
+					     pkth, arg);
+		}
+
 		r = r1;
 	}
 
 	return err;
 }
+
+
+/**
+ * Packetize one access unit of a H.264 byte stream (RFC 3984)
+ *
+ * @param mb      Buffer with the access unit, with NAL start sequences
+ * @param pktsize Maximum RTP payload size
+ * @param stap_a  Aggregate small NAL units into STAP-A packets
+ * @param pkth    Packet handler, called for each packet
+ * @param arg     Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int h264_packetize(struct mbuf *mb, size_t pktsize, bool stap_a,
+		   videnc_packet_h *pkth, void *arg)
+{
+	return packetize(mb->buf, mb->buf + mb->end, pktsize, stap_a,
+			 pkth, arg);
+}
+
+
+struct pktcount {
+	uint32_t n;
+	uint32_t kbytes;
+	size_t bytes;
+	size_t max;
+};
+
+
+static int count_handler(bool marker, const uint8_t *hdr, size_t hdr_len,
+			 const uint8_t *pld, size_t pld_len, void *arg)
+{
+	struct pktcount *pc = arg;
+	(void)marker;
+	(void)hdr;
+	(void)pld;
+
+	++pc->n;
+	pc->bytes += hdr_len + pld_len;
+	pc->max = max(pc->max, hdr_len + pld_len);
+
+	pc->kbytes += (uint32_t)(pc->bytes / 1024);
+	pc->bytes  %= 1024;
+
+	return 0;
+}
+
+
+static bool is_vcl(uint8_t type)
+{
+	return H264_NAL_SLICE <= type && type <= H264_NAL_IDR_SLICE;
+}
+
+
+/**
+ * Packet count with and without STAP-A aggregation, for a recorded H.264
+ * byte stream. The file is split into access units before an AUD, SPS,
+ * PPS or SEI that follows a slice, and before a slice with first_mb 0.
+ *
+ * @param pf  Print handler
+ * @param arg Not used
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int h264_packetize_bench(struct re_printf *pf, void *arg)
+{
+	struct pktcount single, stap;
+	char path[256] = "";
+	const uint8_t *start, *end, *au, *r;
+	struct mbuf *mb = NULL;
+	uint32_t n_au = 0, n_nal = 0;
+	bool vcl = false;
+	FILE *f = NULL;
+	size_t n;
+	int err = 0;
+	(void)arg;
+
+	memset(&single, 0, sizeof(single));
+	memset(&stap, 0, sizeof(stap));
+
+	if (conf_get_str(conf_cur(), "avcodec_h264_file",
+			 path, sizeof(path))) {
+		return re_hprintf(pf, "H.264 packetizer: set"
+				  " avcodec_h264_file to a byte stream\n");
+	}
+
+	f = fopen(path, "rb");
+	if (!f) {
+		err = errno;
+		goto out;
+	}
+
+	mb = mbuf_alloc(65536);
+	if (!mb) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	do {
+		err = mbuf_resize(mb, mb->end + 65536);
+		if (err)
+			goto out;
+
+		n = fread(mb->buf + mb->end, 1, 65536, f);
+		mb->end += n;
+
+	} while (n == 65536);
+
+	start = mb->buf;
+	end   = mb->buf + mb->end;
+
+	au = r = h264_find_startcode(start, end);
+
+	while (r < end) {
+		const uint8_t *nal = r;
+		uint8_t type;
+
+		while (nal < end && !*nal)
+			++nal;
+		if (++nal >= end)
+			break;
+
+		type = nal[0] & 0x1f;
+
+		/* first_mb_in_slice is ue(v), so 0 is a single 1-bit */
+		if (vcl && ((!is_vcl(type) && type <= H264_NAL_AUD) ||
+			    (is_vcl(type) && nal + 1 < end &&
+			     (nal[1] & 0x80)))) {
+
+			err |= packetize(au, r, BENCH_PKTSZ, false,
+					 count_handler, &single);
+			err |= packetize(au, r, BENCH_PKTSZ, true,
+					 count_handler, &stap);
+			++n_au;
+
+			au  = r;
+			vcl = false;
+		}
+
+		vcl |= is_vcl(type);
+		++n_nal;
+
+		r = h264_find_startcode(nal, end);
+	}
+
+	if (au < end) {
+		err |= packetize(au, end, BENCH_PKTSZ, false,
+				 count_handler, &single);
+		err |= packetize(au, end, BENCH_PKTSZ, true,
+				 count_handler, &stap);
+		++n_au;
+	}
+
+	if (err)
+		goto out;
+
+	(void)re_hprintf(pf, "H.264 packetizer: %s\n"
+			 " %u access units, %u NAL units, packet size %u\n",
+			 path, n_au, n_nal, BENCH_PKTSZ);
+	(void)re_hprintf(pf, " single/FU-A: %8u packets, %u KB,"
+			 " largest %zu\n",
+			 single.n, single.kbytes, single.max);
+	(void)re_hprintf(pf, " STAP-A/FU-A: %8u packets, %u KB,"
+			 " largest %zu\n",
+			 stap.n, stap.kbytes, stap.max);
+	if (single.n) {
+		(void)re_hprintf(pf, " saved %.1f%% of the packets\n",
+				 100.0 * (single.n - stap.n) / single.n);
+	}
+
+ out:
+	if (f)
+		(void)fclose(f);
+	mem_deref(mb);
+
+	if (err)
+		(void)re_hprintf(pf, "H.264 packetizer: %s: %m\n", path, err);
+
+	return err;
+}
@@ -0,0 +1,642 @@
+/**
+ * @file codecbench.c  Codec benchmark
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+
+
+#define DEBUG_MODULE "codecbench"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
+
+#if !defined (M_PI)
+#define M_PI 3.14159265358979323846264338327
+#endif
+
+
+/*
+ * Benchmark of all registered audio and video codecs.
+ *
+ * Every audio codec in aucodec_list() is run at its sampling rate and
+ * channels, and at each packet time in ptimev[]. Every video codec in
+ * vidcodec_list() is run at CIF size. The input is a synthetic signal,
+ * or the samples of a 16-bit WAV file set with "codecbench_wav".
+ *
+ * For each run the encode, decode and PLC time per frame, the encoded
+ * bytes per frame, and the number of memory blocks held by the codec
+ * state and gained during the run are reported, as CSV or JSON. A run
+ * that fails, e.g. a packet time the codec does not support, is reported
+ * with its error code.
+ * The memory blocks are only counted if libre has memory statistics
+ * (MEM_DEBUG), otherwise they are reported as -1.
+ *
+ * Usage without the interactive menu:
+ *
+ *   baresip -e K     (CSV)
+ *   baresip -e J     (JSON)
+ */
+
+
+enum {
+	AUDIO_PKTPAD  = 256,   /**< Packet headroom over PCM [bytes]    */
+	AUDIO_LOOP    = 50,    /**< Number of distinct input frames     */
+	VIDEO_LOOP    = 10,    /**< Number of distinct input pictures   */
+	VIDEO_WIDTH   = 352,
+	VIDEO_HEIGHT  = 288,
+	VIDEO_FPS     = 25,
+};
+
+enum fmt {
+	FMT_CSV,
+	FMT_JSON,
+};
+
+/** Result of one benchmark run */
+struct result {
+	const char *type;      /**< "audio" or "video"               */
+	const char *name;      /**< Codec name                       */
+	char format[32];       /**< Format, e.g. 8000/1/20 or WxH@fps */
+	uint32_t frames;       /**< Number of frames                 */
+	double enc_ns;         /**< Encode time per frame [ns]       */
+	double dec_ns;         /**< Decode time per frame [ns]       */
+	double plc_ns;         /**< PLC time per frame [ns]          */
+	double bytes;          /**< Encoded bytes per frame          */
+	int state_blocks;      /**< Memory blocks held by the state  */
+	int run_blocks;        /**< Memory blocks gained in the run  */
+	int err;               /**< Error code, 0 if success         */
+};
+
+/** Encoded video packets */
+struct vidpkts {
+	struct mbuf *mb;       /**< Length, marker and payload       */
+	uint64_t bytes;        /**< Total payload bytes              */
+};
+
+/** Benchmark output */
+struct bench {
+	struct re_printf *pf;  /**< Print handler                    */
+	enum fmt fmt;          /**< Output format                    */
+	unsigned rows;         /**< Number of rows printed           */
+};
+
+
+static const uint32_t ptimev[] = {10, 20, 30, 40, 60};
+
+static uint32_t nframes = 500;  /**< Frames per run                  */
+static int16_t *wavv;           /**< Samples of the WAV file         */
+static size_t wavc;             /**< Number of samples in WAV file   */
+
+
+static int mem_blocks(void)
+{
+	struct memstat mst;
+
+	if (mem_get_stat(&mst))
+		return -1;
+
+	return (int)mst.blocks_cur;
+}
+
+
+static int blocks_diff(int a, int b)
+{
+	return (a < 0 || b < 0) ? -1 : b - a;
+}
+
+
+/* Minimal RIFF/WAVE reader, 16-bit PCM only */
+static int wav_load(const char *path)
+{
+	uint8_t hdr[12], chunk[8], fmt[16];
+	bool pcm16 = false;
+	FILE *f;
+	int err = 0;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return errno;
+
+	if (1 != fread(hdr, sizeof(hdr), 1, f) ||
+	    memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4)) {
+		err = EBADMSG;
+		goto out;
+	}
+
+	while (1 == fread(chunk, sizeof(chunk), 1, f)) {
+
+		const uint32_t sz = chunk[4] | chunk[5]<<8 |
+			chunk[6]<<16 | (uint32_t)chunk[7]<<24;
+		size_t i;
+
+		if (!memcmp(chunk, "fmt ", 4) && sz >= sizeof(fmt)) {
+
+			if (1 != fread(fmt, sizeof(fmt), 1, f)) {
+				err = EBADMSG;
+				goto out;
+			}
+
+			/* format tag 1 (PCM), 16 bits per sample */
+			pcm16 = (fmt[0] | fmt[1]<<8) == 1 &&
+				(fmt[14] | fmt[15]<<8) == 16;
+
+			if (fseek(f, (long)(sz - sizeof(fmt) + (sz & 1)),
+				  SEEK_CUR)) {
+				err = errno;
+				goto out;
+			}
+		}
+		else if (!memcmp(chunk, "data", 4)) {
+
+			if (!pcm16) {
+				err = ENOTSUP;
+				goto out;
+			}
+
+			wavc = sz / 2;
+			wavv = mem_alloc(wavc * sizeof(*wavv), NULL);
+			if (!wavv) {
+				err = ENOMEM;
+				goto out;
+			}
+
+			wavc = fread(wavv, sizeof(*wavv), wavc, f);
+
+			/* little-endian on the wire */
+			for (i=0; i<wavc; i++) {
+				const uint8_t *p = (uint8_t *)&wavv[i];
+				wavv[i] = (int16_t)(p[0] | p[1]<<8);
+			}
+
+			goto out;
+		}
+		else if (fseek(f, (long)(sz + (sz & 1)), SEEK_CUR)) {
+			err = errno;
+			goto out;
+		}
+	}
+
+	err = EBADMSG;
+
+ out:
+	if (!err && !wavc)
+		err = ENODATA;
+
+	if (err) {
+		wavv = mem_deref(wavv);
+		wavc = 0;
+	}
+
+	(void)fclose(f);
+
+	return err;
+}
+
+
+/* Fill the input with the WAV file, or two tones with a little noise */
+static void audio_input(int16_t *sampv, size_t n, uint32_t srate)
+{
+	size_t i;
+
+	if (wavc) {
+		for (i=0; i<n; i++)
+			sampv[i] = wavv[i % wavc];
+		return;
+	}
+
+	for (i=0; i<n; i++) {
+
+		const double t = (double)i / srate;
+
+		sampv[i] = (int16_t)(8000 * sin(2 * M_PI * 440 * t) +
+				     4000 * sin(2 * M_PI * 1250 * t) +
+				     (int16_t)rand_u16() / 64);
+	}
+}
+
+
+static void audio_run(struct result *res, const struct aucodec *ac,
+		      uint32_t ptime)
+{
+	struct auenc_param prm;
+	struct auenc_state *enc = NULL;
+	struct audec_state *dec = NULL;
+	const size_t sampc = ac->srate * ac->ch * ptime / 1000;
+	const size_t pktsz = sampc * sizeof(int16_t) + AUDIO_PKTPAD;
+	int16_t *inv = NULL, *outv = NULL;
+	uint8_t *pktv = NULL;
+	size_t lenv[AUDIO_LOOP];
+	uint64_t bytes = 0, t;
+	int blk0, blk1;
+	uint32_t i;
+	int err = 0;
+
+	res->type = "audio";
+	res->name = ac->name;
+	(void)re_snprintf(res->format, sizeof(res->format), "%u/%u/%u",
+			  ac->srate, ac->ch, ptime);
+
+	inv  = mem_alloc(AUDIO_LOOP * sampc * sizeof(*inv), NULL);
+	outv = mem_alloc(sampc * sizeof(*outv), NULL);
+	pktv = mem_alloc(AUDIO_LOOP * pktsz, NULL);
+	if (!inv || !outv || !pktv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	audio_input(inv, AUDIO_LOOP * sampc, ac->srate);
+
+	prm.ptime = ptime;
+
+	blk0 = mem_blocks();
+
+	if (ac->encupdh) {
+		err = ac->encupdh(&enc, ac, &prm, ac->fmtp);
+		if (err)
+			goto out;
+	}
+
+	if (ac->decupdh) {
+		err = ac->decupdh(&dec, ac, ac->fmtp);
+		if (err)
+			goto out;
+	}
+
+	blk1 = mem_blocks();
+	res->state_blocks = blocks_diff(blk0, blk1);
+
+	/* Encode */
+	t = realtime_usec();
+
+	for (i=0; i<nframes; i++) {
+
+		const size_t k = i % AUDIO_LOOP;
+
+		lenv[k] = pktsz;
+
+		err = ac->ench(enc, &pktv[k * pktsz], &lenv[k],
+			       &inv[k * sampc], sampc);
+		if (err)
+			goto out;
+
+		bytes += lenv[k];
+	}
+
+	res->enc_ns = (realtime_usec() - t) * 1000.0 / nframes;
+	res->bytes  = (double)bytes / nframes;
+
+	/* Decode, the encoded frames are repeated */
+	t = realtime_usec();
+
+	for (i=0; i<nframes; i++) {
+
+		const size_t k = i % AUDIO_LOOP;
+		size_t outc = sampc;
+
+		err = ac->dech(dec, outv, &outc, &pktv[k * pktsz],
+			       lenv[k]);
+		if (err)
+			goto out;
+	}
+
+	res->dec_ns = (realtime_usec() - t) * 1000.0 / nframes;
+
+	/* Packet loss concealment */
+	if (ac->plch) {
+
+		t = realtime_usec();
+
+		for (i=0; i<nframes; i++) {
+
+			size_t outc = sampc;
+
+			err = ac->plch(dec, outv, &outc);
+			if (err)
+				goto out;
+		}
+
+		res->plc_ns = (realtime_usec() - t) * 1000.0 / nframes;
+	}
+
+	res->frames     = nframes;
+	res->run_blocks = blocks_diff(blk1, mem_blocks());
+
+ out:
+	mem_deref(dec);
+	mem_deref(enc);
+	mem_deref(pktv);
+	mem_deref(outv);
+	mem_deref(inv);
+
+	res->err = err;
+}
+
+
+/* A moving gradient with a moving box, so that there is motion */
+static void video_input(struct vidframe *f, unsigned n)
+{
+	unsigned x, y;
+
+	for (y=0; y<f->size.h; y++) {
+
+		uint8_t *p = f->data[0] + y * f->linesize[0];
+
+		for (x=0; x<f->size.w; x++) {
+
+			const bool box = (x + 4*n) % f->size.w < 64 &&
+				(y + 2*n) % f->size.h < 64;
+
+			p[x] = box ? 235 : (uint8_t)(x + y + 3*n);
+		}
+	}
+
+	for (y=0; y<f->size.h/2; y++) {
+
+		memset(f->data[1] + y * f->linesize[1], 128 + n, f->size.w/2);
+		memset(f->data[2] + y * f->linesize[2], 128 - n, f->size.w/2);
+	}
+}
+
+
+/* Encoded packets are stored as: length (2), marker (1), payload */
+static int packet_handler(bool marker, const uint8_t *hdr, size_t hdr_len,
+			  const uint8_t *pld, size_t pld_len, void *arg)
+{
+	struct vidpkts *pkts = arg;
+	struct mbuf *mb = pkts->mb;
+	int err = 0;
+
+	err |= mbuf_write_u16(mb, (uint16_t)(hdr_len + pld_len));
+	err |= mbuf_write_u8(mb, marker);
+	err |= mbuf_write_mem(mb, hdr, hdr_len);
+	err |= mbuf_write_mem(mb, pld, pld_len);
+
+	pkts->bytes += hdr_len + pld_len;
+
+	return err;
+}
+
+
+static void video_run(struct result *res, const struct vidcodec *vc)
+{
+	struct videnc_param prm;
+	struct videnc_state *enc = NULL;
+	struct viddec_state *dec = NULL;
+	struct vidframe *inv[VIDEO_LOOP] = {NULL};
+	struct vidpkts pkts = {NULL, 0};
+	struct mbuf *mb = NULL;
+	const struct vidsz sz = {VIDEO_WIDTH, VIDEO_HEIGHT};
+	uint16_t seq = 0;
+	uint64_t t;
+	int blk0, blk1;
+	uint32_t i;
+	int err = 0;
+
+	res->type = "video";
+	res->name = vc->name;
+	(void)re_snprintf(res->format, sizeof(res->format), "%ux%u@%u",
+			  sz.w, sz.h, VIDEO_FPS);
+
+	pkts.mb = mbuf_alloc(1024 * 1024);
+	mb      = mbuf_alloc(2048);
+	if (!pkts.mb || !mb) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i=0; i<VIDEO_LOOP; i++) {
+
+		err = vidframe_alloc(&inv[i], VID_FMT_YUV420P, &sz);
+		if (err)
+			goto out;
+
+		video_input(inv[i], i);
+	}
+
+	prm.bitrate = 512000;
+	prm.pktsize = 1300;
+	prm.fps     = VIDEO_FPS;
+	prm.max_fs  = -1;
+
+	blk0 = mem_blocks();
+
+	err = vc->encupdh(&enc, vc, &prm, vc->fmtp);
+	if (err)
+		goto out;
+
+	err = vc->decupdh(&dec, vc, vc->fmtp);
+	if (err)
+		goto out;
+
+	blk1 = mem_blocks();
+	res->state_blocks = blocks_diff(blk0, blk1);
+
+	/* Encode */
+	t = realtime_usec();
+
+	for (i=0; i<nframes; i++) {
+
+		err = vc->ench(enc, i == 0, inv[i % VIDEO_LOOP],
+			       packet_handler, &pkts);
+		if (err)
+			goto out;
+	}
+
+	res->enc_ns = (realtime_usec() - t) * 1000.0 / nframes;
+	res->bytes  = (double)pkts.bytes / nframes;
+
+	/* Decode */
+	pkts.mb->pos = 0;
+	t = realtime_usec();
+
+	while (mbuf_get_left(pkts.mb) >= 3) {
+
+		struct vidframe frame;
+		const size_t len = mbuf_read_u16(pkts.mb);
+		const bool marker = mbuf_read_u8(pkts.mb);
+
+		if (mbuf_get_left(pkts.mb) < len)
+			break;
+
+		mb->pos = mb->end = 0;
+		(void)mbuf_write_mem(mb, mbuf_buf(pkts.mb), len);
+		mb->pos = 0;
+		mbuf_advance(pkts.mb, len);
+
+		memset(&frame, 0, sizeof(frame));
+
+		err = vc->dech(dec, &frame, marker, seq++, mb);
+		if (err)
+			goto out;
+	}
+
+	res->dec_ns = (realtime_usec() - t) * 1000.0 / nframes;
+
+	res->frames     = nframes;
+	res->run_blocks = blocks_diff(blk1, mem_blocks());
+
+ out:
+	mem_deref(dec);
+	mem_deref(enc);
+	for (i=0; i<VIDEO_LOOP; i++)
+		mem_deref(inv[i]);
+	mem_deref(mb);
+	mem_deref(pkts.mb);
+
+	res->err = err;
+}
+
+
+static int print_result(struct bench *b, const struct result *res)
+{
+	int err = 0;
+
+	if (b->fmt == FMT_CSV) {
+
+		if (!b->rows) {
+			err |= re_hprintf(b->pf, "type,codec,format,frames,"
+					  "enc_ns,dec_ns,plc_ns,bytes,"
+					  "state_blocks,run_blocks,error\n");
+		}
+
+		err |= re_hprintf(b->pf, "%s,%s,%s,%u,%.0f,%.0f,%.0f,%.1f,"
+				  "%d,%d,%d\n",
+				  res->type, res->name, res->format,
+				  res->frames,
+				  res->enc_ns, res->dec_ns, res->plc_ns,
+				  res->bytes,
+				  res->state_blocks, res->run_blocks,
+				  res->err);
+	}
+	else {
+		err |= re_hprintf(b->pf, "%s\n  {\"type\":\"%s\","
+				  "\"codec\":\"%s\",\"format\":\"%s\","
+				  "\"frames\":%u,"
+				  "\"enc_ns\":%.0f,\"dec_ns\":%.0f,"
+				  "\"plc_ns\":%.0f,\"bytes\":%.1f,"
+				  "\"state_blocks\":%d,\"run_blocks\":%d,"
+				  "\"error\":%d}",
+				  b->rows ? "," : "[",
+				  res->type, res->name, res->format,
+				  res->frames,
+				  res->enc_ns, res->dec_ns, res->plc_ns,
+				  res->bytes,
+				  res->state_blocks, res->run_blocks,
+				  res->err);
+	}
+
+	++b->rows;
+
+	return err;
+}
+
+
+static int bench_run(struct re_printf *pf, enum fmt fmt)
+{
+	struct bench b;
+	struct le *le;
+	size_t i;
+	int err = 0;
+
+	b.pf   = pf;
+	b.fmt  = fmt;
+	b.rows = 0;
+
+	for (le = list_head(aucodec_list()); le; le = le->next) {
+
+		const struct aucodec *ac = le->data;
+
+		for (i=0; i<ARRAY_SIZE(ptimev); i++) {
+
+			struct result res;
+
+			memset(&res, 0, sizeof(res));
+			audio_run(&res, ac, ptimev[i]);
+
+			err |= print_result(&b, &res);
+		}
+	}
+
+	for (le = list_head(vidcodec_list()); le; le = le->next) {
+
+		const struct vidcodec *vc = le->data;
+		struct result res;
+
+		memset(&res, 0, sizeof(res));
+		video_run(&res, vc);
+
+		err |= print_result(&b, &res);
+	}
+
+	if (fmt == FMT_JSON)
+		err |= re_hprintf(pf, "%s\n", b.rows ? "\n]" : "[]");
+
+	return err;
+}
+
+
+static int bench_csv(struct re_printf *pf, void *unused)
+{
+	(void)unused;
+	return bench_run(pf, FMT_CSV);
+}
+
+
+static int bench_json(struct re_printf *pf, void *unused)
+{
+	(void)unused;
+	return bench_run(pf, FMT_JSON);
+}
+
+
+static const struct cmd cmdv[] = {
+	{'K', 0, "Codec benchmark (CSV)",  bench_csv  },
+	{'J', 0, "Codec benchmark (JSON)", bench_json },
+};
+
+
+static int module_init(void)
+{
+	char path[256] = "";
+	int err;
+
+	(void)conf_get_u32(conf_cur(), "codecbench_frames", &nframes);
+	nframes = max(nframes, 1);
+
+	if (0 == conf_get_str(conf_cur(), "codecbench_wav",
+			      path, sizeof(path))) {
+
+		err = wav_load(path);
+		if (err) {
+			DEBUG_WARNING("%s: %m\n", path, err);
+			return err;
+		}
+	}
+
+	return cmd_register(cmdv, ARRAY_SIZE(cmdv));
+}
+
+
+static int module_close(void)
+{
+	cmd_unregister(cmdv);
+	wavv = mem_deref(wavv);
+	wavc = 0;
+
+	return 0;
+}
+
+
+EXPORT_SYM const struct mod_export DECL_EXPORTS(codecbench) = {
+	"codecbench",
+	"application",
+	module_init,
+	module_close,
+};
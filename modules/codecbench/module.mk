@@ -0,0 +1,11 @@
+#
+# module.mk
+#
+# Copyright (C) 2010 Creytiv.com
+#
+
+MOD		:= codecbench
+$(MOD)_SRCS	+= codecbench.c
+$(MOD)_LFLAGS	+= -lm
+
+include mk/mod.mk
@@ -8,6 +8,457 @@
 #include <rem.h>
 #include <baresip.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+	(__GNUC__ >= 5 || defined(__clang__))
+#define G711_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define G711_NEON 1
+#include <arm_neon.h>
+#endif
+
+
+#define DEBUG_MODULE "g711"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
+
+/*
+ * The encoder works on blocks of samples. The segment (exponent) of each
+ * sample is found by counting how many segment boundaries it exceeds, and
+ * the mantissa is extracted by a multiply with 2^(15-shift), which lets
+ * the SIMD kernels shift every lane by a different amount.
+ *
+ * The decoder uses 256-entry tables, built from the librem reference
+ * functions.
+ *
+ * When the module is loaded, every encoder kernel is checked bit-exact
+ * against the reference for all 65536 input values. If no kernel matches,
+ * the encoder falls back to 64K-entry tables built from the reference.
+ */
+
+
+/** Defines a set of encoder kernels */
+struct g711_kernel {
+	const char *name;
+	bool (*supported)(void);
+	void (*ulaw)(uint8_t *dst, const int16_t *src, size_t n);
+	void (*alaw)(uint8_t *dst, const int16_t *src, size_t n);
+};
+
+
+static int16_t ulaw_dec[256];        /**< u-law to linear               */
+static int16_t alaw_dec[256];        /**< A-law to linear               */
+static uint8_t *ulaw_enc;            /**< Linear to u-law (fallback)    */
+static uint8_t *alaw_enc;            /**< Linear to A-law (fallback)    */
+static const struct g711_kernel *kern; /**< Selected encoder kernel     */
+static uint32_t rejected;            /**< Kernels not bit-exact, bits   */
+
+
+/* Segment boundaries of the biased 14-bit u-law magnitude */
+static const int16_t ulaw_thrv[7] = {
+	0x3f, 0x7f, 0xff, 0x1ff, 0x3ff, 0x7ff, 0xfff
+};
+
+/* Segment boundaries of the 12-bit A-law magnitude */
+static const int16_t alaw_thrv[7] = {
+	0x0f, 0x1f, 0x3f, 0x7f, 0xff, 0x1ff, 0x3ff
+};
+
+
+/* Scalar kernels */
+
+static bool supported_c(void)
+{
+	return true;
+}
+
+
+static inline uint8_t ulaw_c(int16_t x)
+{
+	const int16_t s = x >> 15;
+	int a = ((x ^ s) >> 2) + 33;
+	int seg = 0;
+
+	if (a > 0x1fff)
+		a = 0x1fff;
+
+	while (seg < 7 && a > ulaw_thrv[seg])
+		++seg;
+
+	return (uint8_t)(((seg << 4) | ((a >> (seg + 1)) & 0xf)) ^
+			 (0xff ^ (s & 0x80)));
+}
+
+
+static inline uint8_t alaw_c(int16_t x)
+{
+	const int16_t s = x >> 15;
+	const int a = (x ^ s) >> 4;
+	int seg = 0;
+
+	while (seg < 7 && a > alaw_thrv[seg])
+		++seg;
+
+	return (uint8_t)(((seg << 4) | ((a >> (seg ? seg - 1 : 0)) & 0xf)) ^
+			 (0xd5 ^ (s & 0x80)));
+}
+
+
+static void ulaw_enc_c(uint8_t *dst, const int16_t *src, size_t n)
+{
+	while (n--)
+		*dst++ = ulaw_c(*src++);
+}
+
+
+static void alaw_enc_c(uint8_t *dst, const int16_t *src, size_t n)
+{
+	while (n--)
+		*dst++ = alaw_c(*src++);
+}
+
+
+static bool supported_lut(void)
+{
+	return ulaw_enc && alaw_enc;
+}
+
+
+static void ulaw_enc_lut(uint8_t *dst, const int16_t *src, size_t n)
+{
+	while (n--)
+		*dst++ = ulaw_enc[(uint16_t)*src++];
+}
+
+
+static void alaw_enc_lut(uint8_t *dst, const int16_t *src, size_t n)
+{
+	while (n--)
+		*dst++ = alaw_enc[(uint16_t)*src++];
+}
+
+
+#ifdef G711_X86
+
+static bool supported_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+
+static bool supported_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+
+/* Add one to the segment and halve the multiplier where a > t */
+__attribute__((target("sse2")))
+static inline void seg_sse2(__m128i *seg, __m128i *mul, __m128i a, short t)
+{
+	const __m128i m = _mm_cmpgt_epi16(a, _mm_set1_epi16(t));
+
+	*seg = _mm_sub_epi16(*seg, m);
+	*mul = _mm_sub_epi16(*mul, _mm_and_si128(m, _mm_srli_epi16(*mul, 1)));
+}
+
+
+__attribute__((target("sse2")))
+static inline __m128i ulaw_sse2(__m128i x)
+{
+	const __m128i s = _mm_srai_epi16(x, 15);
+	__m128i a, seg, mul, v;
+	size_t i;
+
+	a = _mm_add_epi16(_mm_srai_epi16(_mm_xor_si128(x, s), 2),
+			  _mm_set1_epi16(33));
+	a = _mm_min_epi16(a, _mm_set1_epi16(0x1fff));
+
+	seg = _mm_setzero_si128();
+	mul = _mm_set1_epi16((short)0x8000);
+
+	for (i=0; i<ARRAY_SIZE(ulaw_thrv); i++)
+		seg_sse2(&seg, &mul, a, ulaw_thrv[i]);
+
+	v = _mm_and_si128(_mm_mulhi_epu16(a, mul), _mm_set1_epi16(0xf));
+	v = _mm_or_si128(v, _mm_slli_epi16(seg, 4));
+
+	return _mm_xor_si128(v, _mm_xor_si128(_mm_set1_epi16(0xff),
+				 _mm_and_si128(s, _mm_set1_epi16(0x80))));
+}
+
+
+__attribute__((target("sse2")))
+static inline __m128i alaw_sse2(__m128i x)
+{
+	const __m128i s = _mm_srai_epi16(x, 15);
+	__m128i a, seg, mul, v;
+	size_t i;
+
+	a = _mm_srai_epi16(_mm_xor_si128(x, s), 4);
+
+	seg = _mm_cmpgt_epi16(a, _mm_set1_epi16(alaw_thrv[0]));
+	seg = _mm_sub_epi16(_mm_setzero_si128(), seg);
+	mul = _mm_set1_epi16((short)0x8000);
+
+	for (i=1; i<ARRAY_SIZE(alaw_thrv); i++)
+		seg_sse2(&seg, &mul, a, alaw_thrv[i]);
+
+	v = _mm_mulhi_epu16(_mm_slli_epi16(a, 1), mul);
+	v = _mm_and_si128(v, _mm_set1_epi16(0xf));
+	v = _mm_or_si128(v, _mm_slli_epi16(seg, 4));
+
+	return _mm_xor_si128(v, _mm_xor_si128(_mm_set1_epi16(0xd5),
+				 _mm_and_si128(s, _mm_set1_epi16(0x80))));
+}
+
+
+__attribute__((target("sse2")))
+static void ulaw_enc_sse2(uint8_t *dst, const int16_t *src, size_t n)
+{
+	for (; n >= 16; n -= 16, src += 16, dst += 16) {
+
+		const __m128i lo = _mm_loadu_si128((const __m128i *)src);
+		const __m128i hi = _mm_loadu_si128((const __m128i *)(src+8));
+
+		_mm_storeu_si128((__m128i *)dst,
+				 _mm_packus_epi16(ulaw_sse2(lo),
+						  ulaw_sse2(hi)));
+	}
+
+	ulaw_enc_c(dst, src, n);
+}
+
+
+__attribute__((target("sse2")))
+static void alaw_enc_sse2(uint8_t *dst, const int16_t *src, size_t n)
+{
+	for (; n >= 16; n -= 16, src += 16, dst += 16) {
+
+		const __m128i lo = _mm_loadu_si128((const __m128i *)src);
+		const __m128i hi = _mm_loadu_si128((const __m128i *)(src+8));
+
+		_mm_storeu_si128((__m128i *)dst,
+				 _mm_packus_epi16(alaw_sse2(lo),
+						  alaw_sse2(hi)));
+	}
+
+	alaw_enc_c(dst, src, n);
+}
+
+
+__attribute__((target("avx2")))
+static inline void seg_avx2(__m256i *seg, __m256i *mul, __m256i a, short t)
+{
+	const __m256i m = _mm256_cmpgt_epi16(a, _mm256_set1_epi16(t));
+
+	*seg = _mm256_sub_epi16(*seg, m);
+	*mul = _mm256_sub_epi16(*mul, _mm256_and_si256(m,
+						 _mm256_srli_epi16(*mul, 1)));
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256i ulaw_avx2(__m256i x)
+{
+	const __m256i s = _mm256_srai_epi16(x, 15);
+	__m256i a, seg, mul, v;
+	size_t i;
+
+	a = _mm256_add_epi16(_mm256_srai_epi16(_mm256_xor_si256(x, s), 2),
+			     _mm256_set1_epi16(33));
+	a = _mm256_min_epi16(a, _mm256_set1_epi16(0x1fff));
+
+	seg = _mm256_setzero_si256();
+	mul = _mm256_set1_epi16((short)0x8000);
+
+	for (i=0; i<ARRAY_SIZE(ulaw_thrv); i++)
+		seg_avx2(&seg, &mul, a, ulaw_thrv[i]);
+
+	v = _mm256_and_si256(_mm256_mulhi_epu16(a, mul),
+			     _mm256_set1_epi16(0xf));
+	v = _mm256_or_si256(v, _mm256_slli_epi16(seg, 4));
+
+	return _mm256_xor_si256(v, _mm256_xor_si256(_mm256_set1_epi16(0xff),
+				_mm256_and_si256(s, _mm256_set1_epi16(0x80))));
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256i alaw_avx2(__m256i x)
+{
+	const __m256i s = _mm256_srai_epi16(x, 15);
+	__m256i a, seg, mul, v;
+	size_t i;
+
+	a = _mm256_srai_epi16(_mm256_xor_si256(x, s), 4);
+
+	seg = _mm256_cmpgt_epi16(a, _mm256_set1_epi16(alaw_thrv[0]));
+	seg = _mm256_sub_epi16(_mm256_setzero_si256(), seg);
+	mul = _mm256_set1_epi16((short)0x8000);
+
+	for (i=1; i<ARRAY_SIZE(alaw_thrv); i++)
+		seg_avx2(&seg, &mul, a, alaw_thrv[i]);
+
+	v = _mm256_mulhi_epu16(_mm256_slli_epi16(a, 1), mul);
+	v = _mm256_and_si256(v, _mm256_set1_epi16(0xf));
+	v = _mm256_or_si256(v, _mm256_slli_epi16(seg, 4));
+
+	return _mm256_xor_si256(v, _mm256_xor_si256(_mm256_set1_epi16(0xd5),
+				_mm256_and_si256(s, _mm256_set1_epi16(0x80))));
+}
+
+
+/* packus works per 128-bit lane, so the quadwords are put back in order */
+__attribute__((target("avx2")))
+static inline __m256i pack_avx2(__m256i lo, __m256i hi)
+{
+	return _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8);
+}
+
+
+__attribute__((target("avx2")))
+static void ulaw_enc_avx2(uint8_t *dst, const int16_t *src, size_t n)
+{
+	for (; n >= 32; n -= 32, src += 32, dst += 32) {
+
+		const __m256i lo = _mm256_loadu_si256((const __m256i *)src);
+		const __m256i hi = _mm256_loadu_si256((const __m256i *)
+						      (src + 16));
+
+		_mm256_storeu_si256((__m256i *)dst,
+				    pack_avx2(ulaw_avx2(lo), ulaw_avx2(hi)));
+	}
+
+	ulaw_enc_sse2(dst, src, n);
+}
+
+
+__attribute__((target("avx2")))
+static void alaw_enc_avx2(uint8_t *dst, const int16_t *src, size_t n)
+{
+	for (; n >= 32; n -= 32, src += 32, dst += 32) {
+
+		const __m256i lo = _mm256_loadu_si256((const __m256i *)src);
+		const __m256i hi = _mm256_loadu_si256((const __m256i *)
+						      (src + 16));
+
+		_mm256_storeu_si256((__m256i *)dst,
+				    pack_avx2(alaw_avx2(lo), alaw_avx2(hi)));
+	}
+
+	alaw_enc_sse2(dst, src, n);
+}
+
+#endif
+
+
+#ifdef G711_NEON
+
+/* NEON has per-lane shifts, so the segment gives the shift directly */
+static inline uint8x8_t ulaw_neon(int16x8_t x)
+{
+	const int16x8_t s = vshrq_n_s16(x, 15);
+	int16x8_t a, seg, v;
+	size_t i;
+
+	a = vaddq_s16(vshrq_n_s16(veorq_s16(x, s), 2), vdupq_n_s16(33));
+	a = vminq_s16(a, vdupq_n_s16(0x1fff));
+
+	seg = vdupq_n_s16(0);
+	for (i=0; i<ARRAY_SIZE(ulaw_thrv); i++) {
+		seg = vsubq_s16(seg, vreinterpretq_s16_u16(
+				vcgtq_s16(a, vdupq_n_s16(ulaw_thrv[i]))));
+	}
+
+	v = vshlq_s16(a, vnegq_s16(vaddq_s16(seg, vdupq_n_s16(1))));
+	v = vandq_s16(v, vdupq_n_s16(0xf));
+	v = vorrq_s16(v, vshlq_n_s16(seg, 4));
+	v = veorq_s16(v, veorq_s16(vdupq_n_s16(0xff),
+				   vandq_s16(s, vdupq_n_s16(0x80))));
+
+	return vmovn_u16(vreinterpretq_u16_s16(v));
+}
+
+
+static inline uint8x8_t alaw_neon(int16x8_t x)
+{
+	const int16x8_t s = vshrq_n_s16(x, 15);
+	int16x8_t a, seg, sh, v;
+	size_t i;
+
+	a = vshrq_n_s16(veorq_s16(x, s), 4);
+
+	seg = vdupq_n_s16(0);
+	for (i=0; i<ARRAY_SIZE(alaw_thrv); i++) {
+		seg = vsubq_s16(seg, vreinterpretq_s16_u16(
+				vcgtq_s16(a, vdupq_n_s16(alaw_thrv[i]))));
+	}
+
+	sh = vmaxq_s16(vsubq_s16(seg, vdupq_n_s16(1)), vdupq_n_s16(0));
+
+	v = vandq_s16(vshlq_s16(a, vnegq_s16(sh)), vdupq_n_s16(0xf));
+	v = vorrq_s16(v, vshlq_n_s16(seg, 4));
+	v = veorq_s16(v, veorq_s16(vdupq_n_s16(0xd5),
+				   vandq_s16(s, vdupq_n_s16(0x80))));
+
+	return vmovn_u16(vreinterpretq_u16_s16(v));
+}
+
+
+static void ulaw_enc_neon(uint8_t *dst, const int16_t *src, size_t n)
+{
+	for (; n >= 8; n -= 8, src += 8, dst += 8)
+		vst1_u8(dst, ulaw_neon(vld1q_s16(src)));
+
+	ulaw_enc_c(dst, src, n);
+}
+
+
+static void alaw_enc_neon(uint8_t *dst, const int16_t *src, size_t n)
+{
+	for (; n >= 8; n -= 8, src += 8, dst += 8)
+		vst1_u8(dst, alaw_neon(vld1q_s16(src)));
+
+	alaw_enc_c(dst, src, n);
+}
+
+#endif
+
+
+/* In order of preference */
+static const struct g711_kernel kernelv[] = {
+#ifdef G711_X86
+	{"avx2", supported_avx2, ulaw_enc_avx2, alaw_enc_avx2},
+	{"sse2", supported_sse2, ulaw_enc_sse2, alaw_enc_sse2},
+#endif
+#ifdef G711_NEON
+	{"neon", supported_c,    ulaw_enc_neon, alaw_enc_neon},
+#endif
+	{"c",    supported_c,    ulaw_enc_c,    alaw_enc_c},
+	{"lut",  supported_lut,  ulaw_enc_lut,  alaw_enc_lut},
+};
+
+
+static void decode(int16_t *sampv, const uint8_t *buf, size_t n,
+		   const int16_t *tab)
+{
+	for (; n >= 4; n -= 4, sampv += 4, buf += 4) {
+		sampv[0] = tab[buf[0]];
+		sampv[1] = tab[buf[1]];
+		sampv[2] = tab[buf[2]];
+		sampv[3] = tab[buf[3]];
+	}
+
+	while (n--)
+		*sampv++ = tab[*buf++];
+}
+
 
 static int pcmu_encode(struct auenc_state *aes, uint8_t *buf,
 		       size_t *len, const int16_t *sampv, size_t sampc)
@@ -22,8 +473,7 @@ static int pcmu_encode(struct auenc_state *aes, uint8_t *buf,
 
 	*len = sampc;
 
-	while (sampc--)
-		*buf++ = g711_pcm2ulaw(*sampv++);
+	kern->ulaw(buf, sampv, sampc);
 
 	return 0;
 }
@@ -42,8 +492,7 @@ static int pcmu_decode(struct audec_state *ads, int16_t *sampv,
 
 	*sampc = len;
 
-	while (len--)
-		*sampv++ = g711_ulaw2pcm(*buf++);
+	decode(sampv, buf, len, ulaw_dec);
 
 	return 0;
 }
@@ -62,8 +511,7 @@ static int pcma_encode(struct auenc_state *aes, uint8_t *buf,
 
 	*len = sampc;
 
-	while (sampc--)
-		*buf++ = g711_pcm2alaw(*sampv++);
+	kern->alaw(buf, sampv, sampc);
 
 	return 0;
 }
@@ -82,8 +530,7 @@ static int pcma_decode(struct audec_state *ads, int16_t *sampv,
 
 	*sampc = len;
 
-	while (len--)
-		*sampv++ = g711_alaw2pcm(*buf++);
+	decode(sampv, buf, len, alaw_dec);
 
 	return 0;
 }
@@ -100,20 +547,216 @@ static struct aucodec pcma = {
 };
 
 
+/* Check an encoder kernel bit-exact against the reference, all inputs */
+static bool kernel_check(const struct g711_kernel *k, int16_t *inv,
+			 uint8_t *outv)
+{
+	uint32_t i;
+
+	k->ulaw(outv, inv, 65536);
+	for (i=0; i<65536; i++) {
+		if (outv[i] != g711_pcm2ulaw(inv[i])) {
+			DEBUG_WARNING("%s: u-law mismatch at %d,"
+				      " kernel rejected\n", k->name, inv[i]);
+			return false;
+		}
+	}
+
+	k->alaw(outv, inv, 65536);
+	for (i=0; i<65536; i++) {
+		if (outv[i] != g711_pcm2alaw(inv[i])) {
+			DEBUG_WARNING("%s: A-law mismatch at %d,"
+				      " kernel rejected\n", k->name, inv[i]);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+static int kernel_select(void)
+{
+	int16_t *inv;
+	uint8_t *outv;
+	uint32_t i;
+	int err = 0;
+
+	kern     = NULL;
+	rejected = 0;
+
+	for (i=0; i<256; i++) {
+		ulaw_dec[i] = g711_ulaw2pcm(i);
+		alaw_dec[i] = g711_alaw2pcm(i);
+	}
+
+	inv  = mem_alloc(65536 * sizeof(*inv), NULL);
+	outv = mem_alloc(65536, NULL);
+	if (!inv || !outv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i=0; i<65536; i++)
+		inv[i] = (int16_t)(i - 32768);
+
+	for (i=0; i<ARRAY_SIZE(kernelv); i++) {
+
+		const struct g711_kernel *k = &kernelv[i];
+
+		if (!k->supported())
+			continue;
+
+		/* all kernels are checked, to report the rejected ones */
+		if (!kernel_check(k, inv, outv))
+			rejected |= 1u << i;
+		else if (!kern)
+			kern = k;
+	}
+
+	if (kern)
+		goto out;
+
+	/* no kernel matches the reference, use tables */
+	ulaw_enc = mem_alloc(65536, NULL);
+	alaw_enc = mem_alloc(65536, NULL);
+	if (!ulaw_enc || !alaw_enc) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i=0; i<65536; i++) {
+		ulaw_enc[i] = g711_pcm2ulaw((int16_t)i);
+		alaw_enc[i] = g711_pcm2alaw((int16_t)i);
+	}
+
+	kern = &kernelv[ARRAY_SIZE(kernelv) - 1];
+
+ out:
+	mem_deref(outv);
+	mem_deref(inv);
+
+	return err;
+}
+
+
+static int bench_kernel(struct re_printf *pf, const struct g711_kernel *k)
+{
+	static int16_t inv[160];
+	static uint8_t outv[160];
+	uint64_t start, t;
+	uint64_t nsamp = 0;
+	size_t i;
+	int err = 0;
+
+	for (i=0; i<ARRAY_SIZE(inv); i++)
+		inv[i] = rand_u16();
+
+	start = tmr_jiffies();
+
+	do {
+		for (i=0; i<1000; i++) {
+			k->ulaw(outv, inv, ARRAY_SIZE(inv));
+			k->alaw(outv, inv, ARRAY_SIZE(inv));
+		}
+
+		nsamp += 2 * 1000 * ARRAY_SIZE(inv);
+		t = tmr_jiffies() - start;
+
+	} while (t < 100);
+
+	err |= re_hprintf(pf, " encode %-5s %6.2f ns/sample\n",
+			  k->name, t * 1e6 / (double)nsamp);
+
+	return err;
+}
+
+
+/* Throughput of all encoder kernels supported by the CPU, and decoder */
+static int g711_bench(struct re_printf *pf, void *unused)
+{
+	static int16_t sampv[160];
+	static uint8_t buf[160];
+	uint64_t start, t;
+	uint64_t nsamp = 0;
+	size_t i;
+	int err = 0;
+	(void)unused;
+
+	err |= re_hprintf(pf, "G.711 benchmark (selected kernel: %s)\n",
+			  kern->name);
+
+	for (i=0; i<ARRAY_SIZE(kernelv); i++) {
+
+		const struct g711_kernel *k = &kernelv[i];
+
+		if (!k->supported())
+			continue;
+
+		if (rejected & (1u << i)) {
+			err |= re_hprintf(pf, " encode %-5s rejected,"
+					  " not bit-exact\n", k->name);
+			continue;
+		}
+
+		err |= bench_kernel(pf, k);
+	}
+
+	for (i=0; i<ARRAY_SIZE(buf); i++)
+		buf[i] = rand_u16();
+
+	start = tmr_jiffies();
+
+	do {
+		for (i=0; i<1000; i++) {
+			decode(sampv, buf, ARRAY_SIZE(buf), ulaw_dec);
+			decode(sampv, buf, ARRAY_SIZE(buf), alaw_dec);
+		}
+
+		nsamp += 2 * 1000 * ARRAY_SIZE(buf);
+		t = tmr_jiffies() - start;
+
+	} while (t < 100);
+
+	err |= re_hprintf(pf, " decode %-5s %6.2f ns/sample\n",
+			  "table", t * 1e6 / (double)nsamp);
+
+	return err;
+}
+
+
+static const struct cmd cmdv[] = {
+	{'G', 0, "G.711 benchmark", g711_bench },
+};
+
+
 static int module_init(void)
 {
+	int err;
+
+	err = kernel_select();
+	if (err)
+		return err;
+
+	DEBUG_INFO("using %s encoder\n", kern->name);
+
 	aucodec_register(&pcmu);
 	aucodec_register(&pcma);
 
-	return 0;
+	return cmd_register(cmdv, ARRAY_SIZE(cmdv));
 }
 
 
 static int module_close(void)
 {
+	cmd_unregister(cmdv);
+
 	aucodec_unregister(&pcma);
 	aucodec_unregister(&pcmu);
 
+	ulaw_enc = mem_deref(ulaw_enc);
+	alaw_enc = mem_deref(alaw_enc);
+
 	return 0;
 }
 
@@ -3,9 +3,26 @@
  *
  * Copyright (C) 2010 Creytiv.com
  */
+#include <string.h>
 #include <re.h>
 #include <baresip.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+	(__GNUC__ >= 5 || defined(__clang__))
+#define L16_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define L16_NEON 1
+#include <arm_neon.h>
+#endif
+
+
+#define DEBUG_MODULE "l16"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
 
 enum {NR_CODECS = 8};
 
@@ -15,11 +32,123 @@ struct aucodec_st {
 };
 
 
+/** Defines a byte-swap kernel, n is the number of samples */
+struct l16_kernel {
+	const char *name;
+	bool (*supported)(void);
+	void (*swap)(uint8_t *dst, const uint8_t *src, size_t n);
+};
+
+
+static const struct l16_kernel *kern;  /**< Selected byte-swap kernel */
+static uint32_t rejected;              /**< Kernels failing selftest  */
+
+
+/* The payload is not aligned, so the scalar kernel works on bytes */
+static void swap_c(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	while (n--) {
+		const uint8_t b = src[0];
+
+		dst[0] = src[1];
+		dst[1] = b;
+
+		dst += 2;
+		src += 2;
+	}
+}
+
+
+static bool supported_c(void)
+{
+	return true;
+}
+
+
+#ifdef L16_X86
+
+static bool supported_ssse3(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+}
+
+
+static bool supported_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+
+__attribute__((target("ssse3")))
+static void swap_ssse3(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const __m128i shuf = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+					   9, 8, 11, 10, 13, 12, 15, 14);
+
+	for (; n >= 8; n -= 8, src += 16, dst += 16) {
+
+		const __m128i v = _mm_loadu_si128((const __m128i *)src);
+
+		_mm_storeu_si128((__m128i *)dst, _mm_shuffle_epi8(v, shuf));
+	}
+
+	swap_c(dst, src, n);
+}
+
+
+__attribute__((target("avx2")))
+static void swap_avx2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const __m256i shuf = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+					      9, 8, 11, 10, 13, 12, 15, 14,
+					      1, 0, 3, 2, 5, 4, 7, 6,
+					      9, 8, 11, 10, 13, 12, 15, 14);
+
+	for (; n >= 16; n -= 16, src += 32, dst += 32) {
+
+		const __m256i v = _mm256_loadu_si256((const __m256i *)src);
+
+		_mm256_storeu_si256((__m256i *)dst,
+				    _mm256_shuffle_epi8(v, shuf));
+	}
+
+	swap_ssse3(dst, src, n);
+}
+
+#endif
+
+
+#ifdef L16_NEON
+
+static void swap_neon(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	for (; n >= 8; n -= 8, src += 16, dst += 16)
+		vst1q_u8(dst, vrev16q_u8(vld1q_u8(src)));
+
+	swap_c(dst, src, n);
+}
+
+#endif
+
+
+/* In order of preference */
+static const struct l16_kernel kernelv[] = {
+#ifdef L16_X86
+	{"avx2",  supported_avx2,  swap_avx2},
+	{"ssse3", supported_ssse3, swap_ssse3},
+#endif
+#ifdef L16_NEON
+	{"neon",  supported_c,     swap_neon},
+#endif
+	{"c",     supported_c,     swap_c},
+};
+
+
 static int encode(struct auenc_state *st, uint8_t *buf, size_t *len,
 		  const int16_t *sampv, size_t sampc)
 {
-	int16_t *p = (void *)buf;
-
 	(void)st;
 
 	if (sampc*2 > *len)
@@ -27,8 +156,10 @@ static int encode(struct auenc_state *st, uint8_t *buf, size_t *len,
 
 	*len = sampc*2;
 
-	while (sampc--)
-		*p++ = htons(*sampv++);
+	if (ntohs(1) == 1)
+		memcpy(buf, sampv, sampc*2);
+	else
+		kern->swap(buf, (const uint8_t *)sampv, sampc);
 
 	return 0;
 }
@@ -37,8 +168,6 @@ static int encode(struct auenc_state *st, uint8_t *buf, size_t *len,
 static int decode(struct audec_state *st, int16_t *sampv, size_t *sampc,
 		  const uint8_t *buf, size_t len)
 {
-	int16_t *p = (void *)buf;
-
 	(void)st;
 
 	if (len/2 > *sampc)
@@ -46,8 +175,10 @@ static int decode(struct audec_state *st, int16_t *sampv, size_t *sampc,
 
 	*sampc = len/2;
 
-	while ((len -= 2))
-		*sampv++ = ntohs(*p++);
+	if (ntohs(1) == 1)
+		memcpy(sampv, buf, len/2*2);
+	else
+		kern->swap((uint8_t *)sampv, buf, len/2);
 
 	return 0;
 }
@@ -66,14 +197,186 @@ static struct aucodec l16v[NR_CODECS] = {
 };
 
 
+/*
+ * Round-trip one frame through the network byte order. The swap undoes
+ * itself, so every encoded sample is also compared with htons().
+ */
+static int roundtrip(const struct aucodec *ac, const int16_t *inv,
+		     int16_t *outv, uint8_t *buf, size_t sampc)
+{
+	size_t len = sampc * 2, outc = sampc;
+	size_t i;
+	int err;
+
+	err = ac->ench(NULL, buf, &len, inv, sampc);
+	if (err)
+		return err;
+
+	if (len != sampc * 2)
+		return EPROTO;
+
+	for (i=0; i<sampc; i++) {
+
+		const uint16_t be = htons((uint16_t)inv[i]);
+
+		if (memcmp(&buf[i * 2], &be, 2))
+			return EPROTO;
+	}
+
+	err = ac->dech(NULL, outv, &outc, buf, len);
+	if (err)
+		return err;
+
+	if (outc != sampc)
+		return EPROTO;
+
+	for (i=0; i<sampc; i++) {
+		if (outv[i] != inv[i])
+			return EPROTO;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Check every codec variant with one 20 ms frame plus one sample, to also
+ * cover the tails. The payload is unaligned, as in an RTP packet. The
+ * codec uses the kernel that is being tested.
+ */
+static int selftest(const struct l16_kernel *k)
+{
+	const struct l16_kernel *prev = kern;
+	enum {MAXSAMP = 44100 * 2 / 50 + 1};
+	int16_t *inv, *outv;
+	uint8_t *buf;
+	size_t i;
+	int err = 0;
+
+	inv  = mem_alloc(MAXSAMP * sizeof(*inv), NULL);
+	outv = mem_alloc(MAXSAMP * sizeof(*outv), NULL);
+	buf  = mem_alloc(MAXSAMP * 2 + 1, NULL);
+	if (!inv || !outv || !buf) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i=0; i<MAXSAMP; i++)
+		inv[i] = rand_u16();
+
+	kern = k;
+
+	for (i=0; i<NR_CODECS; i++) {
+
+		const struct aucodec *ac = &l16v[i];
+
+		err = roundtrip(ac, inv, outv, buf + 1,
+				ac->srate * ac->ch / 50 + 1);
+		if (err) {
+			DEBUG_WARNING("selftest: %s %uHz/%u: %m\n",
+				      k->name, ac->srate, ac->ch, err);
+			break;
+		}
+	}
+
+	kern = prev;
+
+ out:
+	mem_deref(buf);
+	mem_deref(outv);
+	mem_deref(inv);
+
+	return err;
+}
+
+
+/* Byte-swap throughput of all kernels supported by the CPU */
+static int l16_bench(struct re_printf *pf, void *unused)
+{
+	static int16_t sampv[48000 * 2 / 50];
+	static uint8_t buf[sizeof(sampv)];
+	uint64_t start, t;
+	size_t i, j;
+	int err = 0;
+	(void)unused;
+
+	err |= re_hprintf(pf, "L16 benchmark (selected kernel: %s)\n",
+			  kern->name);
+
+	for (i=0; i<ARRAY_SIZE(kernelv); i++) {
+
+		const struct l16_kernel *k = &kernelv[i];
+		uint64_t nsamp = 0;
+
+		if (!k->supported())
+			continue;
+
+		if (rejected & (1u << i)) {
+			err |= re_hprintf(pf, " %-5s rejected by selftest\n",
+					  k->name);
+			continue;
+		}
+
+		start = tmr_jiffies();
+
+		do {
+			for (j=0; j<1000; j++) {
+				k->swap(buf, (uint8_t *)sampv,
+					ARRAY_SIZE(sampv));
+				k->swap((uint8_t *)sampv, buf,
+					ARRAY_SIZE(sampv));
+			}
+
+			nsamp += 2 * 1000 * ARRAY_SIZE(sampv);
+			t = tmr_jiffies() - start;
+
+		} while (t < 100);
+
+		err |= re_hprintf(pf, " %-5s %8.1f Msamples/s\n",
+				  k->name, nsamp / (t * 1e3));
+	}
+
+	return err;
+}
+
+
+static const struct cmd cmdv[] = {
+	{'L', 0, "L16 benchmark", l16_bench },
+};
+
+
 static int module_init(void)
 {
 	size_t i;
 
+	kern     = NULL;
+	rejected = 0;
+
+	/* all kernels are checked, to report the rejected ones */
+	for (i=0; i<ARRAY_SIZE(kernelv); i++) {
+
+		const struct l16_kernel *k = &kernelv[i];
+
+		if (!k->supported())
+			continue;
+
+		if (selftest(k)) {
+			DEBUG_WARNING("%s: selftest failed, kernel rejected\n",
+				      k->name);
+			rejected |= 1u << i;
+		}
+		else if (!kern) {
+			kern = k;
+		}
+	}
+
+	if (!kern)
+		return EPROTO;
+
 	for (i=0; i<NR_CODECS; i++)
 		aucodec_register(&l16v[i]);
 
-	return 0;
+	return cmd_register(cmdv, ARRAY_SIZE(cmdv));
 }
 
 
@@ -81,6 +384,8 @@ static int module_close(void)
 {
 	size_t i;
 
+	cmd_unregister(cmdv);
+
 	for (i=0; i<NR_CODECS; i++)
 		aucodec_unregister(&l16v[i]);
 
@@ -126,7 +126,13 @@ static int cmd_print_calls(struct re_printf *pf, void *unused)
 
 
 static const struct cmd cmdv[] = {
+	{'B',       0, "Audio mixer benchmark",    aumix_bench          },
+	{'F',       0, "Audio file player status", play_debug           },
+	{'T',       0, "Audio file player stress", play_stress          },
 	{'M',       0, "Main loop debug",          re_debug             },
+	{'N',       0, "Audio mixer status",       aumix_debug          },
+	{'O',       0, "RTP socket pool status",   rtppool_debug        },
+	{'R',       0, "Resampler benchmark",      resamp_bench         },
 	{'\n',      0, "Accept incoming call",     cmd_answer           },
 	{'b',       0, "Hangup call",              cmd_hangup           },
 	{'c',       0, "Call status",              ua_print_call_status },
@@ -3,23 +3,95 @@
  *
  * Copyright (C) 2010 Creytiv.com
  */
-#include <spandsp.h>
+#include <string.h>
 #include <re.h>
 #include <baresip.h>
 
 
+#define DEBUG_MODULE "plc"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
+
+/*
+ * Pitch based waveform substitution, after ITU-T G.711 Appendix I.
+ *
+ * On the first lost frame the pitch period is found in the history of
+ * each channel, and the last period is then repeated. The output is
+ * attenuated after 10 ms of loss, and is silent after 60 ms. The first
+ * good frame after a loss is crossfaded with the continued concealment,
+ * over 1/4 pitch period plus 4 ms for each 10 ms of loss.
+ *
+ * All durations are in microseconds, and are scaled with the sampling
+ * rate. Interleaved channels are concealed one by one.
+ */
+
+enum {
+	PITCH_MIN  =  5000,  /**< Shortest pitch period [us]            */
+	PITCH_MAX  = 15000,  /**< Longest pitch period [us]             */
+	CORR_LEN   = 20000,  /**< Pitch correlation window [us]         */
+	ATT_START  = 10000,  /**< Attenuation starts after [us]         */
+	ATT_END    = 60000,  /**< Silence after [us]                    */
+	FADE_STEP  =  4000,  /**< Crossfade per 10 ms of loss [us]      */
+	FADE_MAX   = 10000,  /**< Longest crossfade, plus 1/4 pitch [us]*/
+	MAX_CH     = 8,
+};
+
+
+/** Concealment state of one channel */
+struct plc_chan {
+	int16_t *hist;       /**< History of output samples         */
+	int16_t *pbuf;       /**< Pitch period being repeated       */
+	size_t pitch;        /**< Pitch period [samples]            */
+	size_t poff;         /**< Position in the pitch period      */
+};
+
 struct plc_st {
 	struct aufilt_st af; /* base class */
-	plc_state_t plc;
-	size_t nsamp;
+	struct plc_chan *chv;
+	int16_t *cont;       /**< Concealment for the crossfade     */
+	uint32_t srate;
+	uint8_t ch;
+	size_t nsamp;        /**< Frame size, all channels          */
+	size_t histlen;      /**< History length [samples]          */
+	size_t pmin;         /**< Shortest pitch period [samples]   */
+	size_t pmax;         /**< Longest pitch period [samples]    */
+	size_t corrlen;      /**< Correlation window [samples]      */
+	size_t decim;        /**< Decimation of the coarse search   */
+	size_t lost;         /**< Samples lost in current erasure   */
+
+	uint32_t n_conceal;  /**< Number of concealed frames        */
+	uint32_t n_erasure;  /**< Number of erasures (loss bursts)  */
+	uint32_t n_mute;     /**< Concealed frames that are silent  */
 };
 
 
+static size_t us2samp(const struct plc_st *st, uint32_t us)
+{
+	return (size_t)st->srate * us / 1000000;
+}
+
+
 static void destructor(void *arg)
 {
 	struct plc_st *st = arg;
+	unsigned i;
 
 	list_unlink(&st->af.le);
+
+	if (st->n_conceal) {
+		DEBUG_INFO("%uHz/%u: %u frames concealed in %u erasures"
+			   " (%u silent)\n", st->srate, st->ch,
+			   st->n_conceal, st->n_erasure, st->n_mute);
+	}
+
+	for (i=0; st->chv && i<st->ch; i++) {
+		mem_deref(st->chv[i].hist);
+		mem_deref(st->chv[i].pbuf);
+	}
+
+	mem_deref(st->chv);
+	mem_deref(st->cont);
 }
 
 
@@ -28,6 +100,7 @@ static int update(struct aufilt_st **stp, struct aufilt *af,
 		  const struct aufilt_prm *decprm)
 {
 	struct plc_st *st;
+	unsigned i;
 	int err = 0;
 
 	(void)af;
@@ -39,10 +112,9 @@ static int update(struct aufilt_st **stp, struct aufilt *af,
 	if (*stp)
 		return 0;
 
-	/* XXX: add support for stereo PLC */
-	if (decprm->ch != 1) {
-		re_fprintf(stderr, "plc: only mono supported (ch=%u)\n",
-			   decprm->ch);
+	if (!decprm->srate || !decprm->ch || decprm->ch > MAX_CH) {
+		DEBUG_WARNING("unsupported format %uHz/%u\n",
+			      decprm->srate, decprm->ch);
 		return ENOSYS;
 	}
 
@@ -50,12 +122,39 @@ static int update(struct aufilt_st **stp, struct aufilt *af,
 	if (!st)
 		return ENOMEM;
 
-	if (!plc_init(&st->plc)) {
+	st->srate   = decprm->srate;
+	st->ch      = decprm->ch;
+	st->nsamp   = decprm->frame_size;
+	st->pmin    = us2samp(st, PITCH_MIN);
+	st->pmax    = us2samp(st, PITCH_MAX);
+	st->corrlen = us2samp(st, CORR_LEN);
+	st->histlen = st->pmax + st->corrlen;
+	st->decim   = max(st->srate / 8000, 1);
+
+	if (st->pmin < 4) {
+		err = EINVAL;
+		goto out;
+	}
+
+	st->chv  = mem_zalloc(st->ch * sizeof(*st->chv), NULL);
+	st->cont = mem_zalloc((st->pmax / 4 + us2samp(st, FADE_MAX)) *
+			      sizeof(int16_t), NULL);
+	if (!st->chv || !st->cont) {
 		err = ENOMEM;
 		goto out;
 	}
 
-	st->nsamp = decprm->frame_size;
+	for (i=0; i<st->ch; i++) {
+
+		struct plc_chan *c = &st->chv[i];
+
+		c->hist = mem_zalloc(st->histlen * sizeof(int16_t), NULL);
+		c->pbuf = mem_zalloc(st->pmax * sizeof(int16_t), NULL);
+		if (!c->hist || !c->pbuf) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
 
  out:
 	if (err)
@@ -67,6 +166,208 @@ static int update(struct aufilt_st **stp, struct aufilt *af,
 }
 
 
+/* Append every stride'th sample to the history */
+static void hist_append(const struct plc_st *st, struct plc_chan *c,
+			const int16_t *p, size_t n, size_t stride)
+{
+	const size_t hl = st->histlen;
+	size_t i;
+
+	if (n < hl) {
+		memmove(c->hist, c->hist + n, (hl - n) * sizeof(int16_t));
+	}
+	else {
+		p += (n - hl) * stride;
+		n  = hl;
+	}
+
+	for (i=0; i<n; i++)
+		c->hist[hl - n + i] = p[i * stride];
+}
+
+
+/* Normalized correlation of the last window with the one lag before */
+static double corr(const struct plc_st *st, const int16_t *hist,
+		   size_t lag, size_t step)
+{
+	const int16_t *x = hist + st->histlen - st->corrlen;
+	const int16_t *y = x - lag;
+	int64_t xy = 0, yy = 0;
+	size_t i;
+
+	for (i=0; i<st->corrlen; i+=step) {
+		xy += x[i] * y[i];
+		yy += y[i] * y[i];
+	}
+
+	if (yy <= 0)
+		return 0.0;
+
+	return (double)xy * (xy < 0 ? -xy : xy) / yy;
+}
+
+
+static size_t find_pitch(const struct plc_st *st, const int16_t *hist)
+{
+	size_t lag, best = st->pmin, lo, hi;
+	double v, vbest = -1e300;
+
+	/* coarse search on decimated samples */
+	for (lag = st->pmin; lag <= st->pmax; lag += st->decim) {
+
+		v = corr(st, hist, lag, st->decim);
+		if (v > vbest) {
+			vbest = v;
+			best  = lag;
+		}
+	}
+
+	if (st->decim == 1)
+		return best;
+
+	/* fine search around the best lag */
+	lo = max(best - (st->decim - 1), st->pmin);
+	hi = min(best + (st->decim - 1), st->pmax);
+
+	vbest = -1e300;
+
+	for (lag = lo; lag <= hi; lag++) {
+
+		v = corr(st, hist, lag, 1);
+		if (v > vbest) {
+			vbest = v;
+			best  = lag;
+		}
+	}
+
+	return best;
+}
+
+
+/*
+ * Start an erasure: repeat the last pitch period of the history, where
+ * the end of the period is faded into the samples that came before its
+ * start, so that the loop has no discontinuity.
+ */
+static void conceal_start(const struct plc_st *st, struct plc_chan *c)
+{
+	const int16_t *h = c->hist + st->histlen;
+	const int16_t *a, *b;
+	size_t i, p, ov;
+
+	p  = find_pitch(st, c->hist);
+	ov = p / 4;
+
+	memcpy(c->pbuf, h - p, p * sizeof(int16_t));
+
+	a = h - ov;      /* end of the period  */
+	b = h - ov - p;  /* before its start   */
+
+	for (i=0; i<ov; i++) {
+		c->pbuf[p - ov + i] = (int16_t)((a[i] * (int32_t)(ov - i) +
+						 b[i] * (int32_t)i)
+						/ (int32_t)ov);
+	}
+
+	c->pitch = p;
+	c->poff  = 0;
+}
+
+
+/* Gain in Q15 after t samples of loss */
+static int32_t att_gain(const struct plc_st *st, size_t t)
+{
+	const size_t t0 = us2samp(st, ATT_START);
+	const size_t t1 = us2samp(st, ATT_END);
+
+	if (t < t0)
+		return 32768;
+	if (t >= t1)
+		return 0;
+
+	return (int32_t)(32768 * (t1 - t) / (t1 - t0));
+}
+
+
+/* Synthesize n samples of one channel, starting lost samples into loss */
+static void synth(const struct plc_st *st, struct plc_chan *c,
+		  int16_t *out, size_t n, size_t stride, size_t lost)
+{
+	size_t i;
+
+	for (i=0; i<n; i++) {
+
+		const int32_t g = att_gain(st, lost + i);
+
+		out[i * stride] = (int16_t)((c->pbuf[c->poff] * g) >> 15);
+
+		if (++c->poff >= c->pitch)
+			c->poff = 0;
+	}
+}
+
+
+static void conceal(struct plc_st *st, int16_t *sampv, size_t n)
+{
+	unsigned i;
+
+	if (!st->lost)
+		++st->n_erasure;
+
+	for (i=0; i<st->ch; i++) {
+
+		struct plc_chan *c = &st->chv[i];
+
+		if (!st->lost)
+			conceal_start(st, c);
+
+		synth(st, c, sampv + i, n, st->ch, st->lost);
+		hist_append(st, c, sampv + i, n, st->ch);
+	}
+
+	if (att_gain(st, st->lost + n) == 0)
+		++st->n_mute;
+
+	st->lost += n;
+	++st->n_conceal;
+}
+
+
+/* The first good frame after a loss is faded in from the concealment */
+static void recover(struct plc_st *st, int16_t *sampv, size_t n)
+{
+	unsigned i;
+
+	for (i=0; i<st->ch; i++) {
+
+		struct plc_chan *c = &st->chv[i];
+		int16_t *p = sampv + i;
+		size_t j, xf;
+
+		xf = c->pitch / 4 + us2samp(st, FADE_STEP) *
+			(st->lost / max(us2samp(st, 10000), 1));
+		xf = min(xf, c->pitch / 4 + us2samp(st, FADE_MAX));
+		xf = min(xf, n);
+
+		synth(st, c, st->cont, xf, 1, st->lost);
+
+		for (j=0; j<xf; j++) {
+
+			const int32_t a = st->cont[j];
+			const int32_t b = p[j * st->ch];
+
+			p[j * st->ch] = (int16_t)((a * (int32_t)(xf - j) +
+						   b * (int32_t)j)
+						  / (int32_t)xf);
+		}
+
+		hist_append(st, c, p, n, st->ch);
+	}
+
+	st->lost = 0;
+}
+
+
 /**
  * PLC is only valid for Decoding (RX)
  *
@@ -75,11 +376,20 @@ static int update(struct aufilt_st **stp, struct aufilt *af,
 static int decode(struct aufilt_st *st, int16_t *sampv, size_t *sampc)
 {
 	struct plc_st *plc = (struct plc_st *)st;
+	const size_t n = *sampc / plc->ch;
+	unsigned i;
 
-	if (*sampc)
-		plc_rx(&plc->plc, sampv, (int)*sampc);
-	else
-		*sampc = plc_fillin(&plc->plc, sampv, (int)plc->nsamp);
+	if (!*sampc) {
+		conceal(plc, sampv, plc->nsamp / plc->ch);
+		*sampc = plc->nsamp / plc->ch * plc->ch;
+	}
+	else if (plc->lost) {
+		recover(plc, sampv, n);
+	}
+	else {
+		for (i=0; i<plc->ch; i++)
+			hist_append(plc, &plc->chv[i], sampv + i, n, plc->ch);
+	}
 
 	return 0;
 }
@@ -0,0 +1,11 @@
+#
+# module.mk
+#
+# Copyright (C) 2010 Creytiv.com
+#
+
+MOD		:= regstub
+$(MOD)_SRCS	+= regstub.c
+$(MOD)_LFLAGS	+=
+
+include mk/mod.mk
@@ -0,0 +1,251 @@
+/**
+ * @file regstub.c  Stub SIP registrar, for testing the register scheduler
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+
+
+#define DEBUG_MODULE "regstub"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
+
+/*
+ * A minimal registrar in the same process, which answers all REGISTER
+ * requests that reach the local SIP stack. The accounts are configured
+ * with a registrar on the local SIP address, e.g.
+ *
+ *   <sip:user-1@127.0.0.1>;regint=600
+ *
+ * A configurable share of the requests is answered with 503, and the
+ * rest with 200 and the configured expiry. The stub measures the highest
+ * number of requests in one second, to check the rate limit, and the
+ * time from a 503 until the same AOR registers again, to check the
+ * backoff.
+ *
+ * Config:
+ *
+ *   regstub_fail      Share of requests answered with 503 [%]
+ *   regstub_expires   Expiry granted with 200 [s]
+ */
+
+enum {
+	RATE_INTERVAL = 1000,  /**< Rate measurement interval [ms]     */
+	HASH_SIZE     = 256,   /**< Number of buckets for the AORs      */
+};
+
+
+/** Registration state of one AOR */
+struct binding {
+	struct le he;          /**< Hash element                        */
+	char *aor;             /**< Address of record                   */
+	uint64_t ts_fail;      /**< Time of the last 503 [ms], 0 if OK  */
+};
+
+
+static struct {
+	struct sip_lsnr *lsnr;
+	struct hash *ht;       /**< Bindings by AOR                     */
+	struct tmr tmr;
+	uint32_t fail;         /**< Share of 503 replies [%]            */
+	uint32_t expires;      /**< Granted expiry [s]                  */
+	uint32_t n_aor;        /**< Number of AORs seen                 */
+	uint32_t n_req;        /**< Number of REGISTER requests         */
+	uint32_t n_ok;         /**< Number of 200 replies               */
+	uint32_t n_fail;       /**< Number of 503 replies               */
+	uint32_t n_rate;       /**< Requests in the current interval    */
+	uint32_t rate_max;     /**< Most requests in one interval       */
+	uint32_t n_retry;      /**< Retries after a 503                 */
+	uint32_t retry_min;    /**< Shortest retry after a 503 [ms]     */
+	uint32_t retry_max;    /**< Longest retry after a 503 [ms]      */
+} stub;
+
+
+static void binding_destructor(void *arg)
+{
+	struct binding *b = arg;
+
+	hash_unlink(&b->he);
+	mem_deref(b->aor);
+}
+
+
+static bool binding_cmp_handler(struct le *le, void *arg)
+{
+	const struct binding *b = le->data;
+
+	return 0 == pl_strcasecmp(arg, b->aor);
+}
+
+
+static struct binding *binding_get(const struct pl *aor)
+{
+	struct binding *b;
+	struct le *le;
+
+	le = hash_lookup(stub.ht, hash_joaat_pl_ci(aor), binding_cmp_handler,
+			 (void *)aor);
+	if (le)
+		return le->data;
+
+	b = mem_zalloc(sizeof(*b), binding_destructor);
+	if (!b)
+		return NULL;
+
+	if (pl_strdup(&b->aor, aor)) {
+		mem_deref(b);
+		return NULL;
+	}
+
+	hash_append(stub.ht, hash_joaat_pl_ci(aor), &b->he, b);
+	++stub.n_aor;
+
+	return b;
+}
+
+
+static void tmr_handler(void *arg)
+{
+	(void)arg;
+
+	tmr_start(&stub.tmr, RATE_INTERVAL, tmr_handler, NULL);
+
+	stub.rate_max = max(stub.rate_max, stub.n_rate);
+	stub.n_rate   = 0;
+}
+
+
+static bool request_handler(const struct sip_msg *msg, void *arg)
+{
+	const struct sip_hdr *hdr;
+	struct binding *b;
+	(void)arg;
+
+	if (pl_strcmp(&msg->met, "REGISTER"))
+		return false;
+
+	++stub.n_req;
+	++stub.n_rate;
+
+	b = binding_get(&msg->to.auri);
+	if (!b) {
+		(void)sip_reply(uag_sip(), msg, 500, "Server Error");
+		return true;
+	}
+
+	if (b->ts_fail) {
+
+		const uint32_t t = (uint32_t)(tmr_jiffies() - b->ts_fail);
+
+		stub.retry_min = stub.n_retry ? min(stub.retry_min, t) : t;
+		stub.retry_max = max(stub.retry_max, t);
+		++stub.n_retry;
+
+		b->ts_fail = 0;
+	}
+
+	if (rand_u32() % 100 < stub.fail) {
+
+		++stub.n_fail;
+		b->ts_fail = tmr_jiffies();
+
+		(void)sip_treplyf(NULL, NULL, uag_sip(), msg, false,
+				  503, "Service Unavailable",
+				  "Content-Length: 0\r\n\r\n");
+		return true;
+	}
+
+	++stub.n_ok;
+
+	hdr = sip_msg_hdr(msg, SIP_HDR_CONTACT);
+	if (hdr) {
+		(void)sip_treplyf(NULL, NULL, uag_sip(), msg, false,
+				  200, "OK",
+				  "Contact: %r;expires=%u\r\n"
+				  "Content-Length: 0\r\n\r\n",
+				  &hdr->val, stub.expires);
+	}
+	else {
+		(void)sip_treplyf(NULL, NULL, uag_sip(), msg, false,
+				  200, "OK",
+				  "Content-Length: 0\r\n\r\n");
+	}
+
+	return true;
+}
+
+
+static int regstub_debug(struct re_printf *pf, void *unused)
+{
+	(void)unused;
+
+	return re_hprintf(pf, "stub registrar: requests=%u ok=%u"
+			  " fail=%u (%u%%) AORs=%u\n"
+			  " rate: max %u/s (limit %u/s)\n"
+			  " retry after 503: %u retries, %u-%u s\n",
+			  stub.n_req, stub.n_ok, stub.n_fail, stub.fail,
+			  stub.n_aor,
+			  max(stub.rate_max, stub.n_rate),
+			  config.sip.reg_rate,
+			  stub.n_retry, stub.retry_min / 1000,
+			  stub.retry_max / 1000);
+}
+
+
+static const struct cmd cmdv[] = {
+	{'W', 0, "Stub registrar status", regstub_debug },
+};
+
+
+static int module_init(void)
+{
+	int err;
+
+	memset(&stub, 0, sizeof(stub));
+	stub.expires = 3600;
+	tmr_init(&stub.tmr);
+
+	(void)conf_get_u32(conf_cur(), "regstub_fail", &stub.fail);
+	(void)conf_get_u32(conf_cur(), "regstub_expires", &stub.expires);
+
+	err = hash_alloc(&stub.ht, HASH_SIZE);
+	if (err)
+		return err;
+
+	err = sip_listen(&stub.lsnr, uag_sip(), true, request_handler, NULL);
+	if (err) {
+		stub.ht = mem_deref(stub.ht);
+		return err;
+	}
+
+	tmr_start(&stub.tmr, RATE_INTERVAL, tmr_handler, NULL);
+
+	DEBUG_NOTICE("answering REGISTER, %u%% with 503\n", stub.fail);
+
+	return cmd_register(cmdv, ARRAY_SIZE(cmdv));
+}
+
+
+static int module_close(void)
+{
+	cmd_unregister(cmdv);
+
+	tmr_cancel(&stub.tmr);
+	stub.lsnr = mem_deref(stub.lsnr);
+
+	hash_flush(stub.ht);
+	stub.ht = mem_deref(stub.ht);
+
+	return 0;
+}
+
+
+EXPORT_SYM const struct mod_export DECL_EXPORTS(regstub) = {
+	"regstub",
+	"application",
+	module_init,
+	module_close
+};
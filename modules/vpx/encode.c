@@ -5,6 +5,9 @@
  */
 
 #include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
@@ -15,11 +18,30 @@
 
 enum {
 	HDR_SIZE = 4,
+	MAX_THREADS = 8,
+	MAX_PARTITIONS = 3,  /* log2 of the number of token partitions */
 };
 
 
+/*
+ * Encoder tuning, from the config file:
+ *
+ *   vpx_threads           0 is automatic, from frame size and CPU count
+ *   vpx_token_partitions  0-3 (log2), default follows the threads
+ *   vpx_cpuused           0-16, a higher value is faster
+ */
+static struct {
+	uint32_t threads;
+	uint32_t partitions;
+	bool partitions_set;
+	uint32_t cpuused;
+} vconf = {0, 0, false, 16};
+
+
 struct videnc_state {
+	struct le le;
 	vpx_codec_ctx_t ctx;
+	vpx_codec_enc_cfg_t cfg;
 	struct vidsz size;
 	vpx_codec_pts_t pts;
 	unsigned fps;
@@ -27,18 +49,150 @@ struct videnc_state {
 	unsigned pktsize;
 	bool ctxup;
 	uint16_t picid;
+
+	struct {
+		uint32_t n_frame;    /**< Number of encoded frames          */
+		uint32_t n_key;      /**< Number of keyframes               */
+		uint32_t n_reconf;   /**< Live configuration changes        */
+		uint32_t n_reopen;   /**< Encoder re-initialisations        */
+		uint64_t usec;       /**< Total encode time [us]            */
+		uint32_t usec_last;  /**< Encode time of last frame [us]    */
+		uint32_t usec_max;   /**< Maximum encode time [us]          */
+		uint64_t bytes;      /**< Total output size [bytes]         */
+		size_t sz_last;      /**< Output size of last frame [bytes] */
+	} stats;
 };
 
 
+static struct list encl;  /**< Active encoders, for the debug command */
+
+
+static int stats_debug(struct re_printf *pf, const struct videnc_state *ves)
+{
+	const uint32_t n = ves->stats.n_frame;
+
+	return re_hprintf(pf, "vp8: %ux%u %u kbit/s %u fps %u threads:"
+			  " %u frames (%u key), enc avg %.1f ms"
+			  " max %.1f ms last %.1f ms,"
+			  " size avg %llu last %zu bytes,"
+			  " %u reconfigured, %u reopened\n",
+			  ves->size.w, ves->size.h,
+			  ves->bitrate / 1000, ves->fps, ves->cfg.g_threads,
+			  n, ves->stats.n_key,
+			  n ? ves->stats.usec / 1000.0 / n : 0.0,
+			  ves->stats.usec_max / 1000.0,
+			  ves->stats.usec_last / 1000.0,
+			  n ? ves->stats.bytes / n : 0ULL,
+			  ves->stats.sz_last,
+			  ves->stats.n_reconf, ves->stats.n_reopen);
+}
+
+
 static void destructor(void *arg)
 {
 	struct videnc_state *ves = arg;
 
+	list_unlink(&ves->le);
+
+	if (ves->stats.n_frame)
+		(void)re_printf("%H", stats_debug, ves);
+
 	if (ves->ctxup)
 		vpx_codec_destroy(&ves->ctx);
 }
 
 
+static unsigned cpu_count(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	const long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n > 0)
+		return (unsigned)n;
+#endif
+
+	return 1;
+}
+
+
+/* Threads for a frame size, larger frames can use more of them */
+static unsigned thread_count(const struct vidsz *size)
+{
+	const unsigned cpus = cpu_count();
+	const unsigned px = size->w * size->h;
+	unsigned n;
+
+	if (vconf.threads)
+		return min(vconf.threads, MAX_THREADS);
+
+	if (px >= 1920 * 1080 && cpus > 8)
+		n = 8;
+	else if (px >= 1280 * 720 && cpus > 4)
+		n = 4;
+	else if (px >= 640 * 480 && cpus > 2)
+		n = 2;
+	else
+		n = 1;
+
+	return n;
+}
+
+
+/* At least one token partition per thread */
+static unsigned partition_count(unsigned threads)
+{
+	unsigned log2 = 0;
+
+	if (vconf.partitions_set)
+		return min(vconf.partitions, MAX_PARTITIONS);
+
+	while ((1U << log2) < threads && log2 < MAX_PARTITIONS)
+		++log2;
+
+	return log2;
+}
+
+
+/**
+ * Read the VP8 encoder parameters from the config
+ *
+ * @param conf Configuration
+ */
+void vp8_encode_config(const struct conf *conf)
+{
+	(void)conf_get_u32(conf, "vpx_threads", &vconf.threads);
+	(void)conf_get_u32(conf, "vpx_cpuused", &vconf.cpuused);
+
+	if (0 == conf_get_u32(conf, "vpx_token_partitions",
+			      &vconf.partitions))
+		vconf.partitions_set = true;
+}
+
+
+/**
+ * Print the statistics of all VP8 encoders
+ *
+ * @param pf  Print handler
+ * @param arg Not used
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int vp8_encode_debug(struct re_printf *pf, void *arg)
+{
+	struct le *le;
+	int err = 0;
+	(void)arg;
+
+	if (!list_head(&encl))
+		return re_hprintf(pf, "vp8: no active encoders\n");
+
+	for (le = list_head(&encl); le; le = le->next)
+		err |= stats_debug(pf, le->data);
+
+	return err;
+}
+
+
 int vp8_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 		      struct videnc_param *prm, const char *fmtp)
 {
@@ -60,15 +214,31 @@ int vp8_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 
 		ves->picid = rand_u16();
 
+		list_append(&encl, &ves->le, ves);
+
 		*vesp = ves;
 	}
-	else {
-		if (ves->ctxup && (ves->bitrate != prm->bitrate ||
-				   ves->fps     != prm->fps)) {
+	else if (ves->ctxup && (ves->bitrate != prm->bitrate ||
+				ves->fps     != prm->fps)) {
+
+		vpx_codec_err_t res;
+
+		/* change the rate control without a new keyframe */
+		ves->cfg.rc_target_bitrate = prm->bitrate / 1000;
+		if (prm->fps)
+			ves->cfg.g_timebase.den = prm->fps;
 
+		res = vpx_codec_enc_config_set(&ves->ctx, &ves->cfg);
+		if (res) {
+			re_fprintf(stderr, "vp8: enc config: %s\n",
+				   vpx_codec_err_to_string(res));
+
+			/* re-open at the next frame */
 			vpx_codec_destroy(&ves->ctx);
 			ves->ctxup = false;
 		}
+		else
+			++ves->stats.n_reconf;
 	}
 
 	ves->bitrate = prm->bitrate;
@@ -85,25 +255,29 @@ int vp8_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 
 static int open_encoder(struct videnc_state *ves, const struct vidsz *size)
 {
-	vpx_codec_enc_cfg_t cfg;
+	vpx_codec_enc_cfg_t *cfg = &ves->cfg;
 	vpx_codec_err_t res;
 
-	res = vpx_codec_enc_config_default(&vpx_codec_vp8_cx_algo, &cfg, 0);
+	res = vpx_codec_enc_config_default(&vpx_codec_vp8_cx_algo, cfg, 0);
 	if (res)
 		return EPROTO;
 
-	cfg.g_w = size->w;
-	cfg.g_h = size->h;
-	cfg.rc_target_bitrate = ves->bitrate;
-	cfg.g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
+	cfg->g_w = size->w;
+	cfg->g_h = size->h;
+	cfg->g_timebase.num = 1;
+	cfg->g_timebase.den = ves->fps ? ves->fps : 30;
+	cfg->g_threads = thread_count(size);
+	cfg->rc_target_bitrate = ves->bitrate / 1000;
+	cfg->g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
 
 	if (ves->ctxup) {
 		re_printf("vp8: re-opening encoder\n");
 		vpx_codec_destroy(&ves->ctx);
 		ves->ctxup = false;
+		++ves->stats.n_reopen;
 	}
 
-	res = vpx_codec_enc_init(&ves->ctx, &vpx_codec_vp8_cx_algo, &cfg, 0);
+	res = vpx_codec_enc_init(&ves->ctx, &vpx_codec_vp8_cx_algo, cfg, 0);
 	if (res) {
 		re_fprintf(stderr, "vp8: enc init: %s\n",
 			   vpx_codec_err_to_string(res));
@@ -112,12 +286,19 @@ static int open_encoder(struct videnc_state *ves, const struct vidsz *size)
 
 	ves->ctxup = true;
 
-	res = vpx_codec_control(&ves->ctx, VP8E_SET_CPUUSED, 16);
+	res = vpx_codec_control(&ves->ctx, VP8E_SET_CPUUSED, vconf.cpuused);
 	if (res) {
 		re_fprintf(stderr, "vp8: codec ctrl: %s\n",
 			   vpx_codec_err_to_string(res));
 	}
 
+	res = vpx_codec_control(&ves->ctx, VP8E_SET_TOKEN_PARTITIONS,
+				partition_count(cfg->g_threads));
+	if (res) {
+		re_fprintf(stderr, "vp8: token partitions: %s\n",
+			   vpx_codec_err_to_string(res));
+	}
+
 	return 0;
 }
 
@@ -188,6 +369,9 @@ int vp8_encode(struct videnc_state *ves, bool update,
 	vpx_codec_iter_t iter = NULL;
 	vpx_codec_err_t res;
 	vpx_image_t img;
+	uint64_t start;
+	uint32_t usec;
+	size_t sz = 0;
 	int err, i;
 
 	if (!ves || !frame || !pkth || frame->fmt != VID_FMT_YUV420P)
@@ -216,8 +400,13 @@ int vp8_encode(struct videnc_state *ves, bool update,
 		img.planes[i] = frame->data[i];
 	}
 
+	start = realtime_usec();
+
 	res = vpx_codec_encode(&ves->ctx, &img, ves->pts++, 1,
 			       flags, VPX_DL_REALTIME);
+
+	usec = (uint32_t)(realtime_usec() - start);
+
 	if (res) {
 		re_fprintf(stderr, "vp8: enc error: %s\n",
 			   vpx_codec_err_to_string(res));
@@ -235,8 +424,12 @@ int vp8_encode(struct videnc_state *ves, bool update,
 		pkt      = next_pkt;
 		next_pkt = get_cxdata(&ves->ctx, &iter);
 
-		if (pkt->data.frame.flags & VPX_FRAME_IS_KEY)
+		if (pkt->data.frame.flags & VPX_FRAME_IS_KEY) {
 			keyframe = true;
+			++ves->stats.n_key;
+		}
+
+		sz += pkt->data.frame.sz;
 
 		err = packetize(next_pkt == NULL,
 				pkt->data.frame.buf,
@@ -247,5 +440,12 @@ int vp8_encode(struct videnc_state *ves, bool update,
 			return err;
 	}
 
+	++ves->stats.n_frame;
+	ves->stats.usec     += usec;
+	ves->stats.usec_last = usec;
+	ves->stats.usec_max  = max(ves->stats.usec_max, usec);
+	ves->stats.bytes    += sz;
+	ves->stats.sz_last   = sz;
+
 	return 0;
 }
@@ -10,6 +10,8 @@ struct vp8_vidcodec {
 };
 
 /* Encode */
+void vp8_encode_config(const struct conf *conf);
+int vp8_encode_debug(struct re_printf *pf, void *arg);
 int vp8_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 		       struct videnc_param *prm, const char *fmtp);
 int vp8_encode(struct videnc_state *ves, bool update,
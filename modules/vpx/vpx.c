@@ -38,15 +38,24 @@ static struct vp8_vidcodec vpx = {
 };
 
 
+static const struct cmd cmdv[] = {
+	{'P', 0, "VP8 encoder statistics", vp8_encode_debug },
+};
+
+
 static int module_init(void)
 {
+	vp8_encode_config(conf_cur());
+
 	vidcodec_register((struct vidcodec *)&vpx);
-	return 0;
+
+	return cmd_register(cmdv, ARRAY_SIZE(cmdv));
 }
 
 
 static int module_close(void)
 {
+	cmd_unregister(cmdv);
 	vidcodec_unregister((struct vidcodec *)&vpx);
 	return 0;
 }
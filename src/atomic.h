@@ -0,0 +1,56 @@
+/**
+ * @file atomic.h  Interface to atomic operations
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+
+/*
+ * Minimal set of atomic primitives, used for lock-free communication
+ * between the main thread and the real-time audio/video threads.
+ */
+
+#if defined(__GNUC__) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+
+#define atom_barrier()        __sync_synchronize()
+#define atom_add(p, v)        __sync_add_and_fetch((p), (v))
+#define atom_cas(p, old, new) __sync_bool_compare_and_swap((p), (old), (new))
+
+#elif defined(WIN32)
+
+#include <windows.h>
+
+#define atom_barrier()        MemoryBarrier()
+#define atom_add(p, v) \
+	(InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v)) + (v))
+#define atom_cas(p, old, new) \
+	(InterlockedCompareExchange((volatile LONG *)(p), \
+				    (LONG)(new), (LONG)(old)) == (LONG)(old))
+
+#else
+
+#warning "no atomic operations on this platform"
+
+#define atom_barrier()        do {} while (0)
+#define atom_add(p, v)        (*(p) += (v))
+#define atom_cas(p, old, new) ((*(p) == (old)) ? (*(p) = (new), 1) : 0)
+
+#endif
+
+
+/** Read a shared index, with acquire semantics */
+static inline size_t atom_load(const volatile size_t *p)
+{
+	size_t v = *p;
+	atom_barrier();
+	return v;
+}
+
+
+/** Write a shared index, with release semantics */
+static inline void atom_store(volatile size_t *p, size_t v)
+{
+	atom_barrier();
+	*p = v;
+}
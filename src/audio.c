@@ -65,11 +65,12 @@ struct autx {
 	struct ausrc_st *ausrc;       /**< Audio Source                    */
 	const struct aucodec *ac;     /**< Current audio encoder           */
 	struct auenc_state *enc;      /**< Audio encoder state (optional)  */
-	struct aubuf *ab;             /**< Packetize outgoing stream       */
-	struct auresamp *resamp;      /**< Optional resampler for DSP      */
+	struct auring *ab;            /**< Packetize outgoing stream       */
+	struct resamp *resamp;        /**< Optional resampler for DSP      */
 	struct mbuf *mb;              /**< Buffer for outgoing RTP packets */
 	int16_t *sampv;               /**< Sample buffer                   */
 	int16_t *sampv_rs;            /**< Sample buffer for resampler     */
+	uint8_t *silence;             /**< Silence buffer for muted source */
 	uint32_t ptime;               /**< Packet time for sending         */
 	uint32_t ts;                  /**< Timestamp for outgoing RTP      */
 	uint32_t ts_tel;              /**< Timestamp for Telephony Events  */
@@ -78,6 +79,8 @@ struct autx {
 	bool is_g722;                 /**< Set if encoder is G.722 codec   */
 	bool muted;                   /**< Audio source is muted           */
 	int cur_key;                  /**< Currently transmitted event     */
+	uint32_t n_alloc;             /**< Allocations in the tx path      */
+	uint32_t n_alloc_start;       /**< Allocations when audio started  */
 
 	enum audio_mode mode;         /**< Audio mode for sending packets  */
 	union {
@@ -98,13 +101,18 @@ struct aurx {
 	struct auplay_st *auplay;     /**< Audio Player                    */
 	const struct aucodec *ac;     /**< Current audio decoder           */
 	struct audec_state *dec;      /**< Audio decoder state (optional)  */
-	struct aubuf *ab;             /**< Incoming audio buffer           */
-	struct auresamp *resamp;      /**< Optional resampler for DSP      */
+	struct auring *ab;            /**< Incoming audio buffer           */
+	struct resamp *resamp;        /**< Optional resampler for DSP      */
 	int16_t *sampv;               /**< Sample buffer                   */
 	int16_t *sampv_rs;            /**< Sample buffer for resampler     */
 	uint32_t ptime;               /**< Packet time for receiving       */
 	int pt;                       /**< Payload type for incoming RTP   */
 	int pt_tel;                   /**< Event payload type - receive    */
+	uint32_t n_frame;             /**< Number of decoded frames        */
+	uint32_t n_bounce;            /**< Frames via the sample buffer    */
+	uint32_t n_lost;              /**< Lost frames to be concealed     */
+	uint32_t n_plc;               /**< Frames concealed by the codec   */
+	uint32_t n_silent;            /**< Lost frames left unconcealed    */
 };
 
 
@@ -115,10 +123,12 @@ struct audio {
 	struct aurx rx;               /**< Receive                         */
 	struct stream *strm;          /**< Generic media stream            */
 	struct list filtl;            /**< Audio filters (struct aufilt_st)*/
+	struct aumix_source *mixs;    /**< Conference mixer (optional)     */
 	struct telev *telev;          /**< Telephony events                */
 	audio_event_h *eventh;        /**< Event handler                   */
 	audio_err_h *errh;            /**< Audio error handler             */
 	void *arg;                    /**< Handler argument                */
+	struct call *call;            /**< Parent call, for setup tracing  */
 };
 
 
@@ -136,6 +146,7 @@ static void audio_destructor(void *arg)
 	mem_deref(a->rx.sampv);
 	mem_deref(a->rx.ab);
 	mem_deref(a->tx.sampv_rs);
+	mem_deref(a->tx.silence);
 	mem_deref(a->tx.resamp);
 	mem_deref(a->rx.sampv_rs);
 	mem_deref(a->rx.resamp);
@@ -223,6 +234,7 @@ static int add_audio_codec(struct sdp_media *m, struct aucodec *ac)
 static void encode_rtp_send(struct audio *a, struct autx *tx,
 			    int16_t *sampv, size_t sampc)
 {
+	uint64_t start;
 	size_t len;
 	int err;
 
@@ -232,7 +244,12 @@ static void encode_rtp_send(struct audio *a, struct autx *tx,
 	tx->mb->pos = tx->mb->end = STREAM_PRESZ;
 	len = mbuf_get_space(tx->mb);
 
+	start = realtime_usec();
+
 	err = tx->ac->ench(tx->enc, mbuf_buf(tx->mb), &len, sampv, sampc);
+
+	load_add((uint32_t)(realtime_usec() - start));
+
 	if (err) {
 		DEBUG_WARNING("%s encode error: %d samples (%m)\n",
 			      tx->ac->name, sampc, err);
@@ -268,16 +285,16 @@ static void poll_aubuf_tx(struct audio *a)
 	int16_t *sampv = tx->sampv;
 
 	/* timed read from audio-buffer */
-	if (aubuf_get_samp(tx->ab, tx->ptime, tx->sampv, sampc))
+	if (auring_get_samp(tx->ab, tx->ptime, tx->sampv, sampc))
 		return;
 
 	/* optional resampler */
 	if (tx->resamp) {
 		size_t sampc_rs = AUDIO_SAMPSZ;
 
-		err = auresamp_process(tx->resamp,
-				       tx->sampv_rs, &sampc_rs,
-				       tx->sampv, sampc);
+		err = resamp_process(tx->resamp,
+				     tx->sampv_rs, &sampc_rs,
+				     tx->sampv, sampc);
 		if (err)
 			return;
 
@@ -341,7 +358,7 @@ static bool auplay_write_handler(uint8_t *buf, size_t sz, void *arg)
 {
 	struct aurx *rx = arg;
 
-	aubuf_read(rx->ab, buf, sz);
+	auring_read(rx->ab, buf, sz);
 
 	return true;
 }
@@ -358,20 +375,28 @@ static void ausrc_read_handler(const uint8_t *buf, size_t sz, void *arg)
 {
 	struct audio *a = arg;
 	struct autx *tx = &a->tx;
-	uint8_t *silence = NULL;
-	const uint8_t *txbuf = buf;
-
-	/* NOTE:
-	 * some devices behave strangely if they receive no RTP,
-	 * so we send silence when muted
-	 */
-	if (tx->muted) {
-		silence = mem_zalloc(sizeof(*silence) * sz, NULL);
-		txbuf = silence;
-	}
+
+	stream_tx_begin(a->strm);
 
 	if (tx->ab) {
-		if (aubuf_write(tx->ab, txbuf, sz))
+
+		/* NOTE:
+		 * some devices behave strangely if they receive no RTP,
+		 * so we send silence when muted
+		 */
+		if (tx->muted && tx->silence) {
+			size_t left = sz;
+
+			while (left) {
+				const size_t n = min(left, tx->psize);
+
+				if (auring_write(tx->ab, tx->silence, n))
+					goto out;
+
+				left -= n;
+			}
+		}
+		else if (auring_write(tx->ab, buf, sz))
 			goto out;
 
 		/* XXX: on limited CPU and specifically coreaudio module
@@ -386,7 +411,8 @@ static void ausrc_read_handler(const uint8_t *buf, size_t sz, void *arg)
  out:
 	/* Exact timing: send Telephony-Events from here */
 	check_telev(a, tx);
-	mem_deref(silence);
+
+	stream_tx_flush(a->strm);
 }
 
 
@@ -442,8 +468,8 @@ static void handle_telev(struct audio *a, struct mbuf *mb)
 static int audio_stream_decode(struct audio *a, struct aurx *rx,
 			       struct mbuf *mb)
 {
-	size_t sampc = AUDIO_SAMPSZ;
-	int16_t *sampv;
+	size_t sampc = AUDIO_SAMPSZ, slotc = 0;
+	int16_t *sampv = rx->sampv, *slot = NULL;
 	struct le *le;
 	int err = 0;
 
@@ -454,15 +480,39 @@ static int audio_stream_decode(struct audio *a, struct aurx *rx,
 	if (!rx->ac)
 		return 0;
 
+	/* Decode straight into a slot of the playout buffer. With a
+	 * resampler the slot is used for the resampler output instead */
+	if (rx->ab) {
+		size_t sz = AUDIO_SAMPSZ * 2;
+
+		slot  = (int16_t *)auring_reserve(rx->ab, &sz);
+		slotc = sz / 2;
+	}
+
+	if (slot && !rx->resamp) {
+
+		/* a PLC filter conceals a whole frame, needs a full slot */
+		if (mbuf_get_left(mb) || slotc == AUDIO_SAMPSZ) {
+			sampv = slot;
+			sampc = slotc;
+		}
+		else {
+			slot = NULL;
+		}
+	}
+
 	if (mbuf_get_left(mb)) {
-		err = rx->ac->dech(rx->dec, rx->sampv, &sampc,
+		err = rx->ac->dech(rx->dec, sampv, &sampc,
 				   mbuf_buf(mb), mbuf_get_left(mb));
 	}
 	else if (rx->ac->plch) {
-		err = rx->ac->plch(rx->dec, rx->sampv, &sampc);
+		++rx->n_lost;
+		++rx->n_plc;
+		err = rx->ac->plch(rx->dec, sampv, &sampc);
 	}
 	else {
 		/* no PLC in the codec, might be done in filters below */
+		++rx->n_lost;
 		sampc = 0;
 	}
 
@@ -477,29 +527,49 @@ static int audio_stream_decode(struct audio *a, struct aurx *rx,
 		struct aufilt_st *st = le->data;
 
 		if (st->af->dech)
-			err |= st->af->dech(st, rx->sampv, &sampc);
+			err |= st->af->dech(st, sampv, &sampc);
 	}
 
-	if (!rx->ab)
+	if (!sampc) {
+		/* a lost frame, not concealed by codec or filters */
+		if (!mbuf_get_left(mb) && !rx->ac->plch)
+			++rx->n_silent;
 		goto out;
+	}
 
-	sampv = rx->sampv;
+	/* Conference: the mixer replaces the audio player */
+	if (a->mixs) {
+		err = aumix_source_put(a->mixs, get_srate(rx->ac), rx->ac->ch,
+				       sampv, sampc);
+		goto out;
+	}
+
+	if (!rx->ab)
+		goto out;
 
 	/* optional resampler */
 	if (rx->resamp) {
-		size_t sampc_rs = AUDIO_SAMPSZ;
+		int16_t *dst = slot ? slot : rx->sampv_rs;
+		size_t sampc_rs = slot ? slotc : AUDIO_SAMPSZ;
 
-		err = auresamp_process(rx->resamp,
-				       rx->sampv_rs, &sampc_rs,
-				       rx->sampv, sampc);
+		err = resamp_process(rx->resamp, dst, &sampc_rs,
+				     sampv, sampc);
 		if (err)
 			return err;
 
-		sampv = rx->sampv_rs;
+		sampv = dst;
 		sampc = sampc_rs;
 	}
 
-	err = aubuf_write_samp(rx->ab, sampv, sampc);
+	++rx->n_frame;
+
+	if (slot) {
+		err = auring_commit(rx->ab, sampc * 2);
+	}
+	else {
+		++rx->n_bounce;
+		err = auring_write_samp(rx->ab, sampv, sampc);
+	}
 	if (err)
 		goto out;
 
@@ -514,6 +584,7 @@ static void stream_recv_handler(const struct rtp_header *hdr,
 {
 	struct audio *a = arg;
 	struct aurx *rx = &a->rx;
+	uint64_t start;
 	int err;
 
 	if (!mb)
@@ -539,7 +610,11 @@ static void stream_recv_handler(const struct rtp_header *hdr,
 	}
 
  out:
+	start = realtime_usec();
+
 	(void)audio_stream_decode(a, &a->rx, mb);
+
+	load_add((uint32_t)(realtime_usec() - start));
 }
 
 
@@ -586,6 +661,8 @@ int audio_alloc(struct audio **ap, struct call *call,
 
 	MAGIC_INIT(a);
 
+	a->call = call;
+
 	tx = &a->tx;
 	rx = &a->rx;
 
@@ -614,6 +691,7 @@ int audio_alloc(struct audio **ap, struct call *call,
 		err = ENOMEM;
 		goto out;
 	}
+	++tx->n_alloc;
 
 	err = telev_alloc(&a->telev, TELEV_PTIME);
 	if (err)
@@ -659,7 +737,9 @@ static void *tx_thread(void *arg)
 
 	while (a->tx.u.thr.run) {
 
+		stream_tx_begin(a->strm);
 		poll_aubuf_tx(a);
+		stream_tx_flush(a->strm);
 
 		sys_msleep(5);
 	}
@@ -675,7 +755,9 @@ static void timeout_tx(void *arg)
 
 	tmr_start(&a->tx.u.tmr, 5, timeout_tx, a);
 
+	stream_tx_begin(a->strm);
 	poll_aubuf_tx(a);
+	stream_tx_flush(a->strm);
 }
 
 
@@ -738,13 +820,14 @@ static int aufilt_setup(struct audio *a)
 }
 
 
-static int start_player(struct aurx *rx)
+static int start_player(struct aurx *rx, struct audio *a)
 {
 	const struct aucodec *ac = rx->ac;
 	uint32_t srate_dsp = get_srate(ac);
 	int err;
 
-	if (!ac)
+	/* in a conference the decoded audio goes to the mixer */
+	if (!ac || config.audio.mix_ptime)
 		return 0;
 
 	/* Optional resampler, if configured */
@@ -753,18 +836,19 @@ static int start_player(struct aurx *rx)
 
 		srate_dsp = config.audio.srate_play;
 
-		(void)re_printf("enable auplay resampler: %u --> %u Hz\n",
-				get_srate(ac), srate_dsp);
-
 		rx->sampv_rs = mem_zalloc(AUDIO_SAMPSZ * 2, NULL);
 		if (!rx->sampv_rs)
 			return ENOMEM;
 
-		err = auresamp_alloc(&rx->resamp, AUDIO_SAMPSZ,
-				     get_srate(ac), ac->ch,
-				     srate_dsp, ac->ch);
+		err = resamp_alloc(&rx->resamp, AUDIO_SAMPSZ,
+				   get_srate(ac), ac->ch,
+				   srate_dsp, ac->ch);
 		if (err)
 			return err;
+
+		(void)re_printf("enable auplay resampler: %u --> %u Hz (%s)\n",
+				get_srate(ac), srate_dsp,
+				resamp_kernel_name(rx->resamp));
 	}
 
 	/* Start Audio Player */
@@ -780,7 +864,7 @@ static int start_player(struct aurx *rx)
 		if (!rx->ab) {
 			const size_t psize = 2 * prm.frame_size;
 
-			err = aubuf_alloc(&rx->ab, psize * 1, psize * 8);
+			err = auring_alloc(&rx->ab, psize * 1, psize * 8);
 			if (err)
 				return err;
 		}
@@ -794,6 +878,8 @@ static int start_player(struct aurx *rx)
 				      config.audio.play_dev, err);
 			return err;
 		}
+
+		call_trace(a->call, CALL_PHASE_PLAYER);
 	}
 
 	return 0;
@@ -811,26 +897,29 @@ static int start_source(struct autx *tx, struct audio *a)
 
 	/* Optional resampler, if configured */
 	if (config.audio.srate_src && config.audio.srate_src != srate_dsp &&
-	    !tx->resamp) {
+	    !tx->resamp && !config.audio.mix_ptime) {
 
 		srate_dsp = config.audio.srate_src;
 
-		(void)re_printf("enable ausrc resampler: %u --> %u Hz\n",
-				get_srate(ac), srate_dsp);
-
 		tx->sampv_rs = mem_zalloc(AUDIO_SAMPSZ * 2, NULL);
 		if (!tx->sampv_rs)
 			return ENOMEM;
+		++tx->n_alloc;
 
-		err = auresamp_alloc(&tx->resamp, AUDIO_SAMPSZ,
-				     srate_dsp, ac->ch,
-				     get_srate(ac), ac->ch);
+		err = resamp_alloc(&tx->resamp, AUDIO_SAMPSZ,
+				   srate_dsp, ac->ch,
+				   get_srate(ac), ac->ch);
 		if (err)
 			return err;
+
+		(void)re_printf("enable ausrc resampler: %u --> %u Hz (%s)\n",
+				get_srate(ac), srate_dsp,
+				resamp_kernel_name(tx->resamp));
 	}
 
-	/* Start Audio Source */
-	if (!tx->ausrc && ausrc_find(NULL)) {
+	/* Start Audio Source, or join the conference mixer */
+	if (!tx->ausrc && !a->mixs &&
+	    (config.audio.mix_ptime || ausrc_find(NULL))) {
 
 		struct ausrc_prm prm;
 
@@ -839,23 +928,43 @@ static int start_source(struct autx *tx, struct audio *a)
 		prm.ch         = ac->ch;
 		prm.frame_size = calc_nsamp(prm.srate, prm.ch, tx->ptime);
 
-		tx->psize = 2 * prm.frame_size;
+		if (tx->psize != 2 * prm.frame_size) {
+
+			tx->psize = 2 * prm.frame_size;
+
+			mem_deref(tx->silence);
+			tx->silence = mem_zalloc(tx->psize, NULL);
+			if (!tx->silence)
+				return ENOMEM;
+			++tx->n_alloc;
+		}
 
 		if (!tx->ab) {
-			err = aubuf_alloc(&tx->ab, tx->psize * 2,
-					  tx->psize * 30);
+			err = auring_alloc(&tx->ab, tx->psize * 2,
+					   tx->psize * 30);
 			if (err)
 				return err;
+			++tx->n_alloc;
 		}
 
-		err = ausrc_alloc(&tx->ausrc, NULL, config.audio.src_mod,
-				  &prm, config.audio.src_dev,
-				  ausrc_read_handler, ausrc_error_handler, a);
+		if (config.audio.mix_ptime) {
+			err = aumix_source_alloc(&a->mixs, prm.srate, prm.ch,
+						 ausrc_read_handler, a);
+		}
+		else {
+			err = ausrc_alloc(&tx->ausrc, NULL,
+					  config.audio.src_mod,
+					  &prm, config.audio.src_dev,
+					  ausrc_read_handler,
+					  ausrc_error_handler, a);
+		}
 		if (err) {
 			DEBUG_WARNING("start_source failed: %m\n", err);
 			return err;
 		}
 
+		call_trace(a->call, CALL_PHASE_SOURCE);
+
 		switch (tx->mode) {
 #ifdef HAVE_PTHREAD
 		case AUDIO_MODE_THREAD:
@@ -899,6 +1008,9 @@ int audio_start(struct audio *a)
 	if (!a)
 		return EINVAL;
 
+	/* the player buffers are read by the decoder */
+	stream_rx_sync(a->strm);
+
 	err = stream_start(a->strm);
 	if (err)
 		return err;
@@ -913,13 +1025,18 @@ int audio_start(struct audio *a)
 	/* configurable order of play/src start */
 	if (config.audio.src_first) {
 		err |= start_source(&a->tx, a);
-		err |= start_player(&a->rx);
+		err |= start_player(&a->rx, a);
 	}
 	else {
-		err |= start_player(&a->rx);
+		err |= start_player(&a->rx, a);
 		err |= start_source(&a->tx, a);
 	}
 
+	a->tx.n_alloc_start = a->tx.n_alloc;
+
+	if (!err)
+		call_trace(a->call, CALL_PHASE_AUDIO);
+
 	return err;
 }
 
@@ -940,6 +1057,8 @@ void audio_stop(struct audio *a)
 	tx = &a->tx;
 	rx = &a->rx;
 
+	stream_rx_sync(a->strm);
+
 	switch (tx->mode) {
 
 #ifdef HAVE_PTHREAD
@@ -962,6 +1081,7 @@ void audio_stop(struct audio *a)
 	/* audio device must be stopped first */
 	tx->ausrc  = mem_deref(tx->ausrc);
 	rx->auplay = mem_deref(rx->auplay);
+	a->mixs    = mem_deref(a->mixs);
 
 	list_flush(&a->filtl);
 	tx->ab = mem_deref(tx->ab);
@@ -989,7 +1109,9 @@ int audio_encoder_set(struct audio *a, const struct aucodec *ac,
 
 		/* Audio source must be stopped first */
 		if (reset) {
+			stream_rx_sync(a->strm);
 			tx->ausrc = mem_deref(tx->ausrc);
+			a->mixs   = mem_deref(a->mixs);
 		}
 
 		tx->is_g722 = (0 == str_casecmp(ac->name, "G722"));
@@ -1009,10 +1131,13 @@ int audio_encoder_set(struct audio *a, const struct aucodec *ac,
 		}
 	}
 
-	stream_set_srate(a->strm, get_srate(ac), get_srate(ac));
+	call_trace(a->call, CALL_PHASE_ENCODER);
+
+	/* RTP clock rate, 8000 for G.722 (RFC 3551) */
+	stream_set_srate(a->strm, ac->srate, ac->srate);
 	stream_update_encoder(a->strm, pt_tx);
 
-	if (!tx->ausrc) {
+	if (!tx->ausrc && !a->mixs) {
 		err |= audio_start(a);
 	}
 
@@ -1032,6 +1157,8 @@ int audio_decoder_set(struct audio *a, const struct aucodec *ac,
 
 	rx = &a->rx;
 
+	stream_rx_sync(a->strm);
+
 	reset = !aucodec_equal(ac, rx->ac);
 
 	if (ac != rx->ac) {
@@ -1052,7 +1179,7 @@ int audio_decoder_set(struct audio *a, const struct aucodec *ac,
 		}
 	}
 
-	stream_set_srate(a->strm, get_srate(ac), get_srate(ac));
+	stream_set_srate(a->strm, ac->srate, ac->srate);
 
 	if (reset) {
 
@@ -1158,6 +1285,7 @@ int audio_debug(struct re_printf *pf, const struct audio *a)
 {
 	const struct autx *tx;
 	const struct aurx *rx;
+	struct auring_stat stat;
 	int err;
 
 	if (!a)
@@ -1170,13 +1298,29 @@ int audio_debug(struct re_printf *pf, const struct audio *a)
 
 	err |= re_hprintf(pf, " tx:   %H %H ptime=%ums\n",
 			  aucodec_print, tx->ac,
-			  aubuf_debug, tx->ab,
+			  auring_debug, tx->ab,
 			  tx->ptime);
 
+	err |= re_hprintf(pf, "       allocs=%u (%u since start)\n",
+			  tx->n_alloc, tx->n_alloc - tx->n_alloc_start);
+
 	err |= re_hprintf(pf, " rx:   %H %H ptime=%ums pt=%d\n",
 			  aucodec_print, rx->ac,
-			  aubuf_debug, rx->ab,
+			  auring_debug, rx->ab,
 			  rx->ptime, rx->pt);
+	if (0 == auring_stats(rx->ab, &stat) && rx->n_frame) {
+		err |= re_hprintf(pf, "       copied=%u bytes/frame,"
+				  " %u of %u frames via sample buffer\n",
+				  (uint32_t)(stat.b_copy / rx->n_frame),
+				  rx->n_bounce, rx->n_frame);
+	}
+	if (rx->n_lost) {
+		err |= re_hprintf(pf, "       lost=%u frames: %u concealed"
+				  " by codec, %u by filters, %u silent\n",
+				  rx->n_lost, rx->n_plc,
+				  rx->n_lost - rx->n_plc - rx->n_silent,
+				  rx->n_silent);
+	}
 
 	err |= stream_debug(pf, a->strm);
 
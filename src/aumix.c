@@ -0,0 +1,705 @@
+/**
+ * @file aumix.c  Conference audio mixer
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+
+#define DEBUG_MODULE "aumix"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
+
+/**
+ * \page AudioMixer Conference audio mixer
+ *
+ * All calls are mixed into one conference. Each participant is a mixer
+ * source, which puts its decoded audio into the mixer and gets back the
+ * mix of all other participants (mix-minus).
+ *
+ * The mixer runs on its own thread in fixed ticks of 10 or 20 ms, at a
+ * sampling rate of 48000 Hz mono. Participants with other sampling rates
+ * or stereo are resampled on input and output. The samples are summed
+ * with 32-bit precision and packed back to 16-bit with saturation.
+ *
+ * The mix-minus of each participant is computed into its own output
+ * buffer with the mutex held. The frame handlers, i.e. the encoders, are
+ * called after the mutex is released; a source is only removed from the
+ * mixer when no frames are being delivered.
+ *
+ *<pre>
+ *   decoder --> resamp --> auring --.
+ *                                    +--> sum --> minus own --> resamp
+ *   decoder --> resamp --> auring --'                         --> encoder
+ *</pre>
+ */
+
+
+enum {
+	AUMIX_SRATE   = 48000,  /**< Mixing sampling rate in [Hz]    */
+	AUMIX_MAXSAMP = 3840,   /**< Max. samples per frame, any rate */
+	AUMIX_PREBUF  = 2,      /**< Prebuffering in [ticks]          */
+	AUMIX_MAXBUF  = 8,      /**< Maximum buffering in [ticks]     */
+};
+
+
+#ifdef HAVE_PTHREAD
+
+/** Defines the conference mixer */
+struct aumix {
+	pthread_t tid;           /**< Mixer thread                    */
+	pthread_mutex_t mutex;   /**< Protects the list of sources    */
+	pthread_cond_t cond;     /**< Signalled when delivery is done */
+	struct list srcl;        /**< Mixer sources (participants)    */
+	int32_t *mixv;           /**< Sum of all sources              */
+	int16_t *outv;           /**< Mix-minus for one source        */
+	uint32_t ptime;          /**< Tick in [ms]                    */
+	size_t nsamp;            /**< Samples per tick                */
+	bool run;                /**< Mixer thread is running         */
+	bool busy;               /**< Frames are being delivered      */
+	struct {
+		uint32_t n_tick;     /**< Number of ticks             */
+		uint32_t n_late;     /**< Number of late ticks        */
+		uint64_t usec;       /**< Total tick time in [us]     */
+		uint64_t src;        /**< Total number of sources     */
+		uint32_t usec_max;   /**< Max. tick time in [us]      */
+	} stats;
+};
+
+/** Defines a mixer source, i.e. one participant */
+struct aumix_source {
+	struct le le;            /**< Linked list element             */
+	struct aumix *mix;       /**< Mixer (referenced)              */
+	struct auring *inb;      /**< Input samples at mixer rate     */
+	struct resamp *rs_in;    /**< Input resampler (optional)      */
+	struct resamp *rs_out;   /**< Output resampler (optional)     */
+	int16_t *framev;         /**< Own samples of current tick     */
+	int16_t *rsv;            /**< Mix-minus of the current tick   */
+	size_t rsc;              /**< Number of output samples        */
+	uint32_t srate_in;       /**< Input sampling rate             */
+	uint8_t ch_in;           /**< Input channels                  */
+	uint32_t srate;          /**< Output sampling rate            */
+	uint8_t ch;              /**< Output channels                 */
+	ausrc_read_h *frameh;    /**< Mix-minus frame handler         */
+	void *arg;               /**< Handler argument                */
+};
+
+
+static struct aumix *mixer;  /**< The conference mixer */
+
+
+#if defined(__SSE2__)
+/* Sign-extend the low/high four samples to 32-bit */
+static inline __m128i widen_lo(__m128i v)
+{
+	return _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+}
+
+
+static inline __m128i widen_hi(__m128i v)
+{
+	return _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+}
+#endif
+
+
+/* Sum of all sources: mixv += sampv */
+static void mix_add(int32_t *mixv, const int16_t *sampv, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	for (; i+8<=n; i+=8) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(sampv+i));
+		__m128i *m = (__m128i *)(mixv + i);
+		const __m128i lo = widen_lo(v);
+		const __m128i hi = widen_hi(v);
+
+		_mm_storeu_si128(m, _mm_add_epi32(_mm_loadu_si128(m), lo));
+		_mm_storeu_si128(m + 1,
+				 _mm_add_epi32(_mm_loadu_si128(m + 1), hi));
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	for (; i+8<=n; i+=8) {
+		const int16x8_t v = vld1q_s16(sampv + i);
+
+		const int32x4_t lo = vaddw_s16(vld1q_s32(mixv + i),
+					       vget_low_s16(v));
+		const int32x4_t hi = vaddw_s16(vld1q_s32(mixv + i + 4),
+					       vget_high_s16(v));
+
+		vst1q_s32(mixv + i, lo);
+		vst1q_s32(mixv + i + 4, hi);
+	}
+#endif
+
+	for (; i<n; i++)
+		mixv[i] += sampv[i];
+}
+
+
+/* Mix-minus with saturation: outv = mixv - sampv */
+static void mix_minus(int16_t *outv, const int32_t *mixv,
+		      const int16_t *sampv, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	for (; i+8<=n; i+=8) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(sampv+i));
+		const __m128i *m = (const __m128i *)(mixv + i);
+		const __m128i lo = widen_lo(v);
+		const __m128i hi = widen_hi(v);
+
+		const __m128i dlo = _mm_sub_epi32(_mm_loadu_si128(m), lo);
+		const __m128i dhi = _mm_sub_epi32(_mm_loadu_si128(m + 1), hi);
+
+		_mm_storeu_si128((__m128i *)(outv + i),
+				 _mm_packs_epi32(dlo, dhi));
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	for (; i+8<=n; i+=8) {
+		const int16x8_t v = vld1q_s16(sampv + i);
+		const int32x4_t lo = vsubw_s16(vld1q_s32(mixv + i),
+					       vget_low_s16(v));
+		const int32x4_t hi = vsubw_s16(vld1q_s32(mixv + i + 4),
+					       vget_high_s16(v));
+
+		vst1q_s16(outv + i, vcombine_s16(vqmovn_s32(lo),
+						 vqmovn_s32(hi)));
+	}
+#endif
+
+	for (; i<n; i++) {
+		const int32_t v = mixv[i] - sampv[i];
+
+		if (v > 32767)
+			outv[i] = 32767;
+		else if (v < -32768)
+			outv[i] = -32768;
+		else
+			outv[i] = v;
+	}
+}
+
+
+/*
+ * One mixer tick, called with the mutex held. The mix-minus frames are
+ * left in the output buffers of the sources.
+ */
+static void mix_tick(struct aumix *mix)
+{
+	const uint64_t start = realtime_usec();
+	uint32_t usec;
+	struct le *le;
+
+	memset(mix->mixv, 0, mix->nsamp * sizeof(*mix->mixv));
+
+	for (le = mix->srcl.head; le; le = le->next) {
+		struct aumix_source *src = le->data;
+
+		auring_read(src->inb, (uint8_t *)src->framev, mix->nsamp * 2);
+		mix_add(mix->mixv, src->framev, mix->nsamp);
+	}
+
+	for (le = mix->srcl.head; le; le = le->next) {
+		struct aumix_source *src = le->data;
+
+		src->rsc = 0;
+
+		if (!src->rs_out) {
+			mix_minus(src->rsv, mix->mixv, src->framev,
+				  mix->nsamp);
+			src->rsc = mix->nsamp;
+			continue;
+		}
+
+		mix_minus(mix->outv, mix->mixv, src->framev, mix->nsamp);
+
+		src->rsc = AUMIX_MAXSAMP;
+
+		if (resamp_process(src->rs_out, src->rsv, &src->rsc,
+				   mix->outv, mix->nsamp))
+			src->rsc = 0;
+	}
+
+	usec = (uint32_t)(realtime_usec() - start);
+
+	load_add(usec);
+
+	++mix->stats.n_tick;
+	mix->stats.usec += usec;
+	mix->stats.src  += list_count(&mix->srcl);
+	mix->stats.usec_max = max(mix->stats.usec_max, usec);
+}
+
+
+static void *mix_thread(void *arg)
+{
+	struct aumix *mix = arg;
+	uint64_t ts = tmr_jiffies();
+	struct le *le;
+
+	while (mix->run) {
+
+		const uint64_t now = tmr_jiffies();
+
+		if (now < ts) {
+			sys_msleep((unsigned)(ts - now));
+			continue;
+		}
+
+		/* far behind, e.g. after suspend -- skip the missed ticks */
+		if (now > ts + 10 * mix->ptime) {
+			++mix->stats.n_late;
+			ts = now;
+		}
+
+		ts += mix->ptime;
+
+		pthread_mutex_lock(&mix->mutex);
+		mix_tick(mix);
+		mix->busy = true;
+		pthread_mutex_unlock(&mix->mutex);
+
+		/* the list is not changed while busy */
+		for (le = mix->srcl.head; le; le = le->next) {
+			struct aumix_source *src = le->data;
+
+			if (src->frameh && src->rsc)
+				src->frameh((uint8_t *)src->rsv, src->rsc * 2,
+					    src->arg);
+		}
+
+		pthread_mutex_lock(&mix->mutex);
+		mix->busy = false;
+		pthread_cond_broadcast(&mix->cond);
+		pthread_mutex_unlock(&mix->mutex);
+	}
+
+	return NULL;
+}
+
+
+static void mix_destructor(void *arg)
+{
+	struct aumix *mix = arg;
+
+	if (mix->run) {
+		mix->run = false;
+		pthread_join(mix->tid, NULL);
+	}
+
+	mem_deref(mix->mixv);
+	mem_deref(mix->outv);
+	pthread_cond_destroy(&mix->cond);
+	pthread_mutex_destroy(&mix->mutex);
+
+	if (mixer == mix)
+		mixer = NULL;
+}
+
+
+static int mix_alloc(struct aumix **mixp, uint32_t ptime, bool thread)
+{
+	struct aumix *mix;
+	int err = 0;
+
+	mix = mem_zalloc(sizeof(*mix), mix_destructor);
+	if (!mix)
+		return ENOMEM;
+
+	pthread_mutex_init(&mix->mutex, NULL);
+	pthread_cond_init(&mix->cond, NULL);
+
+	mix->ptime = ptime;
+	mix->nsamp = AUMIX_SRATE * ptime / 1000;
+
+	mix->mixv = mem_zalloc(mix->nsamp * sizeof(*mix->mixv), NULL);
+	mix->outv = mem_zalloc(mix->nsamp * sizeof(*mix->outv), NULL);
+	if (!mix->mixv || !mix->outv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	if (thread) {
+		mix->run = true;
+		err = pthread_create(&mix->tid, NULL, mix_thread, mix);
+		if (err) {
+			mix->run = false;
+			goto out;
+		}
+	}
+
+ out:
+	if (err)
+		mem_deref(mix);
+	else
+		*mixp = mix;
+
+	return err;
+}
+
+
+static void source_destructor(void *arg)
+{
+	struct aumix_source *src = arg;
+
+	if (src->mix) {
+		struct aumix *mix = src->mix;
+
+		pthread_mutex_lock(&mix->mutex);
+		while (mix->busy)
+			pthread_cond_wait(&mix->cond, &mix->mutex);
+		list_unlink(&src->le);
+		pthread_mutex_unlock(&mix->mutex);
+	}
+
+	mem_deref(src->inb);
+	mem_deref(src->rs_in);
+	mem_deref(src->rs_out);
+	mem_deref(src->framev);
+	mem_deref(src->rsv);
+	mem_deref(src->mix);
+}
+
+
+static int source_alloc(struct aumix_source **srcp, struct aumix *mix,
+			uint32_t srate, uint8_t ch,
+			ausrc_read_h *frameh, void *arg)
+{
+	struct aumix_source *src;
+	const size_t psize = mix->nsamp * 2;
+	int err;
+
+	src = mem_zalloc(sizeof(*src), source_destructor);
+	if (!src)
+		return ENOMEM;
+
+	src->srate  = srate;
+	src->ch     = ch;
+	src->frameh = frameh;
+	src->arg    = arg;
+
+	err = auring_alloc(&src->inb, psize * AUMIX_PREBUF,
+			   psize * AUMIX_MAXBUF);
+	if (err)
+		goto out;
+
+	src->framev = mem_zalloc(psize, NULL);
+	if (!src->framev) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	if (srate != AUMIX_SRATE || ch != 1) {
+
+		err = resamp_alloc(&src->rs_out, AUMIX_MAXSAMP,
+				   AUMIX_SRATE, 1, srate, ch);
+		if (err)
+			goto out;
+
+	}
+
+	src->rsv = mem_zalloc(AUMIX_MAXSAMP * sizeof(int16_t), NULL);
+	if (!src->rsv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	src->mix = mem_ref(mix);
+
+	pthread_mutex_lock(&mix->mutex);
+	while (mix->busy)
+		pthread_cond_wait(&mix->cond, &mix->mutex);
+	list_append(&mix->srcl, &src->le, src);
+	pthread_mutex_unlock(&mix->mutex);
+
+ out:
+	if (err)
+		mem_deref(src);
+	else
+		*srcp = src;
+
+	return err;
+}
+
+
+/**
+ * Add a participant to the conference mixer
+ *
+ * @param srcp   Pointer to allocated mixer source
+ * @param srate  Sampling rate of the mix-minus frames in [Hz]
+ * @param ch     Number of channels of the mix-minus frames
+ * @param frameh Mix-minus frame handler, called from the mixer thread
+ * @param arg    Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int aumix_source_alloc(struct aumix_source **srcp, uint32_t srate,
+		       uint8_t ch, ausrc_read_h *frameh, void *arg)
+{
+	uint32_t ptime = config.audio.mix_ptime;
+	int err;
+
+	if (!srcp || !srate || !ch)
+		return EINVAL;
+
+	if (ptime != 10 && ptime != 20) {
+		DEBUG_WARNING("invalid mixer tick %u ms, using 20 ms\n",
+			      ptime);
+		ptime = 20;
+	}
+
+	if (mixer) {
+		mem_ref(mixer);
+	}
+	else {
+		err = mix_alloc(&mixer, ptime, true);
+		if (err)
+			return err;
+
+		(void)re_printf("audio mixer: %u Hz, %u ms ticks\n",
+				AUMIX_SRATE, ptime);
+	}
+
+	err = source_alloc(srcp, mixer, srate, ch, frameh, arg);
+
+	/* the source holds a reference */
+	mem_deref(mixer);
+
+	return err;
+}
+
+
+/**
+ * Put decoded audio from a participant into the conference mixer
+ *
+ * @param src   Mixer source
+ * @param srate Sampling rate in [Hz]
+ * @param ch    Number of channels
+ * @param sampv Audio samples
+ * @param sampc Number of samples
+ *
+ * @return 0 if success, otherwise errorcode
+ *
+ * @note Must only be called from one thread, e.g. the decoder thread
+ */
+int aumix_source_put(struct aumix_source *src, uint32_t srate, uint8_t ch,
+		     const int16_t *sampv, size_t sampc)
+{
+	size_t sz = AUMIX_MAXSAMP * 2;
+	uint8_t *slot;
+	int err;
+
+	if (!src || !sampv)
+		return EINVAL;
+
+	if (srate == AUMIX_SRATE && ch == 1)
+		return auring_write_samp(src->inb, sampv, sampc);
+
+	if (!src->rs_in || srate != src->srate_in || ch != src->ch_in) {
+
+		src->rs_in = mem_deref(src->rs_in);
+
+		err = resamp_alloc(&src->rs_in, AUMIX_MAXSAMP,
+				   srate, ch, AUMIX_SRATE, 1);
+		if (err)
+			return err;
+
+		src->srate_in = srate;
+		src->ch_in    = ch;
+	}
+
+	/* resample straight into the input buffer, drop if full */
+	slot = auring_reserve(src->inb, &sz);
+	if (!slot)
+		return 0;
+
+	sz /= 2;
+
+	err = resamp_process(src->rs_in, (int16_t *)slot, &sz, sampv, sampc);
+	if (err)
+		return err;
+
+	return auring_commit(src->inb, sz * 2);
+}
+
+
+int aumix_debug(struct re_printf *pf, void *unused)
+{
+	struct aumix *mix = mixer;
+	uint32_t n_tick, usec;
+	struct le *le;
+	int err;
+	(void)unused;
+
+	if (!mix)
+		return re_hprintf(pf, "audio mixer: not running\n");
+
+	pthread_mutex_lock(&mix->mutex);
+
+	n_tick = mix->stats.n_tick ? mix->stats.n_tick : 1;
+	usec   = (uint32_t)(mix->stats.usec / n_tick);
+
+	err = re_hprintf(pf, "audio mixer: %u Hz, %u ms ticks,"
+			 " %u participants\n"
+			 " ticks=%u late=%u cost=%u us/tick (max %u us),"
+			 " %u ns/participant\n",
+			 AUMIX_SRATE, mix->ptime, list_count(&mix->srcl),
+			 mix->stats.n_tick, mix->stats.n_late,
+			 usec, mix->stats.usec_max,
+			 mix->stats.src ?
+			 (uint32_t)(mix->stats.usec * 1000 / mix->stats.src) :
+			 0);
+
+	for (le = mix->srcl.head; le; le = le->next) {
+		const struct aumix_source *src = le->data;
+
+		err |= re_hprintf(pf, " %u Hz/%uch %H\n",
+				  src->srate, src->ch,
+				  auring_debug, src->inb);
+	}
+
+	pthread_mutex_unlock(&mix->mutex);
+
+	return err;
+}
+
+
+/**
+ * Benchmark the conference mixer with a set of simulated participants
+ *
+ * @param pf     Print handler for the results
+ * @param unused Unused parameter
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int aumix_bench(struct re_printf *pf, void *unused)
+{
+	static const uint32_t nv[] = {10, 50, 100};
+	static const uint32_t sratev[] = {8000, 16000, 48000};
+	static int16_t sampv[AUMIX_MAXSAMP];
+	size_t i, j, k;
+	int err = 0;
+	(void)unused;
+
+	for (i=0; i<ARRAY_SIZE(sampv); i++)
+		sampv[i] = rand_u16() >> 3;
+
+	for (i=0; i<ARRAY_SIZE(nv) && !err; i++) {
+
+		const uint32_t ntick = 500;
+		struct aumix *mix;
+		uint64_t usec;
+
+		err = mix_alloc(&mix, 20, false);
+		if (err)
+			break;
+
+		/* the sources are owned by the mixer list */
+		for (j=0; j<nv[i] && !err; j++) {
+			struct aumix_source *src;
+
+			err = source_alloc(&src, mix, sratev[j % 3],
+					   1 + (j % 2), NULL, NULL);
+		}
+		if (err)
+			goto out;
+
+		usec = realtime_usec();
+
+		for (k=0; k<ntick; k++) {
+
+			struct le *le;
+
+			for (le = mix->srcl.head; le; le = le->next) {
+				struct aumix_source *src = le->data;
+				const uint32_t srate = src->srate;
+				const uint8_t ch = src->ch;
+
+				(void)aumix_source_put(src, srate, ch, sampv,
+						       srate / 50 * ch);
+			}
+
+			mix_tick(mix);
+		}
+
+		usec = realtime_usec() - usec;
+
+		err = re_hprintf(pf, "audio mixer: %3u participants:"
+				 " %5u us/tick (with resampling),"
+				 " %u ns/participant\n",
+				 nv[i], (uint32_t)(usec / ntick),
+				 (uint32_t)(usec * 1000 / ntick / nv[i]));
+
+	out:
+		list_flush(&mix->srcl);
+		mem_deref(mix);
+	}
+
+	return err;
+}
+
+
+#else
+
+
+int aumix_source_alloc(struct aumix_source **srcp, uint32_t srate,
+		       uint8_t ch, ausrc_read_h *frameh, void *arg)
+{
+	(void)srcp;
+	(void)srate;
+	(void)ch;
+	(void)frameh;
+	(void)arg;
+
+	DEBUG_WARNING("audio mixer: no thread support\n");
+
+	return ENOSYS;
+}
+
+
+int aumix_source_put(struct aumix_source *src, uint32_t srate, uint8_t ch,
+		     const int16_t *sampv, size_t sampc)
+{
+	(void)src;
+	(void)srate;
+	(void)ch;
+	(void)sampv;
+	(void)sampc;
+
+	return ENOSYS;
+}
+
+
+int aumix_debug(struct re_printf *pf, void *unused)
+{
+	(void)unused;
+
+	return re_hprintf(pf, "audio mixer: no thread support\n");
+}
+
+
+int aumix_bench(struct re_printf *pf, void *unused)
+{
+	(void)unused;
+
+	return re_hprintf(pf, "audio mixer: no thread support\n");
+}
+
+
+#endif
@@ -0,0 +1,349 @@
+/**
+ * @file auring.c  Lock-free audio ring-buffer
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+#include "atomic.h"
+
+
+/**
+ * Single-producer/single-consumer ring-buffer for audio samples.
+ *
+ * One thread writes (e.g. the network or audio-source thread) and one
+ * thread reads (e.g. the audio-player or encoder thread). Neither side
+ * ever blocks or allocates memory; the producer only updates the write
+ * position and the consumer only updates the read position.
+ *
+ * If the buffer is full the new data is dropped (overrun). If the buffer
+ * runs empty, silence is returned and the buffer is pre-filled up to the
+ * minimum size again (underrun).
+ *
+ * The producer can also reserve a contiguous slot at the write position,
+ * fill it in place (e.g. from a decoder) and then commit it. The sample
+ * memory has an overflow area after the end of the ring, so a slot never
+ * wraps; only the part written into the overflow area is copied to the
+ * start of the ring on commit.
+ */
+struct auring {
+	uint8_t *buf;             /**< Sample memory, incl. overflow area */
+	size_t size;              /**< Capacity in bytes, power of two    */
+	size_t min_sz;            /**< Minimum fill level (prebuffering)  */
+	size_t max_sz;            /**< Maximum fill level                 */
+	volatile size_t wpos;     /**< Write position, owned by producer  */
+	volatile size_t rpos;     /**< Read position, owned by consumer   */
+	uint64_t ts;              /**< Timed read timestamp (consumer)    */
+	bool filling;             /**< Prebuffering state (consumer)      */
+	uint32_t n_overrun;       /**< Number of overruns (producer)      */
+	uint32_t n_underrun;      /**< Number of underruns (consumer)     */
+	uint64_t b_in;            /**< Bytes written (producer)           */
+	uint64_t b_copy_in;       /**< Bytes copied in (producer)         */
+	uint64_t b_copy_out;      /**< Bytes copied out (consumer)        */
+};
+
+
+static void destructor(void *arg)
+{
+	struct auring *ar = arg;
+
+	mem_deref(ar->buf);
+}
+
+
+static void ring_put(struct auring *ar, size_t pos,
+		     const uint8_t *p, size_t sz)
+{
+	const size_t off = pos & (ar->size - 1);
+	const size_t n   = min(sz, ar->size - off);
+
+	memcpy(ar->buf + off, p, n);
+	memcpy(ar->buf, p + n, sz - n);
+}
+
+
+static void ring_get(const struct auring *ar, size_t pos,
+		     uint8_t *p, size_t sz)
+{
+	const size_t off = pos & (ar->size - 1);
+	const size_t n   = min(sz, ar->size - off);
+
+	memcpy(p, ar->buf + off, n);
+	memcpy(p + n, ar->buf, sz - n);
+}
+
+
+/**
+ * Allocate a new audio ring-buffer
+ *
+ * @param arp    Pointer to allocated ring-buffer
+ * @param min_sz Minimum number of bytes before reading starts
+ * @param max_sz Maximum number of bytes in the buffer
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int auring_alloc(struct auring **arp, size_t min_sz, size_t max_sz)
+{
+	struct auring *ar;
+	size_t size = 1;
+
+	if (!arp || !max_sz || min_sz > max_sz)
+		return EINVAL;
+
+	while (size < max_sz)
+		size <<= 1;
+
+	ar = mem_zalloc(sizeof(*ar), destructor);
+	if (!ar)
+		return ENOMEM;
+
+	ar->buf = mem_zalloc(size * 2, NULL);
+	if (!ar->buf) {
+		mem_deref(ar);
+		return ENOMEM;
+	}
+
+	ar->size    = size;
+	ar->min_sz  = min_sz;
+	ar->max_sz  = max_sz;
+	ar->filling = true;
+
+	*arp = ar;
+
+	return 0;
+}
+
+
+/**
+ * Write audio data to the ring-buffer
+ *
+ * @param ar Audio ring-buffer
+ * @param p  Audio data
+ * @param sz Number of bytes
+ *
+ * @return 0 if success, otherwise errorcode
+ *
+ * @note Must only be called from the producer thread
+ */
+int auring_write(struct auring *ar, const uint8_t *p, size_t sz)
+{
+	size_t wpos;
+
+	if (!ar || !p)
+		return EINVAL;
+
+	wpos = ar->wpos;
+
+	if (wpos - atom_load(&ar->rpos) + sz > ar->max_sz) {
+		++ar->n_overrun;
+		return 0;
+	}
+
+	ring_put(ar, wpos, p, sz);
+
+	ar->b_in      += sz;
+	ar->b_copy_in += sz;
+
+	atom_store(&ar->wpos, wpos + sz);
+
+	return 0;
+}
+
+
+/**
+ * Reserve a contiguous slot for writing at the write position
+ *
+ * @param ar  Audio ring-buffer
+ * @param szp Wanted number of bytes on input, slot size on output
+ *
+ * @return Pointer to the slot, NULL if the buffer is full
+ *
+ * @note Must only be called from the producer thread. The slot is not
+ *       visible to the consumer until auring_commit() is called
+ */
+uint8_t *auring_reserve(struct auring *ar, size_t *szp)
+{
+	size_t wpos, space;
+
+	if (!ar || !szp)
+		return NULL;
+
+	wpos  = ar->wpos;
+	space = ar->size - (wpos - atom_load(&ar->rpos));
+	if (!space)
+		return NULL;
+
+	*szp = min(*szp, space);
+
+	return ar->buf + (wpos & (ar->size - 1));
+}
+
+
+/**
+ * Commit data written into a slot from auring_reserve()
+ *
+ * @param ar Audio ring-buffer
+ * @param sz Number of bytes written into the slot
+ *
+ * @return 0 if success, otherwise errorcode
+ *
+ * @note Must only be called from the producer thread
+ */
+int auring_commit(struct auring *ar, size_t sz)
+{
+	size_t wpos, off;
+
+	if (!ar)
+		return EINVAL;
+
+	wpos = ar->wpos;
+
+	if (wpos - atom_load(&ar->rpos) + sz > ar->max_sz) {
+		++ar->n_overrun;
+		return 0;
+	}
+
+	off = wpos & (ar->size - 1);
+
+	/* move the part in the overflow area to the start of the ring */
+	if (off + sz > ar->size) {
+		const size_t n = off + sz - ar->size;
+
+		memcpy(ar->buf, ar->buf + ar->size, n);
+		ar->b_copy_in += n;
+	}
+
+	ar->b_in += sz;
+
+	atom_store(&ar->wpos, wpos + sz);
+
+	return 0;
+}
+
+
+/**
+ * Read audio data from the ring-buffer, silence is returned on underrun
+ *
+ * @param ar Audio ring-buffer
+ * @param p  Buffer for audio data
+ * @param sz Number of bytes to read
+ *
+ * @note Must only be called from the consumer thread
+ */
+void auring_read(struct auring *ar, uint8_t *p, size_t sz)
+{
+	size_t rpos, cur;
+
+	if (!ar || !p || !sz)
+		return;
+
+	rpos = ar->rpos;
+	cur  = atom_load(&ar->wpos) - rpos;
+
+	if (ar->filling) {
+
+		if (cur < ar->min_sz || cur < sz) {
+			memset(p, 0, sz);
+			return;
+		}
+
+		ar->filling = false;
+	}
+	else if (cur < sz) {
+
+		++ar->n_underrun;
+		ar->filling = true;
+		memset(p, 0, sz);
+		return;
+	}
+
+	ring_get(ar, rpos, p, sz);
+
+	ar->b_copy_out += sz;
+
+	atom_store(&ar->rpos, rpos + sz);
+}
+
+
+/**
+ * Timed read of audio data from the ring-buffer
+ *
+ * @param ar    Audio ring-buffer
+ * @param ptime Packet time in [ms]
+ * @param p     Buffer for audio data
+ * @param sz    Number of bytes to read
+ *
+ * @return 0 if data was read, ETIMEDOUT if it is too early to read
+ *
+ * @note Must only be called from the consumer thread
+ */
+int auring_get(struct auring *ar, uint32_t ptime, uint8_t *p, size_t sz)
+{
+	uint64_t now;
+
+	if (!ar || !ptime)
+		return EINVAL;
+
+	now = tmr_jiffies();
+	if (!ar->ts)
+		ar->ts = now;
+
+	if (now < ar->ts)
+		return ETIMEDOUT;
+
+	ar->ts += ptime;
+
+	auring_read(ar, p, sz);
+
+	return 0;
+}
+
+
+/**
+ * Get the current number of bytes in the ring-buffer
+ *
+ * @param ar Audio ring-buffer
+ *
+ * @return Number of bytes
+ */
+size_t auring_cur_size(const struct auring *ar)
+{
+	if (!ar)
+		return 0;
+
+	return ar->wpos - ar->rpos;
+}
+
+
+/**
+ * Get the statistics of an audio ring-buffer
+ *
+ * @param ar Audio ring-buffer
+ * @param st Statistics to fill in
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int auring_stats(const struct auring *ar, struct auring_stat *st)
+{
+	if (!ar || !st)
+		return EINVAL;
+
+	st->b_in   = ar->b_in;
+	st->b_copy = ar->b_copy_in + ar->b_copy_out;
+
+	return 0;
+}
+
+
+int auring_debug(struct re_printf *pf, const struct auring *ar)
+{
+	if (!ar)
+		return 0;
+
+	return re_hprintf(pf, "auring=%zu/%zu/%zu bytes"
+			  " (overrun=%u underrun=%u)",
+			  auring_cur_size(ar), ar->min_sz, ar->max_sz,
+			  ar->n_overrun, ar->n_underrun);
+}
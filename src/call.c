@@ -77,9 +77,39 @@ struct call {
 	int af;                   /**< Preferred Address Family             */
 	call_event_h *eh;         /**< Event handler                        */
 	void *arg;                /**< Handler argument                     */
+
+	/** Time when each setup phase completed, 0 if not traced [us] */
+	uint64_t tracev[CALL_PHASE_MAX];
+};
+
+
+enum {
+	TRACE_HIST_N = 16,  /**< Number of setup trace histogram buckets */
+};
+
+
+/** Upper bounds of the setup trace histogram buckets [us] */
+static const uint32_t trace_histv[TRACE_HIST_N - 1] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+	250000, 500000, 1000000, 2500000, 5000000
 };
 
 
+/**
+ * Setup time of each phase, for all traced calls that were established.
+ * The time of a phase is counted from the phase that completed before it,
+ * and the start phase holds the total setup time.
+ */
+static struct {
+	uint32_t hist[CALL_PHASE_MAX][TRACE_HIST_N];
+	uint32_t n[CALL_PHASE_MAX];    /**< Number of samples               */
+	uint32_t max[CALL_PHASE_MAX];  /**< Longest time [us]               */
+} trace;
+
+
+static uint32_t n_calls;  /**< Number of allocated calls, all UAs */
+
+
 static int send_invite(struct call *call);
 
 
@@ -261,6 +291,8 @@ static void mnat_handler(int err, uint16_t scode, const char *reason,
 		return;
 	}
 
+	call_trace(call, CALL_PHASE_MNAT);
+
 	/* Re-INVITE */
 	if (!call->mnat_wait) {
 		DEBUG_NOTICE("MNAT Established: Send Re-INVITE\n");
@@ -292,6 +324,8 @@ static int update_media(struct call *call)
 	struct le *le;
 	int err = 0;
 
+	call_trace(call, CALL_PHASE_SDP);
+
 	/* media attributes */
 	audio_sdp_attr_decode(call->audio);
 
@@ -359,6 +393,8 @@ static void call_destructor(void *arg)
 {
 	struct call *call = arg;
 
+	--n_calls;
+
 	if (call->state != STATE_IDLE)
 		print_summary(call);
 
@@ -464,8 +500,12 @@ int call_alloc(struct call **callp, struct list *lst,
 	if (!call)
 		return ENOMEM;
 
+	++n_calls;
+
 	MAGIC_INIT(call);
 
+	call_trace(call, CALL_PHASE_START);
+
 	tmr_init(&call->tmr_inv);
 
 	call->ua     = ua;
@@ -592,6 +632,8 @@ int call_alloc(struct call **callp, struct list *lst,
 
 	list_append(lst, &call->le, call);
 
+	call_trace(call, CALL_PHASE_ALLOC);
+
  out:
 	if (err)
 		mem_deref(call);
@@ -730,6 +772,8 @@ int call_answer(struct call *call, uint16_t scode)
 	(void)re_printf("answering call from %s with %u\n",
 			call->peer_uri, scode);
 
+	call_trace(call, CALL_PHASE_ANSWER);
+
 	if (call->got_offer) {
 
 		err = update_media(call);
@@ -914,6 +958,180 @@ void call_videoencoder_cycle(struct call *call)
 #endif
 
 
+static const char *phase_name(enum call_phase ph)
+{
+	switch (ph) {
+
+	case CALL_PHASE_START:   return "start";
+	case CALL_PHASE_ALLOC:   return "alloc";
+	case CALL_PHASE_MNAT:    return "mnat";
+	case CALL_PHASE_ANSWER:  return "answer";
+	case CALL_PHASE_SDP:     return "sdp";
+	case CALL_PHASE_ENCODER: return "encoder";
+	case CALL_PHASE_PLAYER:  return "player";
+	case CALL_PHASE_SOURCE:  return "source";
+	case CALL_PHASE_AUDIO:   return "audio";
+	case CALL_PHASE_ESTAB:   return "estab";
+	default:                 return "???";
+	}
+}
+
+
+/*
+ * Time since the phase that completed before, in [us]. The phases are
+ * ordered by time and not by number, the player and source are opened
+ * in a configurable order.
+ */
+static uint64_t trace_delta(const struct call *call, enum call_phase ph)
+{
+	const uint64_t t = call->tracev[ph];
+	uint64_t prev = call->tracev[CALL_PHASE_START];
+	int i;
+
+	for (i=0; i<CALL_PHASE_MAX; i++) {
+
+		const uint64_t ti = call->tracev[i];
+
+		if (!ti || ti < prev)
+			continue;
+
+		if (ti < t || (ti == t && i < (int)ph))
+			prev = ti;
+	}
+
+	return t - prev;
+}
+
+
+static void trace_hist_add(enum call_phase ph, uint64_t usec)
+{
+	const uint32_t us = (uint32_t)min(usec, UINT32_MAX);
+	size_t i;
+
+	for (i=0; i<ARRAY_SIZE(trace_histv); i++) {
+		if (us < trace_histv[i])
+			break;
+	}
+
+	++trace.hist[ph][i];
+	++trace.n[ph];
+	trace.max[ph] = max(trace.max[ph], us);
+}
+
+
+/* Upper bound of the p'th percentile of a phase [us] */
+static uint32_t trace_hist_pct(enum call_phase ph, uint32_t p)
+{
+	uint64_t cum = 0;
+	size_t i;
+
+	for (i=0; i<ARRAY_SIZE(trace_histv); i++) {
+
+		cum += trace.hist[ph][i];
+
+		if (cum * 100 >= (uint64_t)p * trace.n[ph])
+			return min(trace_histv[i], trace.max[ph]);
+	}
+
+	return trace.max[ph];
+}
+
+
+/**
+ * Record the time when a call setup phase completed. Only the first time
+ * of each phase is kept, and when the call is established the times are
+ * added to the histograms. Nothing is done unless tracing is enabled.
+ *
+ * @param call Call object
+ * @param ph   Call setup phase
+ */
+void call_trace(struct call *call, enum call_phase ph)
+{
+	int i;
+
+	if (!config.call.trace || !call || ph >= CALL_PHASE_MAX)
+		return;
+
+	if (call->tracev[ph])
+		return;
+
+	call->tracev[ph] = realtime_usec();
+
+	if (ph != CALL_PHASE_ESTAB || !call->tracev[CALL_PHASE_START])
+		return;
+
+	for (i=CALL_PHASE_START+1; i<CALL_PHASE_MAX; i++) {
+
+		if (call->tracev[i])
+			trace_hist_add(i, trace_delta(call, i));
+	}
+
+	trace_hist_add(CALL_PHASE_START, call->tracev[CALL_PHASE_ESTAB] -
+		       call->tracev[CALL_PHASE_START]);
+}
+
+
+/**
+ * Print the percentiles of the call setup time, per phase
+ *
+ * @param pf     Print handler
+ * @param unused Unused parameter
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int call_trace_debug(struct re_printf *pf, void *unused)
+{
+	int i, err;
+	(void)unused;
+
+	if (!config.call.trace)
+		return 0;
+
+	err = re_hprintf(pf, "call setup: %u traced calls\n"
+			 " phase         n      p50      p90      p99"
+			 "      max [ms]\n",
+			 trace.n[CALL_PHASE_START]);
+
+	for (i=0; i<CALL_PHASE_MAX; i++) {
+
+		if (!trace.n[i])
+			continue;
+
+		err |= re_hprintf(pf, " %-8s %6u %8.1f %8.1f %8.1f %8.1f\n",
+				  i == CALL_PHASE_START ? "total" :
+				  phase_name(i), trace.n[i],
+				  trace_hist_pct(i, 50) / 1000.0,
+				  trace_hist_pct(i, 90) / 1000.0,
+				  trace_hist_pct(i, 99) / 1000.0,
+				  trace.max[i] / 1000.0);
+	}
+
+	return err;
+}
+
+
+static int trace_print(struct re_printf *pf, const struct call *call)
+{
+	const uint64_t t0 = call->tracev[CALL_PHASE_START];
+	int i, err;
+
+	err = re_hprintf(pf, "setup trace [ms]:\n");
+
+	for (i=CALL_PHASE_START+1; i<CALL_PHASE_MAX; i++) {
+
+		if (!call->tracev[i])
+			continue;
+
+		err |= re_hprintf(pf, " %-8s +%8.1f (%.1f)\n",
+				  phase_name(i),
+				  (call->tracev[i] - t0) / 1000.0,
+				  trace_delta(call, i) / 1000.0);
+	}
+
+	return err;
+}
+
+
 int call_debug(struct re_printf *pf, const struct call *call)
 {
 	int err;
@@ -933,6 +1151,9 @@ int call_debug(struct re_printf *pf, const struct call *call)
 	/* SDP debug */
 	err |= sdp_session_debug(pf, call->sdp);
 
+	if (call->tracev[CALL_PHASE_START])
+		err |= trace_print(pf, call);
+
 	return err;
 }
 
@@ -1131,6 +1352,8 @@ static int sipsess_answer_handler(const struct sip_msg *msg, void *arg)
 
 	MAGIC_CHECK(call);
 
+	call_trace(call, CALL_PHASE_ANSWER);
+
 	(void)decode_multipart_sdp(&msg->ctype, msg->mb);
 
 	err = sdp_decode(call->sdp, msg->mb, false);
@@ -1162,6 +1385,7 @@ static void sipsess_estab_handler(const struct sip_msg *msg, void *arg)
 
 	call->play = mem_deref(call->play);
 	call_stream_start(call, true);
+	call_trace(call, CALL_PHASE_ESTAB);
 	call_event_handler(call, CALL_EVENT_ESTABLISHED, call->peer_uri);
 
 	/* the transferor will hangup this call */
@@ -1636,3 +1860,14 @@ int call_af(const struct call *call)
 {
 	return call ? call->af : AF_UNSPEC;
 }
+
+
+/**
+ * Get the number of calls of all User-Agents
+ *
+ * @return Number of calls
+ */
+uint32_t call_count(void)
+{
+	return n_calls;
+}
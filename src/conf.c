@@ -53,7 +53,9 @@ struct config config = {
 	{
 		16,
 		"",
-		""
+		"",
+		50,
+		10,
 	},
 
 	/** Audio */
@@ -66,6 +68,7 @@ struct config config = {
 		0,
 		0,
 		false,
+		0,
 	},
 
 	/** Video */
@@ -80,10 +83,25 @@ struct config config = {
 	{
 		0xb8,
 		{1024, 49152},
+		{0, 0},
+		0,
+		0,
+		0,
 		{512000, 1024000},
 		true,
 		false,
-		{5, 10}
+		{5, 10},
+		false,
+		0
+	},
+
+	/** Call admission */
+	{
+		4,
+		0,
+		0,
+		30,
+		false,
 	},
 
 	{
@@ -283,6 +301,10 @@ static int conf_write_config_template(const char *file)
 	(void)re_fprintf(f, "sip_trans_bsize\t\t128\n");
 	(void)re_fprintf(f, "#sip_listen\t\t127.0.0.1:5050\n");
 	(void)re_fprintf(f, "#sip_certificate\t\tcert.pem\n");
+	(void)re_fprintf(f, "sip_reg_rate\t\t%u\t\t# REGISTER per second\n",
+			 config.sip.reg_rate);
+	(void)re_fprintf(f, "sip_reg_spread\t\t%u\t\t# random delay,"
+			 " %% of regint\n", config.sip.reg_spread);
 
 	(void)re_fprintf(f, "\n# Audio\n");
 	(void)re_fprintf(f, "#audio_player\t\talsa,default\n");
@@ -296,6 +318,7 @@ static int conf_write_config_template(const char *file)
 			 config.audio.srate_src);
 	(void)re_fprintf(f, "#auplay_srate\t\t%u\n",
 			 config.audio.srate_play);
+	(void)re_fprintf(f, "#audio_mixer\t\t20\t\t# conference tick [ms]\n");
 
 #ifdef USE_VIDEO
 	(void)re_fprintf(f, "\n# Video\n");
@@ -310,11 +333,26 @@ static int conf_write_config_template(const char *file)
 	(void)re_fprintf(f, "\n# AVT - Audio/Video Transport\n");
 	(void)re_fprintf(f, "rtp_tos\t\t\t184\n");
 	(void)re_fprintf(f, "#rtp_ports\t\t\t10000-20000\n");
+	(void)re_fprintf(f, "#rtp_pool\t\t\t8-32\t\t# pre-bound sockets\n");
+	(void)re_fprintf(f, "#rtp_rxbatch\t\t\t16\t\t# datagrams per read\n");
+	(void)re_fprintf(f, "#rtp_rxbuf\t\t\t262144\t\t# [bytes]\n");
+	(void)re_fprintf(f, "#rtp_txbatch\t\t\t32\t\t# packets per send\n");
 	(void)re_fprintf(f, "#rtp_bandwidth\t\t\t512-1024 # [kbit/s]\n");
 	(void)re_fprintf(f, "rtcp_enable\t\t\tyes\n");
 	(void)re_fprintf(f, "rtcp_mux\t\t\tno\n");
 	(void)re_fprintf(f, "jitter_buffer_delay\t%u-%u\t\t# frames\n",
 			 config.avt.jbuf_del.min, config.avt.jbuf_del.max);
+	(void)re_fprintf(f, "#jitter_buffer_adaptive\tyes\n");
+	(void)re_fprintf(f, "#media_workers\t\t4\t\t# decoder threads\n");
+
+	(void)re_fprintf(f, "\n# Call admission\n");
+	(void)re_fprintf(f, "call_max_calls\t\t%u\t\t# per account\n",
+			 config.call.max_calls);
+	(void)re_fprintf(f, "#call_max_total\t\t100\t\t# all accounts\n");
+	(void)re_fprintf(f, "#call_max_load\t\t80\t\t# media load [%%]\n");
+	(void)re_fprintf(f, "#call_retry_after\t%u\t\t# [s]\n",
+			 config.call.retry_after);
+	(void)re_fprintf(f, "#call_trace\t\tyes\t\t# setup latency\n");
 
 	(void)re_fprintf(f, "\n# Network\n");
 	(void)re_fprintf(f, "#dns_server\t\t10.0.0.1:53\n");
@@ -428,10 +466,12 @@ static int conf_write_config_template(const char *file)
 	(void)re_fprintf(f, "# Application Modules\n");
 	(void)re_fprintf(f, "\n");
 	(void)re_fprintf(f, "#module_app\t\t" MOD_PRE "auloop"MOD_EXT"\n");
+	(void)re_fprintf(f, "#module_app\t\t" MOD_PRE "codecbench"MOD_EXT"\n");
 	(void)re_fprintf(f, "module_app\t\t"  MOD_PRE "contact"MOD_EXT"\n");
 	(void)re_fprintf(f, "module_app\t\t"  MOD_PRE "menu"MOD_EXT"\n");
 	(void)re_fprintf(f, "#module_app\t\t" MOD_PRE "natbd"MOD_EXT"\n");
 	(void)re_fprintf(f, "#module_app\t\t" MOD_PRE "presence"MOD_EXT"\n");
+	(void)re_fprintf(f, "#module_app\t\t" MOD_PRE "regstub"MOD_EXT"\n");
 	(void)re_fprintf(f, "#module_app\t\t" MOD_PRE "syslog"MOD_EXT"\n");
 	(void)re_fprintf(f, "#module_app\t\t" MOD_PRE "vidloop"MOD_EXT"\n");
 	(void)re_fprintf(f, "\n");
@@ -449,6 +489,29 @@ static int conf_write_config_template(const char *file)
 	(void)re_fprintf(f, "speex_vad\t\t0 # Voice Activity Detection 0-1\n");
 	(void)re_fprintf(f, "speex_agc_level\t8000\n");
 
+	(void)re_fprintf(f, "\n# Video codec (avcodec)\n");
+	(void)re_fprintf(f, "#avcodec_h264_stap	no	"
+			 "# aggregate small NAL units\n");
+	(void)re_fprintf(f, "#avcodec_h264_file	/path/to/input.264\n");
+	(void)re_fprintf(f, "#avcodec_dec_threading\tslice\t"
+			 "# none, slice or frame\n");
+	(void)re_fprintf(f, "#avcodec_dec_threads\t0\t# 0 is automatic\n");
+	(void)re_fprintf(f, "#avcodec_dec_max_delay\t2\t"
+			 "# frame threading delay [frames]\n");
+
+	(void)re_fprintf(f, "\n# VP8 encoder (vpx)\n");
+	(void)re_fprintf(f, "#vpx_threads\t\t0\t# 0 is automatic\n");
+	(void)re_fprintf(f, "#vpx_token_partitions\t1\t# 0-3 (log2)\n");
+	(void)re_fprintf(f, "#vpx_cpuused\t\t16\t# 0-16\n");
+
+	(void)re_fprintf(f, "\n# Codec benchmark\n");
+	(void)re_fprintf(f, "#codecbench_frames\t500\n");
+	(void)re_fprintf(f, "#codecbench_wav\t\t/path/to/input.wav\n");
+
+	(void)re_fprintf(f, "\n# Stub registrar\n");
+	(void)re_fprintf(f, "#regstub_fail\t\t10\t# 503 replies [%%]\n");
+	(void)re_fprintf(f, "#regstub_expires\t3600\t# [s]\n");
+
 	(void)re_fprintf(f, "\n# NAT Behavior Discovery\n");
 	(void)re_fprintf(f, "natbd_server\t\tcreytiv.com\n");
 	(void)re_fprintf(f, "natbd_interval\t\t600\t\t# in seconds\n");
@@ -694,6 +757,8 @@ static int config_parse(struct conf *conf)
 			   sizeof(config.sip.local));
 	(void)conf_get_str(conf, "sip_certificate", config.sip.cert,
 			   sizeof(config.sip.cert));
+	(void)conf_get_u32(conf, "sip_reg_rate", &config.sip.reg_rate);
+	(void)conf_get_u32(conf, "sip_reg_spread", &config.sip.reg_spread);
 
 	/* Audio */
 	(void)conf_get_csv(conf, "audio_player",
@@ -716,6 +781,7 @@ static int config_parse(struct conf *conf)
 	(void)conf_get_range(conf, "audio_channels", &config.audio.channels);
 	(void)conf_get_u32(conf, "ausrc_srate", &config.audio.srate_src);
 	(void)conf_get_u32(conf, "auplay_srate", &config.audio.srate_play);
+	(void)conf_get_u32(conf, "audio_mixer", &config.audio.mix_ptime);
 
 	if (0 == conf_get(conf, "audio_source", &as) &&
 	    0 == conf_get(conf, "audio_player", &ap))
@@ -736,6 +802,10 @@ static int config_parse(struct conf *conf)
 	if (0 == conf_get_u32(conf, "rtp_tos", &v))
 		config.avt.rtp_tos = v;
 	(void)conf_get_range(conf, "rtp_ports", &config.avt.rtp_ports);
+	(void)conf_get_range(conf, "rtp_pool", &config.avt.rtp_pool);
+	(void)conf_get_u32(conf, "rtp_rxbatch", &config.avt.rtp_rxbatch);
+	(void)conf_get_u32(conf, "rtp_rxbuf", &config.avt.rtp_rxbuf);
+	(void)conf_get_u32(conf, "rtp_txbatch", &config.avt.rtp_txbatch);
 	if (0 == conf_get_range(conf, "rtp_bandwidth",
 				&config.avt.rtp_bw)) {
 		config.avt.rtp_bw.min *= 1024;
@@ -745,6 +815,17 @@ static int config_parse(struct conf *conf)
 	(void)conf_get_bool(conf, "rtcp_mux", &config.avt.rtcp_mux);
 	(void)conf_get_range(conf, "jitter_buffer_delay",
 			     &config.avt.jbuf_del);
+	(void)conf_get_bool(conf, "jitter_buffer_adaptive",
+			    &config.avt.jbuf_adaptive);
+	(void)conf_get_u32(conf, "media_workers", &config.avt.workers);
+
+	/* Call admission */
+	(void)conf_get_u32(conf, "call_max_calls", &config.call.max_calls);
+	(void)conf_get_u32(conf, "call_max_total", &config.call.max_total);
+	(void)conf_get_u32(conf, "call_max_load", &config.call.max_load);
+	(void)conf_get_u32(conf, "call_retry_after",
+			   &config.call.retry_after);
+	(void)conf_get_bool(conf, "call_trace", &config.call.trace);
 
 	if (err) {
 		DEBUG_WARNING("configure parse error (%m)\n", err);
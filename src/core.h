@@ -31,6 +31,66 @@ struct auplay {
 };
 
 
+/*
+ * Audio Ring-buffer
+ */
+
+struct auring;
+
+/** Audio ring-buffer statistics */
+struct auring_stat {
+	uint64_t b_in;     /**< Number of bytes written           */
+	uint64_t b_copy;   /**< Number of bytes copied in and out */
+};
+
+int    auring_alloc(struct auring **arp, size_t min_sz, size_t max_sz);
+int    auring_write(struct auring *ar, const uint8_t *p, size_t sz);
+uint8_t *auring_reserve(struct auring *ar, size_t *szp);
+int    auring_commit(struct auring *ar, size_t sz);
+void   auring_read(struct auring *ar, uint8_t *p, size_t sz);
+int    auring_get(struct auring *ar, uint32_t ptime, uint8_t *p, size_t sz);
+size_t auring_cur_size(const struct auring *ar);
+int    auring_stats(const struct auring *ar, struct auring_stat *st);
+int    auring_debug(struct re_printf *pf, const struct auring *ar);
+
+static inline int auring_write_samp(struct auring *ar, const int16_t *sampv,
+				    size_t sampc)
+{
+	return auring_write(ar, (const uint8_t *)sampv, sampc * 2);
+}
+
+static inline int auring_get_samp(struct auring *ar, uint32_t ptime,
+				  int16_t *sampv, size_t sampc)
+{
+	return auring_get(ar, ptime, (uint8_t *)sampv, sampc * 2);
+}
+
+
+/*
+ * Audio Resampler
+ */
+
+struct resamp;
+
+int resamp_alloc(struct resamp **rsp, size_t maxsamp,
+		 uint32_t irate, uint8_t ich, uint32_t orate, uint8_t och);
+int resamp_process(struct resamp *rs, int16_t *outv, size_t *outc,
+		   const int16_t *inv, size_t inc);
+const char *resamp_kernel_name(const struct resamp *rs);
+
+
+/*
+ * Audio Mixer
+ */
+
+struct aumix_source;
+
+int aumix_source_alloc(struct aumix_source **srcp, uint32_t srate,
+		       uint8_t ch, ausrc_read_h *frameh, void *arg);
+int aumix_source_put(struct aumix_source *src, uint32_t srate, uint8_t ch,
+		     const int16_t *sampv, size_t sampc);
+
+
 /*
  * Audio Source
  */
@@ -80,6 +140,25 @@ int bfcp_alloc(struct bfcp **bfcpp, struct sdp_session *sdp_sess,
 int bfcp_start(struct bfcp *bfcp);
 
 
+/*
+ * Batched UDP I/O
+ */
+
+struct udprx;
+
+int udprx_alloc(struct udprx **rxp, struct udp_sock *us, int af,
+		uint32_t n, size_t bufsz);
+int udprx_debug(struct re_printf *pf, const struct udprx *rx);
+
+struct udptx;
+
+int  udptx_alloc(struct udptx **txp, struct udp_sock *us, int af,
+		 uint32_t n);
+void udptx_begin(struct udptx *tx);
+void udptx_flush(struct udptx *tx);
+int  udptx_debug(struct re_printf *pf, const struct udptx *tx);
+
+
 /*
  * Call Control
  */
@@ -132,6 +211,27 @@ int call_reset_transp(struct call *call);
 int call_notify_sipfrag(struct call *call, uint16_t scode,
 			const char *reason, ...);
 int call_af(const struct call *call);
+uint32_t call_count(void);
+
+
+/** Phases of call setup, in the order they normally complete */
+enum call_phase {
+	CALL_PHASE_START,    /**< Call allocation started              */
+	CALL_PHASE_ALLOC,    /**< Call and media streams allocated     */
+	CALL_PHASE_MNAT,     /**< Media NAT gathering done             */
+	CALL_PHASE_ANSWER,   /**< Answered, locally or by the peer     */
+	CALL_PHASE_SDP,      /**< SDP negotiated, media updated        */
+	CALL_PHASE_ENCODER,  /**< Audio encoder initialised            */
+	CALL_PHASE_PLAYER,   /**< Audio player opened                  */
+	CALL_PHASE_SOURCE,   /**< Audio source opened                  */
+	CALL_PHASE_AUDIO,    /**< Audio stream started                 */
+	CALL_PHASE_ESTAB,    /**< Call established                     */
+
+	CALL_PHASE_MAX
+};
+
+void call_trace(struct call *call, enum call_phase ph);
+int  call_trace_debug(struct re_printf *pf, void *unused);
 
 
 /*
@@ -141,6 +241,17 @@ int call_af(const struct call *call);
 int mctrl_handle_media_control(struct pl *body, bool *pfu);
 
 
+/*
+ * Media load
+ */
+
+int  load_init(void);
+void load_close(void);
+void load_add(uint32_t usec);
+bool load_admit(void);
+int  load_debug(struct re_printf *pf, void *unused);
+
+
 /*
  * Media NAT traversal
  */
@@ -186,6 +297,7 @@ bool reg_isok(const struct reg *reg);
 int  reg_sipfd(const struct reg *reg);
 int  reg_debug(struct re_printf *pf, const struct reg *reg);
 int  reg_status(struct re_printf *pf, const struct reg *reg);
+int  reg_sched_debug(struct re_printf *pf, void *unused);
 
 
 /*
@@ -199,6 +311,19 @@ int  rtpkeep_alloc(struct rtpkeep **rkp, const char *method, int proto,
 void rtpkeep_refresh(struct rtpkeep *rk, uint32_t ts);
 
 
+/*
+ * RTP socket pool
+ */
+
+struct rtppool_sock;
+
+void rtppool_init(int af);
+void rtppool_close(void);
+int  rtppool_take(struct rtppool_sock **psp, int af,
+		  rtp_recv_h *recvh, rtcp_recv_h *rtcph, void *arg);
+struct rtp_sock *rtppool_rtp(const struct rtppool_sock *ps);
+
+
 /*
  * SIP Request
  */
@@ -215,6 +340,7 @@ struct stream;
 struct rtp_header;
 
 enum {STREAM_PRESZ = 4+12}; /* same as RTP_HEADER_SIZE */
+enum {RTP_RECV_SIZE = 8192}; /* receive buffer for incoming RTP */
 
 typedef void (stream_rtp_h)(const struct rtp_header *hdr, struct mbuf *mb,
 			    void *arg);
@@ -231,6 +357,8 @@ int  stream_start(struct stream *s);
 void stream_start_keepalive(struct stream *s);
 int  stream_send(struct stream *s, bool marker, int pt, uint32_t ts,
 		 struct mbuf *mb);
+void stream_tx_begin(struct stream *s);
+void stream_tx_flush(struct stream *s);
 void stream_update(struct stream *s, const char *cname);
 void stream_update_encoder(struct stream *s, int pt_enc);
 int  stream_jbuf_stat(struct re_printf *pf, const struct stream *s);
@@ -242,6 +370,25 @@ void stream_set_bw(struct stream *s, uint32_t bps);
 bool stream_has_media(const struct stream *s);
 int  stream_debug(struct re_printf *pf, const struct stream *s);
 int  stream_print(struct re_printf *pf, const struct stream *s);
+void stream_rx_sync(struct stream *s);
+bool stream_rx_async(const struct stream *s);
+
+
+/*
+ * Media worker threads
+ */
+
+struct mworker;
+
+int  mworker_init(uint32_t n);
+void mworker_close(void);
+struct mworker *mworker_assign(void);
+void mworker_release(struct mworker *w);
+int  mworker_push(struct mworker *w, stream_rtp_h *rtph,
+		  const struct rtp_header *hdr, struct mbuf *mb, void *arg);
+void mworker_sync(struct mworker *w);
+uint32_t mworker_load(void);
+int  mworker_debug(struct re_printf *pf, const struct mworker *w);
 
 
 /*
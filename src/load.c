@@ -0,0 +1,154 @@
+/**
+ * @file load.c  Media load measurement and call admission
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+#include "atomic.h"
+
+
+#define DEBUG_MODULE "load"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
+
+/*
+ * The media threads add the time spent on encoding, decoding and mixing
+ * to a shared counter. Once a second the counter is sampled on the main
+ * thread, together with the busy time of the media worker threads.
+ *
+ * The media load is the processing time relative to the capacity of all
+ * CPUs, and the worker load is the busy time of the most loaded worker.
+ * A single saturated worker delays all streams that are pinned to it,
+ * even if the other CPUs are idle.
+ */
+
+enum {
+	LOAD_INTERVAL = 1000,  /**< Sampling interval [ms]              */
+};
+
+
+static struct {
+	struct tmr tmr;
+	volatile size_t usec;  /**< Media processing time [us], wraps  */
+	size_t usec_prev;      /**< Value at the last sample            */
+	uint64_t ts_prev;      /**< Time of the last sample [ms]        */
+	unsigned ncpu;         /**< Number of CPUs                      */
+	uint32_t media;        /**< Media load, smoothed [%]            */
+	uint32_t media_max;    /**< Highest media load [%]              */
+	uint32_t worker;       /**< Load of busiest worker [%]          */
+	uint32_t n_reject;     /**< Calls rejected by admission        */
+} load;
+
+
+static unsigned cpu_count(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	const long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n > 0)
+		return (unsigned)n;
+#endif
+	return 1;
+}
+
+
+static void tmr_handler(void *arg)
+{
+	const uint64_t now = tmr_jiffies();
+	const size_t usec = atom_load(&load.usec);
+	uint64_t dt;
+	uint32_t pct;
+	(void)arg;
+
+	tmr_start(&load.tmr, LOAD_INTERVAL, tmr_handler, NULL);
+
+	dt = max(now - load.ts_prev, 1);
+
+	pct = (uint32_t)((size_t)(usec - load.usec_prev) / 10 /
+			 (dt * load.ncpu));
+
+	/* smoothed over about 4 seconds, a short peak is no overload */
+	load.media     = (3 * load.media + pct) / 4;
+	load.media_max = max(load.media_max, load.media);
+	load.worker    = mworker_load();
+
+	load.usec_prev = usec;
+	load.ts_prev   = now;
+}
+
+
+/**
+ * Start the media load measurement
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int load_init(void)
+{
+	load.ncpu    = cpu_count();
+	load.ts_prev = tmr_jiffies();
+
+	tmr_init(&load.tmr);
+
+	tmr_start(&load.tmr, LOAD_INTERVAL, tmr_handler, NULL);
+
+	return 0;
+}
+
+
+void load_close(void)
+{
+	tmr_cancel(&load.tmr);
+}
+
+
+/**
+ * Add media processing time, may be called from any thread
+ *
+ * @param usec Processing time in [us]
+ */
+void load_add(uint32_t usec)
+{
+	atom_add(&load.usec, usec);
+}
+
+
+/**
+ * Check if a new call can be admitted, with the configured call limits
+ * and the measured media load
+ *
+ * @return True if the call can be admitted, otherwise false
+ */
+bool load_admit(void)
+{
+	const uint32_t lmax = config.call.max_load;
+	bool ok = true;
+
+	if (config.call.max_total && call_count() >= config.call.max_total)
+		ok = false;
+
+	if (lmax && (load.media >= lmax || load.worker >= lmax))
+		ok = false;
+
+	if (!ok)
+		++load.n_reject;
+
+	return ok;
+}
+
+
+int load_debug(struct re_printf *pf, void *unused)
+{
+	(void)unused;
+
+	return re_hprintf(pf, "load: calls=%u/%u media=%u%% (max %u%%)"
+			  " worker=%u%% cpus=%u limit=%u%% rejected=%u\n",
+			  call_count(), config.call.max_total,
+			  load.media, load.media_max, load.worker,
+			  load.ncpu, config.call.max_load, load.n_reject);
+}
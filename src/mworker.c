@@ -0,0 +1,476 @@
+/**
+ * @file mworker.c  Media worker threads
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+#define DEBUG_MODULE "mworker"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
+
+/**
+ * \page MediaWorker Media worker threads
+ *
+ * A pool of worker threads for decoding incoming media. Each media stream
+ * is pinned to one worker, so all packets of a stream are decoded in order
+ * by the same thread.
+ *
+ * The RTP packets are received on the main thread and the packet buffer
+ * is handed over to the worker without copying. When a packet has been
+ * decoded, the buffer is returned to the main thread for release, so that
+ * all reference counting is done on the main thread.
+ */
+
+
+#ifdef HAVE_PTHREAD
+
+/** Defines a media worker thread */
+struct mworker {
+	pthread_t tid;              /**< Worker thread                     */
+	pthread_mutex_t mutex;      /**< Protects the job lists            */
+	pthread_cond_t cond;        /**< Signalled when a job is queued    */
+	pthread_cond_t cond_idle;   /**< Signalled when the worker is idle */
+	struct list jobl;           /**< Queued jobs (struct mjob)         */
+	struct list donel;          /**< Finished jobs, to be released     */
+	struct mqueue *mq;          /**< Wakes up the main thread          */
+	unsigned idx;               /**< Worker index                      */
+	unsigned nstreams;          /**< Number of pinned streams          */
+	bool run;                   /**< Worker thread is running          */
+	bool busy;                  /**< A job is being processed          */
+	struct {
+		uint32_t depth;     /**< Current queue depth               */
+		uint32_t depth_max; /**< Maximum queue depth               */
+		uint32_t n_jobs;    /**< Number of processed jobs          */
+		uint32_t n_sync;    /**< Number of blocking synchronizes   */
+		uint64_t usec;      /**< Total busy time [us]              */
+		uint64_t usec_prev; /**< Busy time at the last load sample */
+	} stats;
+};
+
+/** Defines a job, i.e. one received RTP packet */
+struct mjob {
+	struct le le;               /**< Linked list element               */
+	struct rtp_header hdr;      /**< RTP header                        */
+	struct mbuf *mb;            /**< RTP payload, NULL if lost         */
+	stream_rtp_h *rtph;         /**< Stream RTP handler                */
+	void *arg;                  /**< Handler argument                  */
+};
+
+
+static struct {
+	struct mworker **wv;        /**< Worker threads                    */
+	uint32_t wc;                /**< Number of worker threads          */
+	uint64_t ts_load;           /**< Time of the last load sample [us] */
+} pool;
+
+
+static void job_destructor(void *arg)
+{
+	struct mjob *job = arg;
+
+	mem_deref(job->mb);
+}
+
+
+static void *worker_thread(void *arg)
+{
+	struct mworker *w = arg;
+
+	pthread_mutex_lock(&w->mutex);
+
+	while (w->run) {
+
+		struct mjob *job;
+		uint64_t start, usec;
+		bool notify;
+
+		if (list_isempty(&w->jobl)) {
+			pthread_cond_broadcast(&w->cond_idle);
+			pthread_cond_wait(&w->cond, &w->mutex);
+			continue;
+		}
+
+		job = list_ledata(list_head(&w->jobl));
+		list_unlink(&job->le);
+		--w->stats.depth;
+		w->busy = true;
+
+		pthread_mutex_unlock(&w->mutex);
+
+		start = realtime_usec();
+
+		job->rtph(&job->hdr, job->mb, job->arg);
+
+		usec = realtime_usec() - start;
+
+		pthread_mutex_lock(&w->mutex);
+
+		w->busy = false;
+		++w->stats.n_jobs;
+		w->stats.usec += usec;
+
+		notify = list_isempty(&w->donel);
+		list_append(&w->donel, &job->le, job);
+
+		if (notify)
+			(void)mqueue_push(w->mq, 0, NULL);
+	}
+
+	pthread_cond_broadcast(&w->cond_idle);
+	pthread_mutex_unlock(&w->mutex);
+
+	return NULL;
+}
+
+
+/* Release finished jobs on the main thread */
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	struct mworker *w = arg;
+	struct list donel;
+	(void)id;
+	(void)data;
+
+	pthread_mutex_lock(&w->mutex);
+	donel = w->donel;
+	list_init(&w->donel);
+	pthread_mutex_unlock(&w->mutex);
+
+	list_flush(&donel);
+}
+
+
+static void worker_destructor(void *arg)
+{
+	struct mworker *w = arg;
+
+	if (w->run) {
+		pthread_mutex_lock(&w->mutex);
+		w->run = false;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->mutex);
+
+		pthread_join(w->tid, NULL);
+	}
+
+	list_flush(&w->jobl);
+	list_flush(&w->donel);
+	mem_deref(w->mq);
+
+	pthread_cond_destroy(&w->cond_idle);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->mutex);
+}
+
+
+static int worker_alloc(struct mworker **wp, unsigned idx)
+{
+	struct mworker *w;
+	int err;
+
+	w = mem_zalloc(sizeof(*w), worker_destructor);
+	if (!w)
+		return ENOMEM;
+
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	pthread_cond_init(&w->cond_idle, NULL);
+
+	w->idx = idx;
+
+	err = mqueue_alloc(&w->mq, mqueue_handler, w);
+	if (err)
+		goto out;
+
+	w->run = true;
+	err = pthread_create(&w->tid, NULL, worker_thread, w);
+	if (err) {
+		w->run = false;
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(w);
+	else
+		*wp = w;
+
+	return err;
+}
+
+
+/**
+ * Initialise the pool of media worker threads
+ *
+ * @param n Number of worker threads, 0 to decode on the main thread
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mworker_init(uint32_t n)
+{
+	uint32_t i;
+	int err = 0;
+
+	if (!n)
+		return 0;
+
+	pool.wv = mem_zalloc(n * sizeof(*pool.wv), NULL);
+	if (!pool.wv)
+		return ENOMEM;
+
+	for (i=0; i<n; i++) {
+
+		err = worker_alloc(&pool.wv[i], i);
+		if (err) {
+			DEBUG_WARNING("worker %u: %m\n", i, err);
+			break;
+		}
+
+		++pool.wc;
+	}
+
+	if (err)
+		mworker_close();
+	else
+		(void)re_printf("media workers: %u threads\n", pool.wc);
+
+	return err;
+}
+
+
+/**
+ * Close the pool of media worker threads
+ */
+void mworker_close(void)
+{
+	uint32_t i;
+
+	for (i=0; i<pool.wc; i++)
+		mem_deref(pool.wv[i]);
+
+	pool.wv = mem_deref(pool.wv);
+	pool.wc = 0;
+}
+
+
+/**
+ * Pin a media stream to the least loaded worker thread
+ *
+ * @return Worker thread (referenced), NULL if the pool is disabled
+ */
+struct mworker *mworker_assign(void)
+{
+	struct mworker *w = NULL;
+	uint32_t i;
+
+	for (i=0; i<pool.wc; i++) {
+
+		if (!w || pool.wv[i]->nstreams < w->nstreams)
+			w = pool.wv[i];
+	}
+
+	if (!w)
+		return NULL;
+
+	++w->nstreams;
+
+	return mem_ref(w);
+}
+
+
+/**
+ * Unpin a media stream from its worker thread
+ *
+ * @param w Worker thread
+ */
+void mworker_release(struct mworker *w)
+{
+	if (!w)
+		return;
+
+	--w->nstreams;
+	mem_deref(w);
+}
+
+
+/**
+ * Queue a received RTP packet for decoding on a worker thread
+ *
+ * @param w    Worker thread
+ * @param rtph Stream RTP handler, called from the worker thread
+ * @param hdr  RTP header
+ * @param mb   RTP payload (referenced), NULL if lost
+ * @param arg  Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mworker_push(struct mworker *w, stream_rtp_h *rtph,
+		 const struct rtp_header *hdr, struct mbuf *mb, void *arg)
+{
+	struct mjob *job;
+
+	if (!w || !rtph || !hdr)
+		return EINVAL;
+
+	job = mem_zalloc(sizeof(*job), job_destructor);
+	if (!job)
+		return ENOMEM;
+
+	job->hdr  = *hdr;
+	job->mb   = mem_ref(mb);
+	job->rtph = rtph;
+	job->arg  = arg;
+
+	pthread_mutex_lock(&w->mutex);
+
+	list_append(&w->jobl, &job->le, job);
+
+	if (++w->stats.depth > w->stats.depth_max)
+		w->stats.depth_max = w->stats.depth;
+
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+
+	return 0;
+}
+
+
+/**
+ * Wait until all queued packets are processed by a worker thread
+ *
+ * @param w Worker thread
+ */
+void mworker_sync(struct mworker *w)
+{
+	if (!w || pthread_equal(pthread_self(), w->tid))
+		return;
+
+	pthread_mutex_lock(&w->mutex);
+
+	if (w->busy || !list_isempty(&w->jobl))
+		++w->stats.n_sync;
+
+	while (w->run && (w->busy || !list_isempty(&w->jobl)))
+		pthread_cond_wait(&w->cond_idle, &w->mutex);
+
+	pthread_mutex_unlock(&w->mutex);
+}
+
+
+/**
+ * Get the load of the most loaded worker thread, since the last call
+ *
+ * @return Busy time of the worker in [%]
+ */
+uint32_t mworker_load(void)
+{
+	const uint64_t now = realtime_usec();
+	const uint64_t dt = max(now - pool.ts_load, 1);
+	uint32_t i, pct = 0;
+
+	for (i=0; i<pool.wc; i++) {
+
+		struct mworker *w = pool.wv[i];
+		uint64_t usec;
+
+		pthread_mutex_lock(&w->mutex);
+		usec = w->stats.usec;
+		pthread_mutex_unlock(&w->mutex);
+
+		pct = max(pct, (uint32_t)((usec - w->stats.usec_prev) * 100 /
+					   dt));
+		w->stats.usec_prev = usec;
+	}
+
+	pool.ts_load = now;
+
+	return pct;
+}
+
+
+int mworker_debug(struct re_printf *pf, const struct mworker *w)
+{
+	if (!w)
+		return 0;
+
+	return re_hprintf(pf, " worker: #%u streams=%u queue=%u (max %u)"
+			  " jobs=%u sync=%u\n",
+			  w->idx, w->nstreams,
+			  w->stats.depth, w->stats.depth_max,
+			  w->stats.n_jobs, w->stats.n_sync);
+}
+
+
+#else
+
+
+int mworker_init(uint32_t n)
+{
+	if (n) {
+		DEBUG_WARNING("media workers: no thread support\n");
+	}
+
+	return 0;
+}
+
+
+void mworker_close(void)
+{
+}
+
+
+struct mworker *mworker_assign(void)
+{
+	return NULL;
+}
+
+
+void mworker_release(struct mworker *w)
+{
+	(void)w;
+}
+
+
+int mworker_push(struct mworker *w, stream_rtp_h *rtph,
+		 const struct rtp_header *hdr, struct mbuf *mb, void *arg)
+{
+	(void)w;
+	(void)rtph;
+	(void)hdr;
+	(void)mb;
+	(void)arg;
+
+	return ENOSYS;
+}
+
+
+void mworker_sync(struct mworker *w)
+{
+	(void)w;
+}
+
+
+uint32_t mworker_load(void)
+{
+	return 0;
+}
+
+
+int mworker_debug(struct re_printf *pf, const struct mworker *w)
+{
+	(void)pf;
+	(void)w;
+
+	return 0;
+}
+
+
+#endif
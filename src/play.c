@@ -9,6 +9,7 @@
 #include <rem.h>
 #include <baresip.h>
 #include "core.h"
+#include "atomic.h"
 
 
 #define DEBUG_MODULE "play"
@@ -18,21 +19,83 @@
 
 enum {SILENCE_DUR = 2000};
 
-/** Audio file player */
+/** Maximum size of the audio file cache [bytes] */
+enum {CACHE_MAX = 4 * 1024 * 1024};
+
+enum {
+	STRESS_PLAYERS = 100,   /**< Number of players in stress test  */
+	STRESS_SRATE   = 8000,  /**< Sampling rate of stress test tone */
+};
+
+/** Playback state, changed with atomic operations */
+enum play_state {
+	PLAY_RUN = 0,  /**< Playing, the audio thread owns the cursor */
+	PLAY_EOF,      /**< End of buffer, the main thread owns it    */
+	PLAY_STOP,     /**< Stopping, only silence is played          */
+};
+
+/**
+ * Audio file player. The PCM buffer may be shared with other players,
+ * so it is only read, and each player has its own position.
+ *
+ * The audio thread never blocks. It advances the cursor while the state
+ * is PLAY_RUN, and sets PLAY_EOF at the end of the buffer. The main
+ * thread then owns the cursor, and rewinds it before it sets PLAY_RUN
+ * again for the next repetition.
+ */
 struct play {
 	struct le le;
 	struct play **playp;
-	struct lock *lock;
-	struct mbuf *mb;
+	struct mbuf *mb;        /**< PCM buffer, read-only          */
+	volatile size_t pos;    /**< Playback position in buffer    */
+	volatile size_t state;  /**< Playback state (play_state)    */
 	struct auplay_st *auplay;
 	struct tmr tmr;
 	int repeat;
-	bool eof;
+	uint32_t srate;         /**< Sampling rate                  */
+	uint8_t ch;             /**< Number of channels             */
+
+	/* written by the audio thread */
+	uint64_t ts_last;       /**< Time of last callback [us]     */
+	uint32_t n_write;       /**< Number of callbacks            */
+	uint32_t n_late;        /**< Callbacks late by a period     */
+	uint32_t gap_max;       /**< Longest callback interval [us] */
+};
+
+/** Decoded audio file, cached and shared by all its players */
+struct prompt {
+	struct le le;
+	char *path;           /**< Full path of the audio file    */
+	struct mbuf *mb;      /**< Decoded 16-bit PCM             */
+	uint32_t srate;       /**< Sampling rate                  */
+	uint8_t ch;           /**< Number of channels             */
+	uint32_t n_play;      /**< Number of times played         */
 };
 
 
 static struct list playl;
 
+/**
+ * Cache of decoded audio files, keyed by path, in least recently used
+ * order. The players hold a reference to the PCM buffer, so a file can
+ * be evicted while it is playing.
+ */
+static struct {
+	struct list promptl;
+	size_t bytes;
+	uint32_t n_hit;
+	uint32_t n_miss;
+	uint32_t n_evict;
+} cache;
+
+/** Totals of the players that have finished */
+static struct {
+	uint32_t n_play;
+	uint32_t n_write;
+	uint32_t n_late;
+	uint32_t gap_max;
+} totals;
+
 
 static void tmr_polling(void *arg);
 
@@ -48,14 +111,11 @@ static void tmr_repeat(void *arg)
 {
 	struct play *play = arg;
 
-	lock_write_get(play->lock);
-
-	play->mb->pos = 0;
-	play->eof = false;
+	/* the cursor is owned by the main thread in PLAY_EOF */
+	atom_store(&play->pos, 0);
+	(void)atom_cas(&play->state, PLAY_EOF, PLAY_RUN);
 
 	tmr_start(&play->tmr, 1000, tmr_polling, arg);
-
-	lock_rel(play->lock);
 }
 
 
@@ -63,11 +123,9 @@ static void tmr_polling(void *arg)
 {
 	struct play *play = arg;
 
-	lock_write_get(play->lock);
-
 	tmr_start(&play->tmr, 1000, tmr_polling, arg);
 
-	if (play->eof) {
+	if (atom_load(&play->state) == PLAY_EOF) {
 		if (play->repeat > 0)
 			play->repeat--;
 
@@ -76,35 +134,59 @@ static void tmr_polling(void *arg)
 		else
 			tmr_start(&play->tmr, SILENCE_DUR, tmr_repeat, arg);
 	}
+}
+
+
+/* Count the callbacks that come later than one period after the last */
+static void write_stats(struct play *play, size_t sz)
+{
+	const uint64_t now = realtime_usec();
+	const uint64_t period = (uint64_t)sz / 2 / max(play->ch, 1)
+		* 1000000 / max(play->srate, 1);
+
+	if (play->ts_last) {
+		const uint64_t gap = now - play->ts_last;
+
+		if (gap > 2 * period)
+			++play->n_late;
+
+		play->gap_max = max(play->gap_max, (uint32_t)gap);
+	}
 
-	lock_rel(play->lock);
+	play->ts_last = now;
+	++play->n_write;
 }
 
 
 /**
+ * Called from the real-time audio thread, and must not block
+ *
  * NOTE: DSP cannot be destroyed inside handler
  */
 static bool write_handler(uint8_t *buf, size_t sz, void *arg)
 {
 	struct play *play = arg;
+	size_t pos;
 
-	lock_write_get(play->lock);
+	write_stats(play, sz);
 
-	if (play->eof)
+	if (atom_load(&play->state) != PLAY_RUN)
 		goto silence;
 
-	if (mbuf_get_left(play->mb) < sz) {
-		play->eof = true;
-	}
-	else {
-		(void)mbuf_read_mem(play->mb, buf, sz);
+	pos = atom_load(&play->pos);
+
+	if (play->mb->end - pos < sz) {
+		(void)atom_cas(&play->state, PLAY_RUN, PLAY_EOF);
+		goto silence;
 	}
 
- silence:
-	if (play->eof)
-		memset(buf, 0, sz);
+	memcpy(buf, play->mb->buf + pos, sz);
+	atom_store(&play->pos, pos + sz);
 
-	lock_rel(play->lock);
+	return true;
+
+ silence:
+	memset(buf, 0, sz);
 
 	return true;
 }
@@ -113,23 +195,54 @@ static bool write_handler(uint8_t *buf, size_t sz, void *arg)
 static void destructor(void *arg)
 {
 	struct play *play = arg;
+	const bool started = play->auplay != NULL;
 
 	list_unlink(&play->le);
 	tmr_cancel(&play->tmr);
 
-	lock_write_get(play->lock);
-	play->eof = true;
-	lock_rel(play->lock);
+	atom_store(&play->state, PLAY_STOP);
 
+	/* stops the audio thread */
 	mem_deref(play->auplay);
+
+	if (started) {
+		++totals.n_play;
+		totals.n_write += play->n_write;
+		totals.n_late  += play->n_late;
+		totals.gap_max  = max(totals.gap_max, play->gap_max);
+	}
+
 	mem_deref(play->mb);
-	mem_deref(play->lock);
 
 	if (play->playp)
 		*play->playp = NULL;
 }
 
 
+static void prompt_destructor(void *arg)
+{
+	struct prompt *pr = arg;
+
+	list_unlink(&pr->le);
+	mem_deref(pr->mb);
+	mem_deref(pr->path);
+}
+
+
+/* Write to the buffer, which grows by doubling its size */
+static int pcm_write(struct mbuf *mb, const uint8_t *p, size_t n)
+{
+	if (mb->pos + n > mb->size) {
+
+		int err = mbuf_resize(mb, max(mb->size * 2, mb->pos + n));
+		if (err)
+			return err;
+	}
+
+	return mbuf_write_mem(mb, p, n);
+}
+
+
 static int aufile_load(struct mbuf *mb, const char *filename,
 		       uint32_t *srate, uint8_t *channels)
 {
@@ -143,6 +256,7 @@ static int aufile_load(struct mbuf *mb, const char *filename,
 
 	while (!err) {
 		uint8_t buf[4096];
+		int16_t sampv[4096];
 		size_t i, n;
 
 		n = sizeof(buf);
@@ -154,21 +268,21 @@ static int aufile_load(struct mbuf *mb, const char *filename,
 		switch (prm.fmt) {
 
 		case AUFMT_S16LE:
-			err = mbuf_write_mem(mb, buf, n);
+			err = pcm_write(mb, buf, n);
 			break;
 
 		case AUFMT_PCMA:
-			for (i=0; i<n; i++) {
-				err |= mbuf_write_u16(mb,
-						      g711_alaw2pcm(buf[i]));
-			}
+			for (i=0; i<n; i++)
+				sampv[i] = g711_alaw2pcm(buf[i]);
+
+			err = pcm_write(mb, (uint8_t *)sampv, n * 2);
 			break;
 
 		case AUFMT_PCMU:
-			for (i=0; i<n; i++) {
-				err |= mbuf_write_u16(mb,
-						      g711_ulaw2pcm(buf[i]));
-			}
+			for (i=0; i<n; i++)
+				sampv[i] = g711_ulaw2pcm(buf[i]);
+
+			err = pcm_write(mb, (uint8_t *)sampv, n * 2);
 			break;
 
 		default:
@@ -180,6 +294,10 @@ static int aufile_load(struct mbuf *mb, const char *filename,
 	mem_deref(af);
 
 	if (!err) {
+		/* release the unused space */
+		if (mb->end)
+			err = mbuf_resize(mb, mb->end);
+
 		mb->pos = 0;
 
 		*srate    = prm.srate;
@@ -190,6 +308,81 @@ static int aufile_load(struct mbuf *mb, const char *filename,
 }
 
 
+/* Evict the least recently used files, until the cache fits its size */
+static void cache_trim(void)
+{
+	while (cache.bytes > CACHE_MAX && cache.promptl.head !=
+	       cache.promptl.tail) {
+
+		struct prompt *pr = list_ledata(cache.promptl.head);
+
+		cache.bytes -= pr->mb->size;
+		++cache.n_evict;
+		mem_deref(pr);
+	}
+}
+
+
+/* Find a decoded audio file in the cache, or load it */
+static int prompt_get(struct prompt **prp, const char *path)
+{
+	struct prompt *pr;
+	struct le *le;
+	int err;
+
+	for (le = cache.promptl.head; le; le = le->next) {
+
+		pr = le->data;
+
+		if (0 == str_cmp(pr->path, path)) {
+			++cache.n_hit;
+			++pr->n_play;
+
+			/* most recently used at the tail */
+			list_unlink(&pr->le);
+			list_append(&cache.promptl, &pr->le, pr);
+
+			*prp = pr;
+			return 0;
+		}
+	}
+
+	++cache.n_miss;
+
+	pr = mem_zalloc(sizeof(*pr), prompt_destructor);
+	if (!pr)
+		return ENOMEM;
+
+	pr->mb = mbuf_alloc(65536);
+	if (!pr->mb) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err = str_dup(&pr->path, path);
+	if (err)
+		goto out;
+
+	err = aufile_load(pr->mb, path, &pr->srate, &pr->ch);
+	if (err)
+		goto out;
+
+	pr->n_play = 1;
+	list_append(&cache.promptl, &pr->le, pr);
+
+	cache.bytes += pr->mb->size;
+	cache_trim();
+
+ out:
+	if (err)
+		mem_deref(pr);
+	else
+		*prp = pr;
+
+	return err;
+}
+
+
 /**
  * Play a tone from a PCM buffer
  *
@@ -218,10 +411,10 @@ int play_tone(struct play **playp, struct mbuf *tone, uint32_t srate,
 	tmr_init(&play->tmr);
 	play->repeat = repeat;
 	play->mb     = mem_ref(tone);
-
-	err = lock_alloc(&play->lock);
-	if (err)
-		goto out;
+	play->pos    = tone->pos;
+	play->state  = PLAY_RUN;
+	play->srate  = srate;
+	play->ch     = ch;
 
 	wprm.fmt        = AUFMT_S16LE;
 	wprm.ch         = ch;
@@ -250,7 +443,8 @@ int play_tone(struct play **playp, struct mbuf *tone, uint32_t srate,
 
 
 /**
- * Play an audio file in WAV format
+ * Play an audio file in WAV format. The file is decoded once, and the
+ * samples are shared by all players of the same file.
  *
  * @param playp    Pointer to allocated player object
  * @param filename Name of WAV file to play
@@ -260,10 +454,8 @@ int play_tone(struct play **playp, struct mbuf *tone, uint32_t srate,
  */
 int play_file(struct play **playp, const char *filename, int repeat)
 {
-	struct mbuf *mb;
+	struct prompt *pr;
 	char path[256];
-	uint32_t srate;
-	uint8_t ch;
 	int err;
 
 	if (playp && *playp)
@@ -276,29 +468,137 @@ int play_file(struct play **playp, const char *filename, int repeat)
 			filename) < 0)
 		return ENOMEM;
 
-	mb = mbuf_alloc(1024);
-	if (!mb)
-		return ENOMEM;
-
-	err = aufile_load(mb, path, &srate, &ch);
+	err = prompt_get(&pr, path);
 	if (err) {
 		DEBUG_WARNING("%s: %m\n", path, err);
-		goto out;
+		return err;
 	}
 
-	err = play_tone(playp, mb, srate, ch, repeat);
+	return play_tone(playp, pr->mb, pr->srate, pr->ch, repeat);
+}
 
- out:
-	mem_deref(mb);
+
+/**
+ * Close all active audio players, and empty the cache
+ */
+void play_close(void)
+{
+	list_flush(&playl);
+	list_flush(&cache.promptl);
+	cache.bytes = 0;
+}
+
+
+/**
+ * Print the audio file cache and the number of active players
+ *
+ * @param pf     Print handler
+ * @param unused Unused parameter
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int play_debug(struct re_printf *pf, void *unused)
+{
+	size_t bytes = 0;
+	struct le *le;
+	int err = 0;
+	(void)unused;
+
+	err |= re_hprintf(pf, "Audio file cache:\n");
+
+	for (le = cache.promptl.head; le; le = le->next) {
+
+		const struct prompt *pr = le->data;
+		const size_t n = pr->mb->end / 2 / max(pr->ch, 1);
+
+		err |= re_hprintf(pf, " %-40s %uHz/%u %5u ms %8zu bytes"
+				  " %u plays\n",
+				  pr->path, pr->srate, pr->ch,
+				  (uint32_t)(n * 1000 / max(pr->srate, 1)),
+				  pr->mb->size, pr->n_play);
+
+		bytes += pr->mb->size;
+	}
+
+	err |= re_hprintf(pf, " %u files, %zu of %u bytes, %u hits,"
+			  " %u misses, %u evicted\n",
+			  list_count(&cache.promptl), bytes, CACHE_MAX,
+			  cache.n_hit, cache.n_miss, cache.n_evict);
+
+	err |= re_hprintf(pf, "Active players: %u\n", list_count(&playl));
+
+	for (le = playl.head; le; le = le->next) {
+
+		const struct play *play = le->data;
+
+		err |= re_hprintf(pf, " %p %uHz/%u %s pos %zu/%zu:"
+				  " %u callbacks, %u late, max gap %u ms\n",
+				  play, play->srate, play->ch,
+				  play->state == PLAY_RUN ? "run" : "eof",
+				  play->pos, play->mb->end,
+				  play->n_write, play->n_late,
+				  play->gap_max / 1000);
+	}
+
+	err |= re_hprintf(pf, "Finished players: %u, %u callbacks,"
+			  " %u late, max gap %u ms\n",
+			  totals.n_play, totals.n_write, totals.n_late,
+			  totals.gap_max / 1000);
 
 	return err;
 }
 
 
 /**
- * Close all active audio players
+ * Stress test, which starts many players of a tone at the same time.
+ * The players stop by themselves, and the late callbacks are shown by
+ * play_debug().
+ *
+ * @param pf     Print handler
+ * @param unused Unused parameter
+ *
+ * @return 0 if success, otherwise errorcode
  */
-void play_close(void)
+int play_stress(struct re_printf *pf, void *unused)
 {
-	list_flush(&playl);
+	struct mbuf *mb;
+	unsigned i, n = 0;
+	int err = 0;
+	(void)unused;
+
+	/* one second of a 500 Hz triangle wave */
+	mb = mbuf_alloc(STRESS_SRATE * 2);
+	if (!mb)
+		return ENOMEM;
+
+	for (i=0; i<STRESS_SRATE; i++) {
+		const int phase = i % 16;
+		const int16_t s = 2048 * (phase < 8 ? phase - 4 : 12 - phase);
+
+		err |= mbuf_write_mem(mb, (uint8_t *)&s, sizeof(s));
+	}
+	if (err)
+		goto out;
+
+	mb->pos = 0;
+
+	memset(&totals, 0, sizeof(totals));
+
+	for (i=0; i<STRESS_PLAYERS; i++) {
+
+		err = play_tone(NULL, mb, STRESS_SRATE, 1, 2);
+		if (err) {
+			DEBUG_WARNING("stress: player %u: %m\n", i, err);
+			break;
+		}
+
+		++n;
+	}
+
+	err = re_hprintf(pf, "play stress test: started %u players\n", n);
+
+ out:
+	mem_deref(mb);
+
+	return err;
 }
@@ -3,6 +3,7 @@
  *
  * Copyright (C) 2010 Creytiv.com
  */
+#include <time.h>
 #include <re.h>
 #include <baresip.h>
 #ifdef DARWIN
@@ -92,3 +93,21 @@ int realtime_enable(bool enable, int fps)
 	return ENOSYS;
 #endif
 }
+
+
+/**
+ * Get the time of a monotonic clock, with microsecond resolution
+ *
+ * @return Time in [us]
+ */
+uint64_t realtime_usec(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (0 == clock_gettime(CLOCK_MONOTONIC, &ts))
+		return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+
+	return tmr_jiffies() * 1000;
+}
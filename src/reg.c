@@ -13,13 +13,43 @@
 #include <re_dbg.h>
 
 
+/*
+ * All REGISTER requests go through a scheduler, so that a large number
+ * of accounts do not register in the same instant. A registration is
+ * queued with a random delay of up to a fraction of the registration
+ * interval, at most SPREAD_MAX, and is sent when it is due and the rate
+ * limit allows. Refreshes are done by the SIP register client, and keep
+ * the spreading of the first REGISTER.
+ *
+ * After a failure the SIP register client is dropped, and the account
+ * is queued again with an exponential backoff.
+ */
+
+enum {
+	SCHED_TICK  =  100,  /**< Scheduler interval [ms]                */
+	BACKOFF_MIN =   30,  /**< First retry after a failure [s]        */
+	BACKOFF_MAX = 1800,  /**< Longest retry interval [s]             */
+	SPREAD_MAX  =   30,  /**< Longest delay of the first REGISTER [s]*/
+};
+
+
 /** Register client */
 struct reg {
 	struct le le;                /**< Linked list element                */
+	struct le le_sched;          /**< Scheduler queue element            */
 	struct ua *ua;               /**< Pointer to parent UA object        */
 	struct sipreg *sipreg;       /**< SIP Register client                */
 	int id;                      /**< Registration ID (for SIP outbound) */
 
+	/* request: */
+	char *uri;                   /**< Registrar URI                      */
+	char *params;                /**< Contact parameters                 */
+	const char *outbound;        /**< Outbound proxy (optional)          */
+	uint32_t regint;             /**< Registration interval [s]          */
+	uint64_t due;                /**< Time to send REGISTER [ms]         */
+	uint32_t failc;              /**< Number of failures in a row        */
+	bool inflight;               /**< REGISTER sent, waiting for reply   */
+
 	/* status: */
 	uint16_t scode;              /**< Registration status code           */
 	char *srv;                   /**< SIP Server id                      */
@@ -28,13 +58,93 @@ struct reg {
 };
 
 
+static struct {
+	struct list regl;            /**< Queued registrations, by due time  */
+	struct tmr tmr;              /**< Scheduler timer                    */
+	uint64_t ts;                 /**< Time of last token refill [ms]     */
+	uint32_t tokens;             /**< Rate limit bucket [1/1000 REGISTER]*/
+	uint32_t n_inflight;         /**< REGISTERs waiting for a reply      */
+	uint32_t inflight_max;       /**< Highest number in flight           */
+	uint32_t n_sent;             /**< Number of scheduled REGISTERs      */
+	uint32_t n_ok;               /**< Number of successful replies       */
+	uint32_t n_fail;             /**< Number of failures                 */
+} sched;
+
+
+static void sched_tick(void *arg);
+
+
+static void inflight_clear(struct reg *reg)
+{
+	if (!reg->inflight)
+		return;
+
+	reg->inflight = false;
+	--sched.n_inflight;
+}
+
+
+static void sched_remove(struct reg *reg)
+{
+	if (!reg->le_sched.list)
+		return;
+
+	list_unlink(&reg->le_sched);
+
+	if (list_isempty(&sched.regl))
+		tmr_cancel(&sched.tmr);
+}
+
+
+/* Queue a registration, sorted by due time */
+static void sched_insert(struct reg *reg, uint64_t delay)
+{
+	struct le *le;
+
+	sched_remove(reg);
+
+	reg->due = tmr_jiffies() + delay;
+
+	for (le = sched.regl.tail; le; le = le->prev) {
+
+		const struct reg *r = le->data;
+
+		if (r->due <= reg->due)
+			break;
+	}
+
+	if (le)
+		list_insert_after(&sched.regl, le, &reg->le_sched, reg);
+	else
+		list_prepend(&sched.regl, &reg->le_sched, reg);
+
+	if (!tmr_isrunning(&sched.tmr))
+		tmr_start(&sched.tmr, 0, sched_tick, NULL);
+}
+
+
+/* Exponential backoff, with a random spreading over the upper half */
+static uint64_t backoff(uint32_t failc)
+{
+	const uint32_t n = min(failc - 1, 6);
+	const uint64_t wait = min(BACKOFF_MIN << n, BACKOFF_MAX) * 1000;
+
+	return wait / 2 + rand_u32() % (wait / 2 + 1);
+}
+
+
 static void destructor(void *arg)
 {
 	struct reg *reg = arg;
 
+	sched_remove(reg);
+	inflight_clear(reg);
+
 	list_unlink(&reg->le);
 	mem_deref(reg->sipreg);
 	mem_deref(reg->srv);
+	mem_deref(reg->uri);
+	mem_deref(reg->params);
 }
 
 
@@ -104,6 +214,21 @@ static int sip_auth_handler(char **username, char **password,
 }
 
 
+/*
+ * The SIP register client of a failed registration is dropped from the
+ * scheduler, and not here in its own response handler.
+ */
+static void register_fail(struct reg *reg)
+{
+	inflight_clear(reg);
+
+	++sched.n_fail;
+	++reg->failc;
+
+	sched_insert(reg, backoff(reg->failc));
+}
+
+
 static void register_handler(int err, const struct sip_msg *msg, void *arg)
 {
 	struct reg *reg = arg;
@@ -114,6 +239,8 @@ static void register_handler(int err, const struct sip_msg *msg, void *arg)
 
 		reg->scode = 999;
 
+		register_fail(reg);
+
 		ua_event(reg->ua, UA_EVENT_REGISTER_FAIL, "%m", err);
 		return;
 	}
@@ -142,6 +269,10 @@ static void register_handler(int err, const struct sip_msg *msg, void *arg)
 		}
 
 		reg->scode = msg->scode;
+		reg->failc = 0;
+
+		inflight_clear(reg);
+		++sched.n_ok;
 
 		ua_event(reg->ua, UA_EVENT_REGISTER_OK, "%u %r",
 			 msg->scode, &msg->reason);
@@ -154,6 +285,8 @@ static void register_handler(int err, const struct sip_msg *msg, void *arg)
 		reg->scode = msg->scode;
 		reg->sipfd = -1;
 
+		register_fail(reg);
+
 		ua_event(reg->ua, UA_EVENT_REGISTER_FAIL, "%u %r",
 			 msg->scode, &msg->reason);
 	}
@@ -184,32 +317,141 @@ int reg_add(struct list *lst, struct ua *ua, int regid)
 }
 
 
-int reg_register(struct reg *reg, const char *reg_uri, const char *params,
-		 uint32_t regint, const char *outbound)
+static int reg_send(struct reg *reg)
 {
 	const char *routev[1];
 	int err;
 
-	if (!reg || !reg_uri)
-		return EINVAL;
-
-	reg->scode = 0;
-	routev[0] = outbound;
+	routev[0] = reg->outbound;
 
 	reg->sipreg = mem_deref(reg->sipreg);
-	err = sipreg_register(&reg->sipreg, uag_sip(), reg_uri,
+	err = sipreg_register(&reg->sipreg, uag_sip(), reg->uri,
 			      ua_aor(reg->ua), ua_aor(reg->ua),
-			      regint, ua_cuser(reg->ua),
+			      reg->regint, ua_cuser(reg->ua),
 			      routev[0] ? routev : NULL,
 			      routev[0] ? 1 : 0,
 			      reg->id,
 			      sip_auth_handler, ua_prm(reg->ua), true,
 			      register_handler, reg,
-			      params[0] ? &params[1] : NULL,
+			      reg->params[0] ? &reg->params[1] : NULL,
 			      "Allow: %s\r\n", uag_allowed_methods());
 	if (err)
 		return err;
 
+	reg->inflight = true;
+	++sched.n_sent;
+
+	if (++sched.n_inflight > sched.inflight_max)
+		sched.inflight_max = sched.n_inflight;
+
+	return 0;
+}
+
+
+static void sched_tick(void *arg)
+{
+	const uint32_t rate = config.sip.reg_rate;
+	const uint64_t now = tmr_jiffies();
+	struct le *le;
+	(void)arg;
+
+	/* token bucket, holds at most one second of REGISTERs */
+	if (rate) {
+		const uint64_t t = (now - sched.ts) * rate + sched.tokens;
+
+		sched.tokens = (uint32_t)min(t, rate * 1000ULL);
+	}
+
+	sched.ts = now;
+
+	/* a failed registration must not be retried by its client */
+	for (le = sched.regl.head; le; le = le->next) {
+
+		struct reg *reg = le->data;
+
+		reg->sipreg = mem_deref(reg->sipreg);
+	}
+
+	while (sched.regl.head) {
+
+		struct reg *reg = sched.regl.head->data;
+		int err;
+
+		if (reg->due > now)
+			break;
+
+		if (rate) {
+			if (sched.tokens < 1000)
+				break;
+
+			sched.tokens -= 1000;
+		}
+
+		sched_remove(reg);
+
+		err = reg_send(reg);
+		if (err) {
+			DEBUG_WARNING("%s: SIP register failed: %m\n",
+				      ua_aor(reg->ua), err);
+
+			reg->scode = 999;
+
+			register_fail(reg);
+
+			ua_event(reg->ua, UA_EVENT_REGISTER_FAIL, "%m", err);
+		}
+	}
+
+	if (!list_isempty(&sched.regl))
+		tmr_start(&sched.tmr, SCHED_TICK, sched_tick, NULL);
+}
+
+
+/**
+ * Queue a registration for the scheduler
+ *
+ * @param reg      Register client
+ * @param reg_uri  Registrar URI
+ * @param params   Contact parameters, starting with a separator
+ * @param regint   Registration interval in [seconds]
+ * @param outbound Outbound proxy (optional)
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int reg_register(struct reg *reg, const char *reg_uri, const char *params,
+		 uint32_t regint, const char *outbound)
+{
+	uint32_t spread;
+	int err;
+
+	if (!reg || !reg_uri || !params)
+		return EINVAL;
+
+	reg->uri    = mem_deref(reg->uri);
+	reg->params = mem_deref(reg->params);
+
+	err  = str_dup(&reg->uri, reg_uri);
+	err |= str_dup(&reg->params, params);
+	if (err)
+		return err;
+
+	reg->outbound = outbound;
+	reg->regint   = regint;
+	reg->scode    = 0;
+	reg->failc    = 0;
+
+	inflight_clear(reg);
+	reg->sipreg = mem_deref(reg->sipreg);
+
+	if (!sched.ts) {
+		sched.ts     = tmr_jiffies();
+		sched.tokens = config.sip.reg_rate * 1000;
+	}
+
+	spread = min(regint * 10 * config.sip.reg_spread, SPREAD_MAX * 1000);
+
+	sched_insert(reg, spread ? rand_u32() % spread : 0);
+
 	return 0;
 }
 
@@ -222,6 +464,10 @@ void reg_unregister(struct reg *reg)
 	reg->scode = 0;
 	reg->sipfd = -1;
 	reg->af    = 0;
+	reg->failc = 0;
+
+	sched_remove(reg);
+	inflight_clear(reg);
 
 	reg->sipreg = mem_deref(reg->sipreg);
 }
@@ -275,3 +521,26 @@ int reg_status(struct re_printf *pf, const struct reg *reg)
 
 	return re_hprintf(pf, " %s %s", print_scode(reg->scode), reg->srv);
 }
+
+
+int reg_sched_debug(struct re_printf *pf, void *unused)
+{
+	uint32_t n_backoff = 0;
+	struct le *le;
+	(void)unused;
+
+	for (le = sched.regl.head; le; le = le->next) {
+		const struct reg *reg = le->data;
+
+		if (reg->failc)
+			++n_backoff;
+	}
+
+	return re_hprintf(pf, "register: queued=%u (backoff %u)"
+			  " inflight=%u (max %u) sent=%u ok=%u fail=%u"
+			  " rate=%u/s\n",
+			  list_count(&sched.regl), n_backoff,
+			  sched.n_inflight, sched.inflight_max,
+			  sched.n_sent, sched.n_ok, sched.n_fail,
+			  config.sip.reg_rate);
+}
@@ -0,0 +1,722 @@
+/**
+ * @file resamp.c  Polyphase audio resampler
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <math.h>
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+	(__GNUC__ >= 5 || defined(__clang__))
+#define RESAMP_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RESAMP_NEON 1
+#include <arm_neon.h>
+#endif
+
+
+#define DEBUG_MODULE "resamp"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
+
+#if !defined (M_PI)
+#define M_PI 3.14159265358979323846264338327
+#endif
+
+
+/**
+ * \page Resampler Polyphase audio resampler
+ *
+ * Converts 16-bit audio between any two sampling rates with a rational
+ * ratio L/M (e.g. 8000/16000/32000/44100/48000 Hz), and between mono and
+ * stereo. The filter is a windowed-sinc prototype, split into L phases of
+ * N taps each. The inner loop is a dot-product of N samples with one
+ * phase, and is done by the fastest kernel available on the CPU:
+ *
+ *   - AVX2   (x86, detected at runtime)
+ *   - SSE2   (x86, detected at runtime)
+ *   - NEON   (ARM, selected at compile-time)
+ *   - scalar C
+ */
+
+
+enum {
+	RESAMP_TAPS     = 32,    /**< Filter taps per phase, multiple of 16 */
+	RESAMP_MAXPHASE = 1024,  /**< Maximum interpolation factor          */
+	RESAMP_MAXDOWN  = 16,    /**< Maximum decimation ratio              */
+	RESAMP_SHIFT    = 14,    /**< Fixed-point scale of coefficients     */
+};
+
+
+/** Defines a set of processing kernels */
+struct resamp_kernel {
+	const char *name;
+	bool (*supported)(void);
+	int32_t (*dot)(const int16_t *x, const int16_t *h, size_t n);
+	void (*deint)(int16_t *l, int16_t *r, const int16_t *src, size_t n);
+	void (*downmix)(int16_t *dst, const int16_t *src, size_t n);
+	void (*upmix)(int16_t *dst, const int16_t *src, size_t n);
+};
+
+/** Defines a resampler */
+struct resamp {
+	const struct resamp_kernel *k; /**< Processing kernels             */
+	int16_t *coeffv;    /**< Filter coefficients, [phase][tap]          */
+	int16_t *bufv[2];   /**< Input samples per channel, incl. history   */
+	int16_t *tmpv;      /**< Mono output before upmix (optional)        */
+	size_t bufsz;       /**< Size of input buffers in [samples]         */
+	size_t fill;        /**< Number of samples in input buffers         */
+	size_t maxsamp;     /**< Maximum number of samples per call         */
+	uint32_t ntaps;     /**< Number of taps per phase                   */
+	uint32_t up;        /**< Interpolation factor L                     */
+	uint32_t down;      /**< Decimation factor M                        */
+	uint32_t phase;     /**< Current filter phase                       */
+	uint8_t ch_in;      /**< Number of input channels                   */
+	uint8_t ch_out;     /**< Number of output channels                  */
+	uint8_t nch;        /**< Number of filtered channels                */
+};
+
+
+/* Scalar kernels */
+
+static bool supported_c(void)
+{
+	return true;
+}
+
+
+static int32_t dot_c(const int16_t *x, const int16_t *h, size_t n)
+{
+	int32_t acc = 0;
+	size_t i;
+
+	for (i=0; i<n; i++)
+		acc += (int32_t)x[i] * h[i];
+
+	return acc;
+}
+
+
+static void deint_c(int16_t *l, int16_t *r, const int16_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++) {
+		l[i] = src[2*i];
+		r[i] = src[2*i+1];
+	}
+}
+
+
+static void downmix_c(int16_t *dst, const int16_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++)
+		dst[i] = (src[2*i] + src[2*i+1]) >> 1;
+}
+
+
+static void upmix_c(int16_t *dst, const int16_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++)
+		dst[2*i] = dst[2*i+1] = src[i];
+}
+
+
+#ifdef RESAMP_X86
+
+static bool supported_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+
+static bool supported_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+
+__attribute__((target("sse2")))
+static int32_t dot_sse2(const int16_t *x, const int16_t *h, size_t n)
+{
+	__m128i acc = _mm_setzero_si128();
+	size_t i;
+
+	for (i=0; i<n; i+=8) {
+		const __m128i a = _mm_loadu_si128((const __m128i *)(x + i));
+		const __m128i b = _mm_loadu_si128((const __m128i *)(h + i));
+
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(a, b));
+	}
+
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xb1));
+
+	return _mm_cvtsi128_si32(acc);
+}
+
+
+__attribute__((target("avx2")))
+static int32_t dot_avx2(const int16_t *x, const int16_t *h, size_t n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	__m128i sum;
+	size_t i;
+
+	for (i=0; i<n; i+=16) {
+		const __m256i a = _mm256_loadu_si256((const __m256i *)(x + i));
+		const __m256i b = _mm256_loadu_si256((const __m256i *)(h + i));
+
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a, b));
+	}
+
+	sum = _mm_add_epi32(_mm256_castsi256_si128(acc),
+			    _mm256_extracti128_si256(acc, 1));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+
+	return _mm_cvtsi128_si32(sum);
+}
+
+
+__attribute__((target("sse2")))
+static void deint_sse2(int16_t *l, int16_t *r, const int16_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+		const __m128i a = _mm_loadu_si128((const __m128i *)(src+2*i));
+		const __m128i b = _mm_loadu_si128((const __m128i *)(src+2*i+8));
+		const __m128i la = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+		const __m128i lb = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+
+		_mm_storeu_si128((__m128i *)(l + i), _mm_packs_epi32(la, lb));
+		_mm_storeu_si128((__m128i *)(r + i),
+				 _mm_packs_epi32(_mm_srai_epi32(a, 16),
+						 _mm_srai_epi32(b, 16)));
+	}
+
+	deint_c(l + i, r + i, src + 2*i, n - i);
+}
+
+
+__attribute__((target("sse2")))
+static void downmix_sse2(int16_t *dst, const int16_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+		const __m128i a = _mm_loadu_si128((const __m128i *)(src+2*i));
+		const __m128i b = _mm_loadu_si128((const __m128i *)(src+2*i+8));
+		__m128i sa, sb;
+
+		sa = _mm_add_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+				   _mm_srai_epi32(a, 16));
+		sb = _mm_add_epi32(_mm_srai_epi32(_mm_slli_epi32(b, 16), 16),
+				   _mm_srai_epi32(b, 16));
+
+		_mm_storeu_si128((__m128i *)(dst + i),
+				 _mm_packs_epi32(_mm_srai_epi32(sa, 1),
+						 _mm_srai_epi32(sb, 1)));
+	}
+
+	downmix_c(dst + i, src + 2*i, n - i);
+}
+
+
+__attribute__((target("sse2")))
+static void upmix_sse2(int16_t *dst, const int16_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+		const __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+
+		_mm_storeu_si128((__m128i *)(dst + 2*i),
+				 _mm_unpacklo_epi16(a, a));
+		_mm_storeu_si128((__m128i *)(dst + 2*i + 8),
+				 _mm_unpackhi_epi16(a, a));
+	}
+
+	upmix_c(dst + 2*i, src + i, n - i);
+}
+
+#endif
+
+
+#ifdef RESAMP_NEON
+
+static int32_t dot_neon(const int16_t *x, const int16_t *h, size_t n)
+{
+	int32x4_t acc = vdupq_n_s32(0);
+	int32x2_t sum;
+	size_t i;
+
+	for (i=0; i<n; i+=8) {
+		const int16x8_t a = vld1q_s16(x + i);
+		const int16x8_t b = vld1q_s16(h + i);
+
+		acc = vmlal_s16(acc, vget_low_s16(a), vget_low_s16(b));
+		acc = vmlal_s16(acc, vget_high_s16(a), vget_high_s16(b));
+	}
+
+	sum = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+	sum = vpadd_s32(sum, sum);
+
+	return vget_lane_s32(sum, 0);
+}
+
+
+static void deint_neon(int16_t *l, int16_t *r, const int16_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+		const int16x8x2_t v = vld2q_s16(src + 2*i);
+
+		vst1q_s16(l + i, v.val[0]);
+		vst1q_s16(r + i, v.val[1]);
+	}
+
+	deint_c(l + i, r + i, src + 2*i, n - i);
+}
+
+
+static void downmix_neon(int16_t *dst, const int16_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+		const int16x8x2_t v = vld2q_s16(src + 2*i);
+
+		vst1q_s16(dst + i, vhaddq_s16(v.val[0], v.val[1]));
+	}
+
+	downmix_c(dst + i, src + 2*i, n - i);
+}
+
+
+static void upmix_neon(int16_t *dst, const int16_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+		int16x8x2_t v;
+
+		v.val[0] = v.val[1] = vld1q_s16(src + i);
+		vst2q_s16(dst + 2*i, v);
+	}
+
+	upmix_c(dst + 2*i, src + i, n - i);
+}
+
+#endif
+
+
+/* In order of preference */
+static const struct resamp_kernel kernelv[] = {
+#ifdef RESAMP_X86
+	{"avx2", supported_avx2, dot_avx2, deint_sse2, downmix_sse2,
+	 upmix_sse2},
+	{"sse2", supported_sse2, dot_sse2, deint_sse2, downmix_sse2,
+	 upmix_sse2},
+#endif
+#ifdef RESAMP_NEON
+	{"neon", supported_c, dot_neon, deint_neon, downmix_neon,
+	 upmix_neon},
+#endif
+	{"c",    supported_c, dot_c, deint_c, downmix_c, upmix_c},
+};
+
+
+static const struct resamp_kernel *kernel_find(void)
+{
+	static const struct resamp_kernel *k;
+	size_t i;
+
+	if (k)
+		return k;
+
+	for (i=0; i<ARRAY_SIZE(kernelv); i++) {
+
+		if (kernelv[i].supported()) {
+			k = &kernelv[i];
+			break;
+		}
+	}
+
+	return k;
+}
+
+
+/* Windowed-sinc prototype filter, u is the distance in input samples */
+static double proto(double u, double fc, uint32_t n)
+{
+	const double x = M_PI * fc * u;
+	double w;
+
+	if (fabs(u) >= n / 2.0)
+		return 0.0;
+
+	/* Blackman window */
+	w = 0.42 + 0.5*cos(2 * M_PI * u / n) + 0.08*cos(4 * M_PI * u / n);
+
+	return (x == 0.0 ? 1.0 : sin(x) / x) * w;
+}
+
+
+static void coeff_init(struct resamp *rs)
+{
+	const double fc = 0.9 * min(1.0, (double)rs->up / rs->down);
+	const uint32_t n = rs->ntaps;
+	uint32_t p, i;
+
+	for (p=0; p<rs->up; p++) {
+
+		int16_t *h = rs->coeffv + p * n;
+		double sum = 0.0;
+
+		for (i=0; i<n; i++)
+			sum += proto(n/2.0 - 1 + (double)p / rs->up - i, fc, n);
+
+		/* unity gain for each phase */
+		for (i=0; i<n; i++) {
+			const double u = n/2.0 - 1 + (double)p / rs->up - i;
+
+			h[i] = (int16_t)lrint(proto(u, fc, n) / sum *
+					      (1 << RESAMP_SHIFT));
+		}
+	}
+}
+
+
+static void destructor(void *arg)
+{
+	struct resamp *rs = arg;
+
+	mem_deref(rs->coeffv);
+	mem_deref(rs->bufv[0]);
+	mem_deref(rs->bufv[1]);
+	mem_deref(rs->tmpv);
+}
+
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+	while (b) {
+		const uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+
+/**
+ * Allocate a new resampler
+ *
+ * @param rsp      Pointer to allocated resampler
+ * @param maxsamp  Maximum number of samples per call, input and output
+ * @param irate    Input sampling rate in [Hz]
+ * @param ich      Number of input channels (1 or 2)
+ * @param orate    Output sampling rate in [Hz]
+ * @param och      Number of output channels (1 or 2)
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int resamp_alloc(struct resamp **rsp, size_t maxsamp,
+		 uint32_t irate, uint8_t ich, uint32_t orate, uint8_t och)
+{
+	struct resamp *rs;
+	uint32_t div, m;
+	int err = 0;
+
+	if (!rsp || !maxsamp || !irate || !orate)
+		return EINVAL;
+	if (ich < 1 || ich > 2 || och < 1 || och > 2)
+		return EINVAL;
+
+	div = gcd(irate, orate);
+
+	if (orate / div > RESAMP_MAXPHASE ||
+	    irate / orate >= RESAMP_MAXDOWN) {
+		DEBUG_WARNING("unsupported ratio %u -> %u Hz\n", irate, orate);
+		return ENOTSUP;
+	}
+
+	rs = mem_zalloc(sizeof(*rs), destructor);
+	if (!rs)
+		return ENOMEM;
+
+	rs->k       = kernel_find();
+	rs->up      = orate / div;
+	rs->down    = irate / div;
+	rs->ch_in   = ich;
+	rs->ch_out  = och;
+	rs->nch     = (ich == 2 && och == 2) ? 2 : 1;
+	rs->maxsamp = maxsamp;
+
+	/* longer filter when decimating, to keep the transition band */
+	m = (rs->down + rs->up - 1) / rs->up;
+	rs->ntaps = RESAMP_TAPS * m;
+
+	rs->coeffv = mem_zalloc(rs->up * rs->ntaps * sizeof(int16_t), NULL);
+	if (!rs->coeffv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	coeff_init(rs);
+
+	rs->bufsz = rs->ntaps + maxsamp;
+
+	rs->bufv[0] = mem_zalloc(rs->bufsz * sizeof(int16_t), NULL);
+	if (!rs->bufv[0]) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	if (rs->nch == 2) {
+		rs->bufv[1] = mem_zalloc(rs->bufsz * sizeof(int16_t), NULL);
+		if (!rs->bufv[1]) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
+	if (ich == 1 && och == 2) {
+		rs->tmpv = mem_zalloc(maxsamp * sizeof(int16_t), NULL);
+		if (!rs->tmpv) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
+	/* start with silence, so that output begins immediately */
+	rs->fill = rs->ntaps - 1;
+
+ out:
+	if (err)
+		mem_deref(rs);
+	else
+		*rsp = rs;
+
+	return err;
+}
+
+
+/**
+ * Resample a block of audio samples
+ *
+ * @param rs   Resampler
+ * @param outv Output samples
+ * @param outc Size of output buffer on input, number of samples on output
+ * @param inv  Input samples
+ * @param inc  Number of input samples
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int resamp_process(struct resamp *rs, int16_t *outv, size_t *outc,
+		   const int16_t *inv, size_t inc)
+{
+	const struct resamp_kernel *k;
+	size_t nin, maxo, pos = 0, n = 0;
+	int16_t *dst;
+	uint8_t c;
+
+	if (!rs || !outv || !outc || (!inv && inc))
+		return EINVAL;
+
+	k   = rs->k;
+	nin = inc / rs->ch_in;
+
+	if (inc > rs->maxsamp || rs->fill + nin > rs->bufsz)
+		return ENOMEM;
+
+	/* Input stage: planar, one buffer per filtered channel */
+	if (rs->ch_in == 2 && rs->nch == 2)
+		k->deint(rs->bufv[0] + rs->fill, rs->bufv[1] + rs->fill,
+			 inv, nin);
+	else if (rs->ch_in == 2)
+		k->downmix(rs->bufv[0] + rs->fill, inv, nin);
+	else
+		memcpy(rs->bufv[0] + rs->fill, inv, nin * sizeof(int16_t));
+
+	rs->fill += nin;
+
+	/* Filter stage */
+	maxo = *outc / rs->ch_out;
+
+	if (rs->tmpv) {
+		dst  = rs->tmpv;
+		maxo = min(maxo, rs->maxsamp);
+	}
+	else {
+		dst = outv;
+	}
+
+	while (n < maxo && pos + rs->ntaps <= rs->fill) {
+
+		const int16_t *h = rs->coeffv + rs->phase * rs->ntaps;
+
+		for (c=0; c<rs->nch; c++) {
+
+			int32_t y = k->dot(rs->bufv[c] + pos, h, rs->ntaps);
+
+			y = (y + (1 << (RESAMP_SHIFT-1))) >> RESAMP_SHIFT;
+
+			if (y > 32767)
+				y = 32767;
+			else if (y < -32768)
+				y = -32768;
+
+			dst[n * rs->nch + c] = y;
+		}
+
+		++n;
+
+		rs->phase += rs->down;
+		pos       += rs->phase / rs->up;
+		rs->phase %= rs->up;
+	}
+
+	/* Keep the history for the next call */
+	for (c=0; c<rs->nch; c++) {
+		memmove(rs->bufv[c], rs->bufv[c] + pos,
+			(rs->fill - pos) * sizeof(int16_t));
+	}
+
+	rs->fill -= pos;
+
+	/* Output stage */
+	if (rs->tmpv)
+		k->upmix(outv, rs->tmpv, n);
+
+	*outc = n * rs->ch_out;
+
+	return 0;
+}
+
+
+/**
+ * Get the name of the processing kernel used by a resampler
+ *
+ * @param rs Resampler
+ *
+ * @return Name of kernel
+ */
+const char *resamp_kernel_name(const struct resamp *rs)
+{
+	return rs ? rs->k->name : NULL;
+}
+
+
+static int bench_kernel(struct re_printf *pf, const struct resamp_kernel *k,
+			uint32_t irate, uint8_t ich, uint32_t orate, uint8_t och)
+{
+	static int16_t inv[960 * 2], outv[3840 * 2];
+	const size_t inc = irate / 50 * ich;
+	struct resamp *rs;
+	uint64_t start, t;
+	uint64_t nsamp = 0;
+	size_t i;
+	int err;
+
+	err = resamp_alloc(&rs, ARRAY_SIZE(outv), irate, ich, orate, och);
+	if (err)
+		return err;
+
+	rs->k = k;
+
+	for (i=0; i<ARRAY_SIZE(inv); i++)
+		inv[i] = rand_u16() >> 2;
+
+	start = tmr_jiffies();
+
+	do {
+		for (i=0; i<50; i++) {
+
+			size_t outc = ARRAY_SIZE(outv);
+
+			err = resamp_process(rs, outv, &outc, inv, inc);
+			if (err)
+				goto out;
+
+			nsamp += inc;
+		}
+
+		t = tmr_jiffies() - start;
+
+	} while (t < 100);
+
+	err = re_hprintf(pf, " %-5s %5u/%u -> %5u/%u Hz: %6.2f ns/sample\n",
+			 k->name, irate, ich, orate, och,
+			 t * 1e6 / (double)nsamp);
+
+ out:
+	mem_deref(rs);
+
+	return err;
+}
+
+
+/**
+ * Run a benchmark of all resampler kernels supported by the CPU
+ *
+ * @param pf     Print handler for the results
+ * @param unused Unused parameter
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int resamp_bench(struct re_printf *pf, void *unused)
+{
+	static const struct {
+		uint32_t irate, orate;
+		uint8_t ich, och;
+	} ratev[] = {
+		{48000, 8000,  1, 1},
+		{8000,  48000, 1, 1},
+		{16000, 8000,  1, 1},
+		{44100, 48000, 1, 1},
+		{48000, 16000, 2, 2},
+		{32000, 48000, 1, 2},
+		{48000, 16000, 2, 1},
+	};
+	size_t i, j;
+	int err = 0;
+	(void)unused;
+
+	err |= re_hprintf(pf, "Resampler benchmark (selected kernel: %s)\n",
+			  kernel_find()->name);
+
+	for (i=0; i<ARRAY_SIZE(kernelv); i++) {
+
+		const struct resamp_kernel *k = &kernelv[i];
+
+		if (!k->supported())
+			continue;
+
+		for (j=0; j<ARRAY_SIZE(ratev); j++) {
+
+			err |= bench_kernel(pf, k,
+					    ratev[j].irate, ratev[j].ich,
+					    ratev[j].orate, ratev[j].och);
+		}
+	}
+
+	return err;
+}
@@ -0,0 +1,292 @@
+/**
+ * @file rtppool.c  Pool of pre-bound RTP sockets
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+#define DEBUG_MODULE "rtppool"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
+
+/*
+ * Binding an RTP/RTCP socket pair searches the port range with bind()
+ * retries, and is done on the SIP thread during call setup. The pool
+ * keeps a number of bound and configured socket pairs, which a new
+ * media stream takes without any system calls.
+ *
+ * The pool is refilled from a timer on the main thread, a few sockets
+ * at a time, when it falls below the low watermark and until it reaches
+ * the high watermark. An empty pool falls back to binding a new socket.
+ *
+ * The RTP handlers are given when the socket is bound, so a pooled socket
+ * forwards its packets to the stream that took it. A socket is closed when
+ * the stream is done with it, and is not put back in the pool. It holds
+ * the RTCP session of the old stream, and the old peer may still send
+ * packets to the port.
+ */
+
+enum {
+	FILL_INTERVAL = 20,  /**< Refill interval [ms]                  */
+	FILL_STEP     = 4,   /**< Sockets bound per refill              */
+};
+
+
+/** Defines a pooled RTP socket pair */
+struct rtppool_sock {
+	struct le le;                /**< Pool list element                  */
+	struct rtp_sock *rtp;        /**< RTP/RTCP socket pair               */
+	int af;                      /**< Address family                     */
+	rtp_recv_h *recvh;           /**< RTP handler of the owner           */
+	rtcp_recv_h *rtcph;          /**< RTCP handler of the owner          */
+	void *arg;                   /**< Handler argument                   */
+};
+
+
+static struct {
+	struct list sockl;           /**< Free socket pairs                  */
+	struct tmr tmr;              /**< Refill timer                       */
+	int af;                      /**< Address family of the pool         */
+	struct {
+		uint32_t n_hit;      /**< Taken from the pool                */
+		uint32_t n_miss;     /**< Bound on demand                    */
+		uint32_t n_fill;     /**< Bound by the refill                */
+		uint32_t n_err;      /**< Failed binds                       */
+		uint32_t low;        /**< Lowest number of free sockets      */
+		uint64_t usec_hit;   /**< Total time of a hit [us]           */
+		uint64_t usec_miss;  /**< Total time of a miss [us]          */
+		uint32_t usec_max;   /**< Longest time of a miss [us]        */
+	} stats;
+} pool;
+
+
+static void destructor(void *arg)
+{
+	struct rtppool_sock *ps = arg;
+
+	list_unlink(&ps->le);
+	mem_deref(ps->rtp);
+}
+
+
+static void rtp_handler(const struct sa *src, const struct rtp_header *hdr,
+			struct mbuf *mb, void *arg)
+{
+	struct rtppool_sock *ps = arg;
+
+	if (ps->recvh)
+		ps->recvh(src, hdr, mb, ps->arg);
+}
+
+
+static void rtcp_handler(const struct sa *src, struct rtcp_msg *msg,
+			 void *arg)
+{
+	struct rtppool_sock *ps = arg;
+
+	if (ps->rtcph)
+		ps->rtcph(src, msg, ps->arg);
+}
+
+
+/* Bind and configure a new RTP/RTCP socket pair */
+static int sock_alloc(struct rtppool_sock **psp, int af)
+{
+	struct rtppool_sock *ps;
+	struct sa laddr;
+	int tos, err;
+
+	ps = mem_zalloc(sizeof(*ps), destructor);
+	if (!ps)
+		return ENOMEM;
+
+	ps->af = af;
+
+	/* we listen on all interfaces */
+	sa_init(&laddr, af);
+
+	err = rtp_listen(&ps->rtp, IPPROTO_UDP, &laddr,
+			 config.avt.rtp_ports.min, config.avt.rtp_ports.max,
+			 config.avt.rtcp_enable,
+			 rtp_handler, rtcp_handler, ps);
+	if (err)
+		goto out;
+
+	tos = config.avt.rtp_tos;
+	(void)udp_setsockopt(rtp_sock(ps->rtp), IPPROTO_IP, IP_TOS,
+			     &tos, sizeof(tos));
+	(void)udp_setsockopt(rtcp_sock(ps->rtp), IPPROTO_IP, IP_TOS,
+			     &tos, sizeof(tos));
+
+	udp_rxsz_set(rtp_sock(ps->rtp), RTP_RECV_SIZE);
+
+	if (config.avt.rtp_rxbuf) {
+		int rxbuf = config.avt.rtp_rxbuf;
+
+		(void)udp_setsockopt(rtp_sock(ps->rtp), SOL_SOCKET,
+				     SO_RCVBUF, &rxbuf, sizeof(rxbuf));
+	}
+
+ out:
+	if (err)
+		mem_deref(ps);
+	else
+		*psp = ps;
+
+	return err;
+}
+
+
+static int pool_af(void)
+{
+	return sa_af(net_laddr_af(pool.af));
+}
+
+
+static void fill_handler(void *arg)
+{
+	uint32_t i, n = list_count(&pool.sockl);
+	(void)arg;
+
+	/* no local address yet */
+	if (!pool_af())
+		return;
+
+	for (i=0; i<FILL_STEP && n < config.avt.rtp_pool.max; i++, n++) {
+
+		struct rtppool_sock *ps;
+		int err;
+
+		err = sock_alloc(&ps, pool_af());
+		if (err) {
+			DEBUG_WARNING("refill: %m\n", err);
+			++pool.stats.n_err;
+			return;
+		}
+
+		list_append(&pool.sockl, &ps->le, ps);
+		++pool.stats.n_fill;
+	}
+
+	if (n < config.avt.rtp_pool.max)
+		tmr_start(&pool.tmr, FILL_INTERVAL, fill_handler, NULL);
+}
+
+
+/**
+ * Start the pool of RTP sockets, if enabled
+ *
+ * @param af Preferred address family
+ */
+void rtppool_init(int af)
+{
+	pool.af = af;
+	pool.stats.low = config.avt.rtp_pool.max;
+
+	tmr_init(&pool.tmr);
+
+	if (config.avt.rtp_pool.max)
+		tmr_start(&pool.tmr, 0, fill_handler, NULL);
+}
+
+
+void rtppool_close(void)
+{
+	tmr_cancel(&pool.tmr);
+	list_flush(&pool.sockl);
+}
+
+
+/**
+ * Take a bound RTP socket pair from the pool, or bind a new one
+ *
+ * @param psp   Pointer to the socket pair, closed when dereferenced
+ * @param af    Address family
+ * @param recvh RTP packet handler
+ * @param rtcph RTCP packet handler
+ * @param arg   Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int rtppool_take(struct rtppool_sock **psp, int af,
+		 rtp_recv_h *recvh, rtcp_recv_h *rtcph, void *arg)
+{
+	const uint64_t start = realtime_usec();
+	struct rtppool_sock *ps = list_ledata(list_head(&pool.sockl));
+	uint32_t usec, n;
+	bool hit;
+	int err;
+
+	if (!psp)
+		return EINVAL;
+
+	hit = ps && ps->af == af;
+	if (hit) {
+		list_unlink(&ps->le);
+	}
+	else {
+		err = sock_alloc(&ps, af);
+		if (err) {
+			++pool.stats.n_err;
+			return err;
+		}
+	}
+
+	ps->recvh = recvh;
+	ps->rtcph = rtcph;
+	ps->arg   = arg;
+
+	usec = (uint32_t)(realtime_usec() - start);
+
+	if (hit) {
+		++pool.stats.n_hit;
+		pool.stats.usec_hit += usec;
+	}
+	else {
+		++pool.stats.n_miss;
+		pool.stats.usec_miss += usec;
+		pool.stats.usec_max = max(pool.stats.usec_max, usec);
+	}
+
+	n = list_count(&pool.sockl);
+	pool.stats.low = min(pool.stats.low, n);
+
+	/* refill below the low watermark */
+	if (config.avt.rtp_pool.max && n < config.avt.rtp_pool.min &&
+	    !tmr_isrunning(&pool.tmr))
+		tmr_start(&pool.tmr, 0, fill_handler, NULL);
+
+	*psp = ps;
+
+	return 0;
+}
+
+
+struct rtp_sock *rtppool_rtp(const struct rtppool_sock *ps)
+{
+	return ps ? ps->rtp : NULL;
+}
+
+
+int rtppool_debug(struct re_printf *pf, void *unused)
+{
+	const uint32_t n_hit = pool.stats.n_hit, n_miss = pool.stats.n_miss;
+	(void)unused;
+
+	return re_hprintf(pf, "RTP socket pool: free=%u (low %u)"
+			  " watermarks=%u-%u\n"
+			  " hit=%u (%u us) miss=%u (%u us, max %u us)"
+			  " bound=%u errors=%u\n",
+			  list_count(&pool.sockl), pool.stats.low,
+			  config.avt.rtp_pool.min, config.avt.rtp_pool.max,
+			  n_hit, n_hit ?
+			  (uint32_t)(pool.stats.usec_hit / n_hit) : 0,
+			  n_miss, n_miss ?
+			  (uint32_t)(pool.stats.usec_miss / n_miss) : 0,
+			  pool.stats.usec_max,
+			  pool.stats.n_fill, pool.stats.n_err);
+}
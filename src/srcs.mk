@@ -6,7 +6,9 @@
 
 SRCS	+= aucodec.c
 SRCS	+= audio.c
+SRCS	+= aumix.c
 SRCS	+= aufilt.c
+SRCS	+= auring.c
 SRCS	+= auplay.c
 SRCS	+= ausrc.c
 SRCS	+= bfcp.c
@@ -14,19 +16,24 @@ SRCS	+= call.c
 SRCS	+= cmd.c
 SRCS	+= conf.c
 SRCS	+= contact.c
+SRCS	+= load.c
 SRCS	+= mctrl.c
 SRCS	+= menc.c
 SRCS	+= mnat.c
 SRCS	+= module.c
+SRCS	+= mworker.c
 SRCS	+= net.c
 SRCS	+= play.c
 SRCS	+= realtime.c
 SRCS	+= reg.c
+SRCS	+= resamp.c
 SRCS	+= rtpkeep.c
+SRCS	+= rtppool.c
 SRCS	+= sdp.c
 SRCS	+= sipreq.c
 SRCS	+= stream.c
 SRCS	+= ua.c
+SRCS	+= udpbatch.c
 SRCS	+= ui.c
 SRCS	+= vidcodec.c
 SRCS	+= vidfilt.c
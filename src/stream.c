@@ -19,8 +19,11 @@
 
 
 enum {
-	RTP_RECV_SIZE    = 8192,  /**< Receive buffer for incoming RTP     */
 	RTP_KEEPALIVE_Tr = 15,    /**< RTP keepalive interval in [seconds] */
+	AJB_SHRINK_HOLD  = 10,    /**< Packets above target before shrink  */
+	AJB_SHRINK_FORCE = 250,   /**< Shrink also in speech after [pkts]  */
+	AJB_SILENCE_SIZE = 2,     /**< Largest payload that is silence     */
+	PLC_MAX_GAP      = 5,     /**< Max. frames concealed for a gap     */
 };
 
 
@@ -39,9 +42,13 @@ struct stream {
 	enum stream_type type;   /**< Type of stream (audio, video...)      */
 	struct call *call;       /**< Ref. to call object                   */
 	struct sdp_media *sdp;   /**< SDP Media line                        */
+	struct rtppool_sock *rs; /**< RTP Socket, from the pool             */
 	struct rtp_sock *rtp;    /**< RTP Socket                            */
+	struct udprx *rxb;       /**< Batched RTP receive (optional)        */
+	struct udptx *txb;       /**< Batched RTP transmit (optional)       */
 	struct rtpkeep *rtpkeep; /**< RTP Keepalive                         */
 	struct jbuf *jbuf;       /**< Jitter Buffer for incoming RTP        */
+	struct mworker *worker;  /**< Media worker thread (optional)        */
 	struct mnat_media *mns;  /**< Media NAT traversal state             */
 	const struct menc *menc; /**< Media encryption module               */
 	struct menc_sess *mencs; /**< Media encryption session state        */
@@ -56,7 +63,33 @@ struct stream {
 	void *arg;               /**< Handler argument                      */
 
 	int pt_enc;
-	/*int pt_dec; todo: enable this */
+	int pt_dec;              /**< Payload type of last inline packet    */
+
+	/** Adaptive jitter buffer */
+	struct {
+		bool enabled;       /**< Adaptive mode is enabled           */
+		bool prev;          /**< Previous packet is valid           */
+		uint32_t srate;     /**< RTP clock rate in [Hz]             */
+		uint32_t arr_prev;  /**< Arrival time of prev. packet [ts]  */
+		uint32_t ts_prev;   /**< RTP timestamp of previous packet   */
+		uint16_t seq_prev;  /**< Sequence number of previous packet */
+		uint32_t jitter;    /**< Interarrival jitter in [ts] * 16   */
+		uint32_t frame;     /**< Frame duration in [ts]             */
+		uint32_t depth;     /**< Current delay in [frames]          */
+		uint32_t target;    /**< Target delay in [frames]           */
+		uint32_t hold;      /**< Packets above target delay         */
+		uint32_t silent;    /**< Consecutive silent packets         */
+		uint32_t n_grow;    /**< Number of concealed frames         */
+		uint32_t n_shrink;  /**< Number of discarded frames         */
+		uint32_t n_force;   /**< Discarded frames with speech       */
+	} ajb;
+
+	/** Frames passed to the receiver as lost, for concealment */
+	struct {
+		uint32_t n_lost;     /**< Frames missing in the sequence    */
+		uint32_t n_gap;      /**< Frames concealed for seq. gaps    */
+		uint32_t n_underrun; /**< Jitter buffer underruns           */
+	} plc;
 
 	struct tmr tmr_stats;
 	struct {
@@ -97,6 +130,8 @@ static void stream_destructor(void *arg)
 {
 	struct stream *s = arg;
 
+	mworker_sync(s->worker);
+
 	list_unlink(&s->le);
 	tmr_cancel(&s->tmr_stats);
 	mem_deref(s->rtpkeep);
@@ -105,7 +140,202 @@ static void stream_destructor(void *arg)
 	mem_deref(s->mencs);
 	mem_deref(s->mns);
 	mem_deref(s->jbuf);
-	mem_deref(s->rtp);
+	mem_deref(s->rxb);
+	mem_deref(s->txb);
+	mem_deref(s->rs);
+	mworker_release(s->worker);
+}
+
+
+/*
+ * Telephone events and comfort noise are interleaved with the media
+ * payload, but never change the decoder
+ */
+static bool is_aux_pt(const struct stream *s, uint8_t pt)
+{
+	const struct sdp_format *fmt;
+
+	if (pt == PT_CN)
+		return true;
+
+	fmt = sdp_media_lformat(s->sdp, pt);
+	if (!fmt)
+		return false;
+
+	return 0 == str_casecmp(fmt->name, telev_rtpfmt) ||
+		0 == str_casecmp(fmt->name, "CN");
+}
+
+
+/*
+ * Pass one incoming packet to the stream handler, on the media worker
+ * thread if the stream has one. A packet with a new media payload type
+ * may change the decoder, so it is handled inline on the main thread
+ * after the worker has processed all queued packets.
+ */
+static void handle_rtp(struct stream *s, const struct rtp_header *hdr,
+		       struct mbuf *mb)
+{
+	if (s->worker && (!mb || hdr->pt == s->pt_dec ||
+			  is_aux_pt(s, hdr->pt))) {
+
+		if (0 == mworker_push(s->worker, s->rtph, hdr, mb, s->arg))
+			return;
+	}
+
+	mworker_sync(s->worker);
+
+	if (mb)
+		s->pt_dec = hdr->pt;
+
+	s->rtph(hdr, mb, s->arg);
+}
+
+
+/*
+ * Adaptive jitter buffer
+ *
+ * The interarrival jitter is estimated as in RFC 3550 section 6.4.1, and
+ * the target delay is one frame plus four times the jitter. The buffer
+ * grows by playing out a concealed frame instead of taking one from the
+ * buffer, and shrinks by discarding the oldest frame once the delay has
+ * been above the target for a while.
+ *
+ * A discarded frame is not concealed, and would be heard as a click in
+ * speech. The buffer is therefore only shrunk when all the buffered
+ * packets are silence, i.e. comfort noise or a DTX frame. A stream
+ * without silence suppression is shrunk in speech, but only when the
+ * delay has been above the target for several seconds.
+ */
+static void ajb_reset(struct stream *s)
+{
+	s->ajb.prev   = false;
+	s->ajb.depth  = 0;
+	s->ajb.hold   = 0;
+	s->ajb.silent = 0;
+}
+
+
+static bool is_silence(const struct stream *s, const struct rtp_header *hdr,
+		       const struct mbuf *mb)
+{
+	const struct sdp_format *fmt;
+
+	if (hdr->pt == PT_CN || mbuf_get_left(mb) <= AJB_SILENCE_SIZE)
+		return true;
+
+	fmt = sdp_media_lformat(s->sdp, hdr->pt);
+
+	return fmt && 0 == str_casecmp(fmt->name, "CN");
+}
+
+
+static void ajb_put(struct stream *s, const struct rtp_header *hdr,
+		    const struct mbuf *mb)
+{
+	const uint32_t srate = s->ajb.srate ? s->ajb.srate : 8000;
+	const uint32_t arr = (uint32_t)(tmr_jiffies() * srate / 1000);
+	uint32_t target;
+
+	if (s->ajb.prev) {
+
+		const uint32_t dts = hdr->ts - s->ajb.ts_prev;
+		int32_t d = (int32_t)((arr - s->ajb.arr_prev) - dts);
+
+		if (d < 0)
+			d = -d;
+
+		s->ajb.jitter += d - ((s->ajb.jitter + 8) >> 4);
+
+		if ((uint16_t)(hdr->seq - s->ajb.seq_prev) == 1 &&
+		    dts && dts < srate)
+			s->ajb.frame = dts;
+	}
+
+	if (is_silence(s, hdr, mb))
+		++s->ajb.silent;
+	else
+		s->ajb.silent = 0;
+
+	s->ajb.prev     = true;
+	s->ajb.arr_prev = arr;
+	s->ajb.ts_prev  = hdr->ts;
+	s->ajb.seq_prev = hdr->seq;
+
+	if (!s->ajb.frame)
+		s->ajb.frame = srate / 50;
+
+	target = 1 + (4 * (s->ajb.jitter >> 4) + s->ajb.frame - 1)
+		/ s->ajb.frame;
+
+	s->ajb.target = min(target, config.avt.jbuf_del.max);
+
+	/* the jitter buffer drops the oldest frame on overflow */
+	if (s->ajb.depth <= config.avt.jbuf_del.max)
+		++s->ajb.depth;
+}
+
+
+static void ajb_shrink(struct stream *s)
+{
+	struct rtp_header hdr;
+	void *mb = NULL;
+	bool silent;
+
+	if (s->ajb.depth <= s->ajb.target + 1) {
+		s->ajb.hold = 0;
+		return;
+	}
+
+	if (++s->ajb.hold < AJB_SHRINK_HOLD)
+		return;
+
+	/* the buffered packets are the last ones that arrived */
+	silent = s->ajb.silent >= s->ajb.depth;
+	if (!silent && s->ajb.hold < AJB_SHRINK_FORCE)
+		return;
+
+	s->ajb.hold = 0;
+
+	if (jbuf_get(s->jbuf, &hdr, &mb)) {
+		s->ajb.depth = 0;
+		return;
+	}
+
+	--s->ajb.depth;
+	++s->ajb.n_shrink;
+
+	if (!silent)
+		++s->ajb.n_force;
+
+	/* the discarded frame is not counted as lost */
+	(void)lostcalc(s, hdr.seq);
+
+	mem_deref(mb);
+}
+
+
+/*
+ * Conceal the frames missing before the next packet. The number of
+ * concealed frames is limited, a longer gap is a jump in the stream.
+ * Only audio is concealed, a video decoder waits for the next picture.
+ */
+static void conceal_gap(struct stream *s, const struct rtp_header *hdr)
+{
+	int i, lostc = lostcalc(s, hdr->seq);
+
+	if (lostc <= 0)
+		return;
+
+	s->plc.n_lost += lostc;
+
+	if (s->type != STREAM_AUDIO)
+		return;
+
+	for (i=0; i<min(lostc, PLC_MAX_GAP); i++) {
+		++s->plc.n_gap;
+		handle_rtp(s, hdr, NULL);
+	}
 }
 
 
@@ -143,8 +373,10 @@ static void rtp_recv(const struct sa *src, const struct rtp_header *hdr,
 		void *mb2 = NULL;
 
 		/* Put frame in Jitter Buffer */
-		if (flush)
+		if (flush) {
 			jbuf_flush(s->jbuf);
+			ajb_reset(s);
+		}
 
 		err = jbuf_put(s->jbuf, hdr, mb);
 		if (err) {
@@ -152,29 +384,55 @@ static void rtp_recv(const struct sa *src, const struct rtp_header *hdr,
 					sdp_media_name(s->sdp), mb->end,
 					src, err);
 		}
+		else if (s->ajb.enabled) {
+			ajb_put(s, hdr, mb);
+		}
+
+		if (s->ajb.enabled) {
+
+			/* Grow the delay, conceal one frame */
+			if (s->ajb.depth < s->ajb.target) {
+
+				if (s->jbuf_started) {
+					++s->ajb.n_grow;
+					handle_rtp(s, hdr, NULL);
+				}
+
+				return;
+			}
+
+			ajb_shrink(s);
+		}
 
 		if (jbuf_get(s->jbuf, &hdr2, &mb2)) {
 
-			if (!s->jbuf_started)
+			s->ajb.depth = 0;
+
+			if (!s->jbuf_started || s->type != STREAM_AUDIO)
 				return;
 
-			memset(&hdr2, 0, sizeof(hdr2));
+			/* underrun: conceal one frame, the sequence
+			 * is checked when the next frame comes out */
+			++s->plc.n_underrun;
+			handle_rtp(s, hdr, NULL);
+			return;
+		}
+		else if (s->ajb.depth) {
+			--s->ajb.depth;
 		}
 
 		s->jbuf_started = true;
 
-		if (lostcalc(s, hdr2.seq) > 0)
-			s->rtph(hdr, NULL, s->arg);
+		conceal_gap(s, &hdr2);
 
-		s->rtph(&hdr2, mb2, s->arg);
+		handle_rtp(s, &hdr2, mb2);
 
 		mem_deref(mb2);
 	}
 	else {
-		if (lostcalc(s, hdr->seq) > 0)
-			s->rtph(hdr, NULL, s->arg);
+		conceal_gap(s, hdr);
 
-		s->rtph(hdr, mb, s->arg);
+		handle_rtp(s, hdr, mb);
 	}
 }
 
@@ -193,28 +451,27 @@ static void rtcp_handler(const struct sa *src, struct rtcp_msg *msg, void *arg)
 
 static int stream_sock_alloc(struct stream *s, int af)
 {
-	struct sa laddr;
-	int tos, err;
+	int err;
 
 	if (!s)
 		return EINVAL;
 
-	/* we listen on all interfaces */
-	sa_init(&laddr, sa_af(net_laddr_af(af)));
-
-	err = rtp_listen(&s->rtp, IPPROTO_UDP, &laddr,
-			 config.avt.rtp_ports.min, config.avt.rtp_ports.max,
-			 s->rtcp, rtp_recv, rtcp_handler, s);
+	err = rtppool_take(&s->rs, sa_af(net_laddr_af(af)),
+			   rtp_recv, rtcp_handler, s);
 	if (err)
 		return err;
 
-	tos = config.avt.rtp_tos;
-	(void)udp_setsockopt(rtp_sock(s->rtp), IPPROTO_IP, IP_TOS,
-			     &tos, sizeof(tos));
-	(void)udp_setsockopt(rtcp_sock(s->rtp), IPPROTO_IP, IP_TOS,
-			     &tos, sizeof(tos));
+	s->rtp = rtppool_rtp(s->rs);
+
+	if (config.avt.rtp_rxbatch > 1) {
 
-	udp_rxsz_set(rtp_sock(s->rtp), RTP_RECV_SIZE);
+		err = udprx_alloc(&s->rxb, rtp_sock(s->rtp),
+				  sa_af(rtp_local(s->rtp)),
+				  config.avt.rtp_rxbatch, RTP_RECV_SIZE);
+		if (err) {
+			DEBUG_WARNING("batched receive disabled (%m)\n", err);
+		}
+	}
 
 	return 0;
 }
@@ -279,13 +536,27 @@ int stream_alloc(struct stream **sp, struct call *call,
 	s->arg   = arg;
 	s->pseq  = -1;
 	s->rtcp  = config.avt.rtcp_enable;
+	s->pt_dec = -1;
+
+	s->worker = mworker_assign();
 
 	err = stream_sock_alloc(s, call_af(call));
 	if (err)
 		goto out;
 
 	/* Jitter buffer */
-	if (config.avt.jbuf_del.min && config.avt.jbuf_del.max) {
+	if (config.avt.jbuf_adaptive && s->type == STREAM_AUDIO &&
+	    config.avt.jbuf_del.max) {
+
+		/* the delay is controlled by the stream, see ajb_put() */
+		err = jbuf_alloc(&s->jbuf, 0, config.avt.jbuf_del.max + 1);
+		if (err)
+			goto out;
+
+		s->ajb.enabled = true;
+		s->ajb.target  = 1;
+	}
+	else if (config.avt.jbuf_del.min && config.avt.jbuf_del.max) {
 
 		err = jbuf_alloc(&s->jbuf, config.avt.jbuf_del.min,
 				 config.avt.jbuf_del.max);
@@ -329,6 +600,18 @@ int stream_alloc(struct stream **sp, struct call *call,
 	if (err)
 		goto out;
 
+	/* the batch must see the final datagrams, i.e. no UDP helpers */
+	if (config.avt.rtp_txbatch > 1 && !mnat && !menc) {
+
+		err = udptx_alloc(&s->txb, rtp_sock(s->rtp),
+				  sa_af(rtp_local(s->rtp)),
+				  config.avt.rtp_txbatch);
+		if (err) {
+			DEBUG_WARNING("batched transmit disabled (%m)\n", err);
+			err = 0;
+		}
+	}
+
 	s->pt_enc = -1;
 
 	list_append(call_streaml(call), &s->le, s);
@@ -413,6 +696,34 @@ int stream_send(struct stream *s, bool marker, int pt, uint32_t ts,
 }
 
 
+/**
+ * Start collecting outgoing RTP packets, e.g. all packets of one frame
+ *
+ * @param s Stream object
+ */
+void stream_tx_begin(struct stream *s)
+{
+	if (!s)
+		return;
+
+	udptx_begin(s->txb);
+}
+
+
+/**
+ * Send all RTP packets collected since stream_tx_begin()
+ *
+ * @param s Stream object
+ */
+void stream_tx_flush(struct stream *s)
+{
+	if (!s)
+		return;
+
+	udptx_flush(s->txb);
+}
+
+
 static void stream_remote_set(struct stream *s, const char *cname)
 {
 	struct sa rtcp;
@@ -492,6 +803,23 @@ int stream_jbuf_stat(struct re_printf *pf, const struct stream *s)
 				  stat.n_overflow, stat.n_underflow);
 	}
 
+	if (s->ajb.enabled) {
+		const uint32_t srate = s->ajb.srate ? s->ajb.srate : 8000;
+		const uint32_t frame = s->ajb.frame * 1000 / srate;
+
+		err |= re_hprintf(pf, " delay=%u/%u ms jitter=%u ms"
+				  " grow=%u shrink=%u (%u in speech)",
+				  s->ajb.depth * frame, s->ajb.target * frame,
+				  (s->ajb.jitter >> 4) * 1000 / srate,
+				  s->ajb.n_grow, s->ajb.n_shrink,
+				  s->ajb.n_force);
+	}
+
+	err |= re_hprintf(pf, " lost=%u conceal=%u (gap=%u underrun=%u)",
+			  s->plc.n_lost,
+			  s->plc.n_gap + s->plc.n_underrun + s->ajb.n_grow,
+			  s->plc.n_gap, s->plc.n_underrun);
+
 	return err;
 }
 
@@ -511,6 +839,8 @@ void stream_set_srate(struct stream *s, uint32_t srate_tx, uint32_t srate_rx)
 		return;
 
 	rtcp_set_srate(s->rtp, srate_tx, srate_rx);
+
+	s->ajb.srate = srate_rx;
 }
 
 
@@ -538,6 +868,7 @@ void stream_reset(struct stream *s)
 		return;
 
 	jbuf_flush(s->jbuf);
+	ajb_reset(s);
 }
 
 
@@ -583,6 +914,9 @@ int stream_debug(struct re_printf *pf, const struct stream *s)
 
 	err |= rtp_debug(pf, s->rtp);
 	err |= jbuf_debug(pf, s->jbuf);
+	err |= udprx_debug(pf, s->rxb);
+	err |= udptx_debug(pf, s->txb);
+	err |= mworker_debug(pf, s->worker);
 
 	return err;
 }
@@ -596,3 +930,32 @@ int stream_print(struct re_printf *pf, const struct stream *s)
 	return re_hprintf(pf, " %s=%u/%u", sdp_media_name(s->sdp),
 			  s->stats.bitrate_tx, s->stats.bitrate_rx);
 }
+
+
+/**
+ * Wait until all received packets of the stream have been processed,
+ * must be called before changing or freeing the decoder state
+ *
+ * @param s Stream object
+ */
+void stream_rx_sync(struct stream *s)
+{
+	if (!s)
+		return;
+
+	mworker_sync(s->worker);
+}
+
+
+/**
+ * Check if the received packets of the stream are decoded on a media
+ * worker thread, i.e. the RTP handler is not called on the main thread
+ *
+ * @param s Stream object
+ *
+ * @return True if decoding on a worker thread, otherwise false
+ */
+bool stream_rx_async(const struct stream *s)
+{
+	return s && s->worker;
+}
@@ -20,7 +20,7 @@
 
 enum {
 	REG_INTERVAL    = 3600,
-	MAX_CALLS       =    4
+	UA_HASH_SIZE    = 1024,  /**< Buckets in the UA lookup indexes   */
 };
 
 
@@ -58,6 +58,8 @@ struct ua_prm {
 struct ua {
 	MAGIC_DECL                   /**< Magic number for struct ua         */
 	struct le le;                /**< Linked list element                */
+	struct le he_cuser;          /**< Hash element, by contact user      */
+	struct le he_aor;            /**< Hash element, by AOR user          */
 	struct ua_prm *prm;          /**< UA Parameters                      */
 	struct list regl;            /**< List of Register clients           */
 	struct list calls;           /**< List of active calls (struct call) */
@@ -78,6 +80,8 @@ struct eh {
 
 static struct {
 	struct list ual;
+	struct hash *ht_cuser;         /**< UAs by contact user, no case  */
+	struct hash *ht_aor;           /**< UAs by AOR user, no case      */
 	struct list ehl;               /**< Event handlers (struct eh)    */
 	struct sip *sip;
 	struct sip_lsnr *lsnr;
@@ -96,6 +100,8 @@ static struct {
 	bool prefer_ipv6;              /**< Force IPv6 transport          */
 } uag = {
 	LIST_INIT,
+	NULL,
+	NULL,
 	LIST_INIT,
 	NULL,
 	NULL,
@@ -630,6 +636,11 @@ static void ua_destructor(void *arg)
 	struct ua *ua = arg;
 
 	list_unlink(&ua->le);
+	hash_unlink(&ua->he_cuser);
+	hash_unlink(&ua->he_aor);
+
+	if (uag.cur == ua)
+		uag.cur = NULL;
 
 	mem_deref(ua->dialbuf);
 	mem_deref(ua->addr);
@@ -907,6 +918,56 @@ static int mk_aor(struct ua *ua, const char *aor)
 }
 
 
+/* Add the UA to the lookup indexes, after the AOR and contact user is set */
+static void ua_index(struct ua *ua, struct hash *ht_cuser,
+		     struct hash *ht_aor)
+{
+	hash_append(ht_cuser, hash_joaat_str_ci(ua->cuser),
+		    &ua->he_cuser, ua);
+	hash_append(ht_aor, hash_joaat_pl_ci(&ua->aor.uri.user),
+		    &ua->he_aor, ua);
+}
+
+
+static bool cuser_cmp_handler(struct le *le, void *arg)
+{
+	const struct ua *ua = le->data;
+
+	return 0 == pl_strcasecmp(arg, ua->cuser);
+}
+
+
+static bool aor_cmp_handler(struct le *le, void *arg)
+{
+	const struct ua *ua = le->data;
+
+	return 0 == pl_casecmp(arg, &ua->aor.uri.user);
+}
+
+
+/* Find a UA in the lookup indexes, by contact user or else by AOR user */
+static struct ua *find_hash(struct hash *ht_cuser, struct hash *ht_aor,
+			    const struct pl *cuser)
+{
+	struct le *le;
+	uint32_t key;
+
+	if (!cuser)
+		return NULL;
+
+	key = hash_joaat_pl_ci(cuser);
+
+	le = hash_lookup(ht_cuser, key, cuser_cmp_handler, (void *)cuser);
+	if (le)
+		return le->data;
+
+	/* Try also matching by AOR, for better interop */
+	le = hash_lookup(ht_aor, key, aor_cmp_handler, (void *)cuser);
+
+	return le ? le->data : NULL;
+}
+
+
 static bool request_handler(const struct sip_msg *msg, void *arg)
 {
 	struct ua *ua;
@@ -1038,6 +1099,8 @@ int ua_alloc(struct ua **uap, const char *aor,
 	if (err)
 		goto out;
 
+	ua_index(ua, uag.ht_cuser, uag.ht_aor);
+
 	/* Decode address parameters */
 	err |= sip_params_decode(ua->prm, ua);
 	answermode_decode(ua->prm, &ua->aor.params);
@@ -1670,13 +1733,26 @@ static void sipsess_conn_handler(const struct sip_msg *msg, void *arg)
 	}
 
 	/* handle multiple calls */
-	if (list_count(&ua->calls) + 1 > MAX_CALLS) {
-		DEBUG_NOTICE("rejected call from %r (maximum %d calls)\n",
-			     &msg->from.auri, MAX_CALLS);
+	if (config.call.max_calls &&
+	    list_count(&ua->calls) + 1 > config.call.max_calls) {
+		DEBUG_NOTICE("rejected call from %r (maximum %u calls)\n",
+			     &msg->from.auri, config.call.max_calls);
 		(void)sip_treply(NULL, uag.sip, msg, 486, "Busy Here");
 		return;
 	}
 
+	/* a saturated box rejects new calls, instead of degrading all */
+	if (!load_admit()) {
+		DEBUG_NOTICE("rejected call from %r, %H",
+			     &msg->from.auri, load_debug, NULL);
+		(void)sip_treplyf(NULL, NULL, uag.sip, msg, false,
+				  503, "Service Unavailable",
+				  "Retry-After: %u\r\n"
+				  "Content-Length: 0\r\n\r\n",
+				  config.call.retry_after);
+		return;
+	}
+
 	/* Handle Require: header, check for any required extensions */
 	hdr = sip_msg_hdr_apply(msg, true, SIP_HDR_REQUIRE,
 				require_handler, ua);
@@ -1737,8 +1813,181 @@ static int cmd_quit(struct re_printf *pf, void *unused)
 }
 
 
+/*
+ * The UA lookup benchmark uses its own accounts, list and indexes, and
+ * does not change the UAs of the running application.
+ */
+struct find_bench {
+	struct list ual;           /**< Benchmark accounts                 */
+	struct hash *ht_cuser;     /**< Accounts by contact user           */
+	struct hash *ht_aor;       /**< Accounts by AOR user               */
+	struct ua **uav;           /**< Accounts in order of allocation    */
+	uint32_t n;                /**< Number of accounts                 */
+};
+
+
+/* Linear search of all UAs, as a reference for the benchmark */
+static struct ua *find_linear(const struct list *ual, const struct pl *cuser)
+{
+	struct le *le;
+
+	for (le = ual->head; le; le = le->next) {
+		struct ua *ua = le->data;
+
+		if (0 == pl_strcasecmp(cuser, ua->cuser))
+			return ua;
+	}
+
+	for (le = ual->head; le; le = le->next) {
+		struct ua *ua = le->data;
+
+		if (0 == pl_casecmp(cuser, &ua->aor.uri.user))
+			return ua;
+	}
+
+	return NULL;
+}
+
+
+/* Add a UA with only an AOR, which is never registered */
+static int bench_ua_add(struct find_bench *fb)
+{
+	struct ua *ua;
+	char aor[64];
+	int err;
+
+	ua = mem_zalloc(sizeof(*ua), ua_destructor);
+	if (!ua)
+		return ENOMEM;
+
+	MAGIC_INIT(ua);
+
+	list_append(&fb->ual, &ua->le, ua);
+
+	(void)re_snprintf(aor, sizeof(aor), "sip:bench-%u@127.0.0.1", fb->n);
+
+	err = mk_aor(ua, aor);
+	if (err) {
+		mem_deref(ua);
+		return err;
+	}
+
+	ua_index(ua, fb->ht_cuser, fb->ht_aor);
+
+	fb->uav[fb->n++] = ua;
+
+	return 0;
+}
+
+
+/* Average time of finding the UA of a request, half by AOR user */
+static int bench_find(uint32_t *nsec, const struct find_bench *fb,
+		      bool hash)
+{
+	uint64_t start, usec;
+	uint32_t i, j = 0, nfind = 0;
+	const struct ua *found;
+	struct pl pl;
+
+	start = realtime_usec();
+
+	do {
+		for (i=0; i<1000; i++) {
+
+			const struct ua *ua = fb->uav[j];
+
+			if (i & 1)
+				pl = ua->aor.uri.user;
+			else
+				pl_set_str(&pl, ua->cuser);
+
+			if (hash)
+				found = find_hash(fb->ht_cuser, fb->ht_aor,
+						  &pl);
+			else
+				found = find_linear(&fb->ual, &pl);
+
+			if (found != ua)
+				return EPROTO;
+
+			j = (j + 7919) % fb->n;
+		}
+
+		nfind += 1000;
+		usec = realtime_usec() - start;
+
+	} while (usec < 100000);
+
+	*nsec = (uint32_t)(usec * 1000 / nfind);
+
+	return 0;
+}
+
+
+/*
+ * Add dummy accounts in steps, and measure how long it takes to find
+ * the UA of an incoming request, with the indexes and without.
+ */
+static int cmd_find_bench(struct re_printf *pf, void *unused)
+{
+	static const uint32_t stepv[] = {10, 100, 1000, 5000, 10000};
+	const uint32_t n_max = stepv[ARRAY_SIZE(stepv) - 1];
+	struct find_bench fb;
+	uint32_t i, t_hash, t_lin;
+	int err = 0;
+	(void)unused;
+
+	memset(&fb, 0, sizeof(fb));
+
+	fb.uav = mem_zalloc(n_max * sizeof(*fb.uav), NULL);
+	err  = hash_alloc(&fb.ht_cuser, UA_HASH_SIZE);
+	err |= hash_alloc(&fb.ht_aor, UA_HASH_SIZE);
+	if (err || !fb.uav) {
+		err = err ? err : ENOMEM;
+		goto out;
+	}
+
+	err = re_hprintf(pf, "UA lookup benchmark (%u buckets)\n"
+			 "%10s %10s %10s\n", UA_HASH_SIZE,
+			 "accounts", "hash [ns]", "list [ns]");
+	if (err)
+		goto out;
+
+	for (i=0; i<ARRAY_SIZE(stepv); i++) {
+
+		while (fb.n < stepv[i]) {
+			err = bench_ua_add(&fb);
+			if (err)
+				goto out;
+		}
+
+		err  = bench_find(&t_hash, &fb, true);
+		err |= bench_find(&t_lin, &fb, false);
+		if (err)
+			goto out;
+
+		err = re_hprintf(pf, "%10u %10u %10u\n", fb.n, t_hash, t_lin);
+		if (err)
+			goto out;
+	}
+
+ out:
+	/* the UA destructor unlinks the hash elements */
+	list_flush(&fb.ual);
+	mem_deref(fb.ht_cuser);
+	mem_deref(fb.ht_aor);
+	mem_deref(fb.uav);
+
+	if (err)
+		(void)re_hprintf(pf, "UA lookup benchmark failed: %m\n", err);
+
+	return err;
+}
+
+
 static const struct cmd cmdv[] = {
 	{'q',       0, "Quit",                     cmd_quit             },
+	{'U',       0, "UA lookup benchmark",      cmd_find_bench       },
 };
 
 
@@ -1769,6 +2018,21 @@ int ua_init(const char *software, bool udp, bool tcp, bool tls,
 	uag.prefer_ipv6 = prefer_ipv6;
 	list_init(&uag.ual);
 
+	err  = hash_alloc(&uag.ht_cuser, UA_HASH_SIZE);
+	err |= hash_alloc(&uag.ht_aor, UA_HASH_SIZE);
+	if (err)
+		goto out;
+
+	err = mworker_init(config.avt.workers);
+	if (err)
+		goto out;
+
+	err = load_init();
+	if (err)
+		goto out;
+
+	rtppool_init(prefer_ipv6 ? AF_INET6 : AF_INET);
+
 	err = ua_setup_transp(software, udp, tcp, tls);
 	if (err)
 		goto out;
@@ -1836,6 +2100,8 @@ void ua_close(void)
 	cmd_unregister(cmdv);
 	net_close();
 	play_close();
+	load_close();
+	rtppool_close();
 
 	uag.evsock = mem_deref(uag.evsock);
 	uag.sock   = mem_deref(uag.sock);
@@ -1848,6 +2114,14 @@ void ua_close(void)
 
 	list_flush(&uag.ual);
 	list_flush(&uag.ehl);
+
+	/* a UA that is still referenced must not unlink from a freed hash */
+	hash_clear(uag.ht_cuser);
+	hash_clear(uag.ht_aor);
+	uag.ht_cuser = mem_deref(uag.ht_cuser);
+	uag.ht_aor   = mem_deref(uag.ht_aor);
+
+	mworker_close();
 }
 
 
@@ -2073,6 +2347,7 @@ int ua_print_reg_status(struct re_printf *pf, void *unused)
 
 	err = re_hprintf(pf, "\n--- Useragents: %u/%u ---\n", ua_nreg_get(),
 			 n_uas());
+	err |= reg_sched_debug(pf, NULL);
 
 	for (le = uag.ual.head; le && !err; le = le->next) {
 		const struct ua *ua = le->data;
@@ -2102,14 +2377,17 @@ int ua_print_call_status(struct re_printf *pf, void *unused)
 
 	(void)unused;
 
+	err  = load_debug(pf, NULL);
+	err |= call_trace_debug(pf, NULL);
+
 	call = current_call(uag_cur());
 	if (call) {
-		err  = re_hprintf(pf, "\n--- Call status: ---\n");
+		err |= re_hprintf(pf, "\n--- Call status: ---\n");
 		err |= call_debug(pf, call);
 		err |= re_hprintf(pf, "\n");
 	}
 	else {
-		err  = re_hprintf(pf, "\n(no active calls)\n");
+		err |= re_hprintf(pf, "\n(no active calls)\n");
 	}
 
 	return err;
@@ -2273,24 +2551,7 @@ const char *ua_param(const struct ua *ua, const char *key)
  */
 struct ua *uag_find(const struct pl *cuser)
 {
-	struct le *le;
-
-	for (le = uag.ual.head; le; le = le->next) {
-		struct ua *ua = le->data;
-
-		if (0 == pl_strcasecmp(cuser, ua->cuser))
-			return ua;
-	}
-
-	/* Try also matching by AOR, for better interop */
-	for (le = uag.ual.head; le; le = le->next) {
-		struct ua *ua = le->data;
-
-		if (0 == pl_casecmp(cuser, &ua->aor.uri.user))
-			return ua;
-	}
-
-	return NULL;
+	return find_hash(uag.ht_cuser, uag.ht_aor, cuser);
 }
 
 
@@ -0,0 +1,634 @@
+/**
+ * @file udpbatch.c  Batched UDP socket I/O for media streams
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#define _GNU_SOURCE 1
+#include <string.h>
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <errno.h>
+#endif
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+#define DEBUG_MODULE "udpbatch"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
+
+/*
+ * Batched receive takes over the read handler of a UDP socket and reads
+ * up to N datagrams per wakeup with recvmmsg(). Each datagram is injected
+ * into the normal receive path of the socket, so UDP helpers (media
+ * encryption, NAT traversal) and the RTP/RTCP handlers work unchanged.
+ *
+ * The receive buffers are reused for the next batch, unless they were
+ * referenced by the receive path (e.g. the jitter buffer), in which case
+ * a new buffer is allocated for that slot. Datagrams larger than the
+ * receive buffer are truncated by the kernel, and are dropped.
+ *
+ * The datagrams are injected with udp_recv_packet(), which is not in
+ * libre 0.4.4. The Makefile only enables batched receive if the libre
+ * headers declare it, otherwise udprx_alloc() returns ENOSYS and the
+ * stream keeps the normal receive path.
+ *
+ * Batched transmit registers a UDP helper which, between udptx_begin()
+ * and udptx_flush(), queues the outgoing datagrams instead of sending
+ * them. The queue is then sent with one UDP GSO send if all datagrams
+ * have the same size and destination, or with sendmmsg() otherwise.
+ * Since the helper must see the final datagrams, batched transmit is
+ * only used on sockets without other UDP helpers.
+ */
+
+
+enum {
+	UDPTX_BUFSZ  = 65000,   /**< Maximum bytes per batch (GSO limit)   */
+	UDPTX_MAXSEG = 64,      /**< Maximum datagrams per GSO send        */
+	UDPTX_LAYER  = -1000,   /**< UDP helper layer, closest to the wire */
+};
+
+
+/** Defines a batched receiver for one UDP socket */
+struct udprx {
+	struct udp_sock *us;        /**< UDP socket                        */
+	int fd;                     /**< Socket file descriptor            */
+	uint32_t n;                 /**< Maximum datagrams per read        */
+	size_t bufsz;               /**< Size of each receive buffer       */
+	struct mbuf **mbv;          /**< Receive buffers                   */
+	struct sa *srcv;            /**< Source addresses                  */
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr *msgv;       /**< Message headers                   */
+	struct iovec *iov;          /**< I/O vectors                       */
+#endif
+	struct {
+		uint32_t n_read;    /**< Number of read calls              */
+		uint32_t n_pkt;     /**< Number of datagrams               */
+		uint32_t n_max;     /**< Maximum datagrams per read        */
+		uint32_t n_alloc;   /**< Receive buffers re-allocated      */
+		uint32_t n_trunc;   /**< Truncated datagrams dropped       */
+	} stats;
+};
+
+
+/** Defines one queued datagram */
+struct udptx_pkt {
+	size_t off;                 /**< Offset in the batch buffer        */
+	size_t len;                 /**< Length of the datagram            */
+	struct sa dst;              /**< Destination address               */
+};
+
+/** Defines a batched transmitter for one UDP socket */
+struct udptx {
+	struct udp_helper *uh;      /**< UDP helper for capturing          */
+	struct lock *lock;          /**< Protects the queue                */
+	int fd;                     /**< Socket file descriptor            */
+	uint8_t *buf;               /**< Batch buffer, datagrams back2back */
+	size_t used;                /**< Number of bytes used in buffer    */
+	struct udptx_pkt *pktv;     /**< Queued datagrams                  */
+	uint32_t n;                 /**< Maximum datagrams per batch       */
+	uint32_t cnt;               /**< Number of queued datagrams        */
+	bool open;                  /**< Batch is open, capture datagrams  */
+	bool gso;                   /**< UDP GSO is supported              */
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr *msgv;       /**< Message headers                   */
+	struct iovec *iov;          /**< I/O vectors                       */
+#endif
+	struct {
+		uint32_t n_pkt;     /**< Number of datagrams sent          */
+		uint32_t n_call;    /**< Number of send system calls       */
+		uint32_t n_gso;     /**< Number of GSO sends               */
+		uint32_t n_err;     /**< Number of send errors             */
+	} stats;
+};
+
+
+#ifdef HAVE_RECVMMSG
+
+
+static void udprx_destructor(void *arg)
+{
+	struct udprx *rx = arg;
+	uint32_t i;
+
+	if (rx->fd >= 0)
+		fd_close(rx->fd);
+
+	for (i=0; i<rx->n; i++)
+		mem_deref(rx->mbv[i]);
+
+	mem_deref(rx->mbv);
+	mem_deref(rx->srcv);
+	mem_deref(rx->msgv);
+	mem_deref(rx->iov);
+	mem_deref(rx->us);
+}
+
+
+static void read_handler(int flags, void *arg)
+{
+	struct udprx *rx = arg;
+	uint32_t i, c;
+	int n;
+	(void)flags;
+
+	for (c=0; c<rx->n; c++) {
+
+		struct msghdr *hdr = &rx->msgv[c].msg_hdr;
+
+		if (!rx->mbv[c]) {
+
+			rx->mbv[c] = mbuf_alloc(rx->bufsz);
+			if (!rx->mbv[c])
+				break;
+
+			++rx->stats.n_alloc;
+		}
+
+		rx->iov[c].iov_base = rx->mbv[c]->buf;
+		rx->iov[c].iov_len  = rx->mbv[c]->size;
+
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->msg_name    = &rx->srcv[c].u;
+		hdr->msg_namelen = sizeof(rx->srcv[c].u);
+		hdr->msg_iov     = &rx->iov[c];
+		hdr->msg_iovlen  = 1;
+	}
+
+	if (!c)
+		return;
+
+	n = recvmmsg(rx->fd, rx->msgv, c, MSG_DONTWAIT, NULL);
+	if (n <= 0)
+		return;
+
+	++rx->stats.n_read;
+	rx->stats.n_pkt += n;
+	if ((uint32_t)n > rx->stats.n_max)
+		rx->stats.n_max = n;
+
+	/* the receive path might close the stream */
+	mem_ref(rx);
+
+	for (i=0; i<(uint32_t)n; i++) {
+
+		struct mbuf *mb = rx->mbv[i];
+
+		if (rx->msgv[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			++rx->stats.n_trunc;
+			continue;
+		}
+
+		mb->pos = 0;
+		mb->end = rx->msgv[i].msg_len;
+		rx->srcv[i].len = rx->msgv[i].msg_hdr.msg_namelen;
+
+		udp_recv_packet(rx->us, &rx->srcv[i], mb);
+
+		/* keep the buffer only if nobody else holds it */
+		if (mem_nrefs(mb) > 1)
+			rx->mbv[i] = mem_deref(mb);
+	}
+
+	mem_deref(rx);
+}
+
+
+/**
+ * Enable batched receive on a UDP socket
+ *
+ * @param rxp   Pointer to allocated batched receiver
+ * @param us    UDP socket
+ * @param af    Address family of the socket
+ * @param n     Maximum number of datagrams per read
+ * @param bufsz Size of each receive buffer in [bytes]
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int udprx_alloc(struct udprx **rxp, struct udp_sock *us, int af,
+		uint32_t n, size_t bufsz)
+{
+	struct udprx *rx;
+	int err;
+
+	if (!rxp || !us || !n || !bufsz)
+		return EINVAL;
+
+	rx = mem_zalloc(sizeof(*rx), udprx_destructor);
+	if (!rx)
+		return ENOMEM;
+
+	rx->fd    = -1;
+	rx->us    = mem_ref(us);
+	rx->n     = n;
+	rx->bufsz = bufsz;
+
+	rx->mbv  = mem_zalloc(n * sizeof(*rx->mbv), NULL);
+	rx->srcv = mem_zalloc(n * sizeof(*rx->srcv), NULL);
+	rx->msgv = mem_zalloc(n * sizeof(*rx->msgv), NULL);
+	rx->iov  = mem_zalloc(n * sizeof(*rx->iov), NULL);
+	if (!rx->mbv || !rx->srcv || !rx->msgv || !rx->iov) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	rx->fd = udp_sock_fd(us, af);
+	if (rx->fd < 0) {
+		err = EBADF;
+		goto out;
+	}
+
+	/* replaces the read handler of the UDP socket */
+	err = fd_listen(rx->fd, FD_READ, read_handler, rx);
+	if (err) {
+		rx->fd = -1;
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(rx);
+	else
+		*rxp = rx;
+
+	return err;
+}
+
+
+#else
+
+
+int udprx_alloc(struct udprx **rxp, struct udp_sock *us, int af,
+		uint32_t n, size_t bufsz)
+{
+	(void)rxp;
+	(void)us;
+	(void)af;
+	(void)n;
+	(void)bufsz;
+
+	return ENOSYS;
+}
+
+
+#endif
+
+
+int udprx_debug(struct re_printf *pf, const struct udprx *rx)
+{
+	uint32_t avg;
+
+	if (!rx)
+		return 0;
+
+	avg = rx->stats.n_read ?
+		(uint32_t)(100ULL * rx->stats.n_pkt / rx->stats.n_read) : 0;
+
+	return re_hprintf(pf, " rxbatch: %u reads, %u packets"
+			  " (avg %u.%02u, max %u per read), %u buffers,"
+			  " %u truncated\n",
+			  rx->stats.n_read, rx->stats.n_pkt,
+			  avg / 100, avg % 100,
+			  rx->stats.n_max, rx->stats.n_alloc,
+			  rx->stats.n_trunc);
+}
+
+
+#ifdef HAVE_SENDMMSG
+
+
+static int send_gso(struct udptx *tx)
+{
+#ifdef UDP_SEGMENT
+	char ctrl[CMSG_SPACE(sizeof(uint16_t))];
+	const uint16_t segsz = (uint16_t)tx->pktv[0].len;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	struct iovec iov;
+
+	iov.iov_base = tx->buf;
+	iov.iov_len  = tx->used;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name       = &tx->pktv[0].dst.u;
+	msg.msg_namelen    = tx->pktv[0].dst.len;
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_UDP;
+	cm->cmsg_type  = UDP_SEGMENT;
+	cm->cmsg_len   = CMSG_LEN(sizeof(segsz));
+	memcpy(CMSG_DATA(cm), &segsz, sizeof(segsz));
+
+	++tx->stats.n_call;
+
+	if (sendmsg(tx->fd, &msg, 0) < 0)
+		return errno;
+
+	++tx->stats.n_gso;
+
+	return 0;
+#else
+	(void)tx;
+	return ENOSYS;
+#endif
+}
+
+
+/* GSO needs equal sized datagrams (except the last) to one destination */
+static bool gso_possible(const struct udptx *tx)
+{
+	const size_t segsz = tx->pktv[0].len;
+	uint32_t i;
+
+	if (!tx->gso || tx->cnt < 2 || tx->cnt > UDPTX_MAXSEG)
+		return false;
+
+	for (i=1; i<tx->cnt; i++) {
+
+		const struct udptx_pkt *pkt = &tx->pktv[i];
+
+		if (!sa_cmp(&pkt->dst, &tx->pktv[0].dst, SA_ALL))
+			return false;
+
+		if (pkt->len > segsz || (i < tx->cnt-1 && pkt->len != segsz))
+			return false;
+	}
+
+	return true;
+}
+
+
+static void send_mmsg(struct udptx *tx)
+{
+	uint32_t i, sent = 0;
+
+	for (i=0; i<tx->cnt; i++) {
+
+		struct udptx_pkt *pkt = &tx->pktv[i];
+		struct msghdr *hdr = &tx->msgv[i].msg_hdr;
+
+		tx->iov[i].iov_base = tx->buf + pkt->off;
+		tx->iov[i].iov_len  = pkt->len;
+
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->msg_name    = &pkt->dst.u;
+		hdr->msg_namelen = pkt->dst.len;
+		hdr->msg_iov     = &tx->iov[i];
+		hdr->msg_iovlen  = 1;
+	}
+
+	while (sent < tx->cnt) {
+
+		int n = sendmmsg(tx->fd, tx->msgv + sent, tx->cnt - sent, 0);
+
+		++tx->stats.n_call;
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		/* drop the failing datagram and send the rest */
+		if (n <= 0) {
+			++tx->stats.n_err;
+			++sent;
+			continue;
+		}
+
+		sent += n;
+	}
+}
+
+
+/* must be called with the lock held */
+static void flush(struct udptx *tx)
+{
+	if (!tx->cnt)
+		return;
+
+	if (gso_possible(tx)) {
+
+		int err = send_gso(tx);
+		if (err) {
+			DEBUG_NOTICE("UDP GSO disabled (%m)\n", err);
+			tx->gso = false;
+			send_mmsg(tx);
+		}
+	}
+	else {
+		send_mmsg(tx);
+	}
+
+	tx->stats.n_pkt += tx->cnt;
+	tx->cnt  = 0;
+	tx->used = 0;
+}
+
+
+static bool send_handler(int *err, struct sa *dst, struct mbuf *mb,
+			 void *arg)
+{
+	struct udptx *tx = arg;
+	const size_t len = mbuf_get_left(mb);
+	struct udptx_pkt *pkt;
+	bool hdld = false;
+	(void)err;
+
+	lock_write_get(tx->lock);
+
+	if (!tx->open)
+		goto out;
+
+	if (tx->cnt >= tx->n || tx->used + len > UDPTX_BUFSZ)
+		flush(tx);
+
+	/* too big for the batch, send directly after the queue */
+	if (len > UDPTX_BUFSZ)
+		goto out;
+
+	memcpy(tx->buf + tx->used, mbuf_buf(mb), len);
+
+	pkt = &tx->pktv[tx->cnt++];
+	pkt->off = tx->used;
+	pkt->len = len;
+	pkt->dst = *dst;
+
+	tx->used += len;
+	hdld = true;
+
+ out:
+	lock_rel(tx->lock);
+
+	return hdld;
+}
+
+
+static bool recv_handler(struct sa *src, struct mbuf *mb, void *arg)
+{
+	(void)src;
+	(void)mb;
+	(void)arg;
+
+	return false;
+}
+
+
+static void udptx_destructor(void *arg)
+{
+	struct udptx *tx = arg;
+
+	mem_deref(tx->uh);
+	mem_deref(tx->buf);
+	mem_deref(tx->pktv);
+	mem_deref(tx->msgv);
+	mem_deref(tx->iov);
+	mem_deref(tx->lock);
+}
+
+
+/**
+ * Enable batched transmit on a UDP socket
+ *
+ * @param txp Pointer to allocated batched transmitter
+ * @param us  UDP socket
+ * @param af  Address family of the socket
+ * @param n   Maximum number of datagrams per batch
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int udptx_alloc(struct udptx **txp, struct udp_sock *us, int af, uint32_t n)
+{
+	struct udptx *tx;
+	int err;
+
+	if (!txp || !us || !n)
+		return EINVAL;
+
+	tx = mem_zalloc(sizeof(*tx), udptx_destructor);
+	if (!tx)
+		return ENOMEM;
+
+	tx->n = n;
+#ifdef UDP_SEGMENT
+	tx->gso = true;
+#endif
+
+	tx->buf  = mem_alloc(UDPTX_BUFSZ, NULL);
+	tx->pktv = mem_zalloc(n * sizeof(*tx->pktv), NULL);
+	tx->msgv = mem_zalloc(n * sizeof(*tx->msgv), NULL);
+	tx->iov  = mem_zalloc(n * sizeof(*tx->iov), NULL);
+	if (!tx->buf || !tx->pktv || !tx->msgv || !tx->iov) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err = lock_alloc(&tx->lock);
+	if (err)
+		goto out;
+
+	tx->fd = udp_sock_fd(us, af);
+	if (tx->fd < 0) {
+		err = EBADF;
+		goto out;
+	}
+
+	err = udp_register_helper(&tx->uh, us, UDPTX_LAYER,
+				  send_handler, recv_handler, tx);
+	if (err)
+		goto out;
+
+ out:
+	if (err)
+		mem_deref(tx);
+	else
+		*txp = tx;
+
+	return err;
+}
+
+
+/**
+ * Start a batch, outgoing datagrams are queued until udptx_flush()
+ *
+ * @param tx Batched transmitter
+ */
+void udptx_begin(struct udptx *tx)
+{
+	if (!tx)
+		return;
+
+	lock_write_get(tx->lock);
+	tx->open = true;
+	lock_rel(tx->lock);
+}
+
+
+/**
+ * Send all queued datagrams and close the batch
+ *
+ * @param tx Batched transmitter
+ */
+void udptx_flush(struct udptx *tx)
+{
+	if (!tx)
+		return;
+
+	lock_write_get(tx->lock);
+	flush(tx);
+	tx->open = false;
+	lock_rel(tx->lock);
+}
+
+
+#else
+
+
+int udptx_alloc(struct udptx **txp, struct udp_sock *us, int af, uint32_t n)
+{
+	(void)txp;
+	(void)us;
+	(void)af;
+	(void)n;
+
+	return ENOSYS;
+}
+
+
+void udptx_begin(struct udptx *tx)
+{
+	(void)tx;
+}
+
+
+void udptx_flush(struct udptx *tx)
+{
+	(void)tx;
+}
+
+
+#endif
+
+
+int udptx_debug(struct re_printf *pf, const struct udptx *tx)
+{
+	uint32_t avg;
+
+	if (!tx)
+		return 0;
+
+	avg = tx->stats.n_call ?
+		(uint32_t)(100ULL * tx->stats.n_pkt / tx->stats.n_call) : 0;
+
+	return re_hprintf(pf, " txbatch: %u packets, %u calls"
+			  " (avg %u.%02u per call), %u gso, %u errors\n",
+			  tx->stats.n_pkt, tx->stats.n_call,
+			  avg / 100, avg % 100,
+			  tx->stats.n_gso, tx->stats.n_err);
+}
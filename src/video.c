@@ -7,6 +7,9 @@
  */
 #include <string.h>
 #include <stdlib.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
@@ -31,6 +34,19 @@
 enum {
 	SRATE = 90000,
 	MAX_MUTED_FRAMES = 3,
+	DEC_HIST_N = 8,
+};
+
+/** Requests from the decoder to the main thread */
+enum vrx_req {
+	VRX_FIR = 1,   /**< Send RTCP FIR to the peer              */
+	VRX_DISPLAY,   /**< Display the queued frame               */
+};
+
+
+/** Upper bounds of the decode-time histogram buckets [us] */
+static const uint32_t dec_histv[DEC_HIST_N - 1] = {
+	1000, 2000, 5000, 10000, 20000, 40000, 80000
 };
 
 
@@ -60,6 +76,12 @@ enum {
  *        |Display|  |Source |
  *        '-------'  '-------'
  *</pre>
+ *
+ * The frames from the Video Source are encoded on a separate encoder
+ * thread. The source thread only converts the frame into a mailbox with
+ * room for one frame; if the encoder is still busy with the previous
+ * frame when the next one arrives, the frame in the mailbox is replaced,
+ * so a slow encoder drops frames instead of adding latency.
  */
 
 /** Video stream - transmitter/encoder direction */
@@ -67,6 +89,8 @@ struct vtx {
 	struct video *video;               /**< Parent                    */
 	const struct vidcodec *vc;         /**< Current Video encoder     */
 	struct videnc_state *enc;          /**< Video encoder state       */
+	struct videnc_param enc_prm;       /**< Video encoder parameters  */
+	char *enc_fmtp;                    /**< Video encoder fmtp        */
 	struct vidsrc_prm vsrc_prm;        /**< Video source parameters   */
 	struct vidsz vsrc_size;            /**< Video source size         */
 	struct vidsrc_st *vsrc;            /**< Video source              */
@@ -76,10 +100,29 @@ struct vtx {
 	struct mbuf *mb;
 	int muted_frames;                  /**< # of muted frames sent    */
 	uint32_t ts_tx;                    /**< Outgoing RTP timestamp    */
+	uint32_t ts_base;                  /**< RTP timestamp offset      */
 	bool picup;                        /**< Send picture update       */
 	bool muted;                        /**< Muted flag                */
 	int frames;                        /**< Number of frames sent     */
 	int efps;                          /**< Estimated frame-rate      */
+#ifdef HAVE_PTHREAD
+	pthread_t tid;                     /**< Encoder thread            */
+	pthread_mutex_t mutex;             /**< Protects the mailbox      */
+	pthread_cond_t cond;               /**< Signals a new frame       */
+	bool run;                          /**< Encoder thread is running */
+#endif
+	struct vidframe *mbox;             /**< Mailbox, latest frame     */
+	struct vidframe *work;             /**< Frame being encoded       */
+	uint32_t ts_mbox;                  /**< Capture time of mailbox   */
+	bool mbox_full;                    /**< Mailbox has a new frame   */
+	struct {
+		uint32_t n_enc;            /**< Number of encoded frames  */
+		uint32_t n_drop;           /**< Number of dropped frames  */
+		uint64_t usec;             /**< Total encode time [us]    */
+		uint32_t usec_max;         /**< Max. encode time [us]     */
+		int frames;                /**< Encoded frames, interval  */
+		int efps;                  /**< Encoded frame-rate        */
+	} stats;
 };
 
 
@@ -91,11 +134,20 @@ struct vrx {
 	struct vidisp_prm vidisp_prm;      /**< Video display parameters  */
 	struct vidisp_st *vidisp;          /**< Video display             */
 	struct lock *lock;                 /**< Lock for decoder          */
+	struct mqueue *mq;                 /**< Requests to main thread   */
+	struct vidframe *disp;             /**< Frame waiting for display */
+	bool disp_full;                    /**< Display frame is queued   */
 	enum vidorient orient;             /**< Display orientation       */
 	bool fullscreen;                   /**< Fullscreen flag           */
 	int pt_rx;                         /**< Incoming RTP payload type */
 	int frames;                        /**< Number of frames received */
 	int efps;                          /**< Estimated frame-rate      */
+	struct {
+		uint32_t n_dec;            /**< Number of decoded frames  */
+		uint64_t usec;             /**< Total decode time [us]    */
+		uint32_t usec_max;         /**< Max. decode time [us]     */
+		uint32_t hist[DEC_HIST_N]; /**< Decode-time histogram     */
+	} stats;
 };
 
 
@@ -119,20 +171,39 @@ static void video_destructor(void *arg)
 	struct vtx *vtx = &v->vtx;
 	struct vrx *vrx = &v->vrx;
 
+	stream_rx_sync(v->strm);
+
 	/* transmit */
 	mem_deref(vtx->vsrc);
+#ifdef HAVE_PTHREAD
+	if (vtx->run) {
+		pthread_mutex_lock(&vtx->mutex);
+		vtx->run = false;
+		pthread_cond_signal(&vtx->cond);
+		pthread_mutex_unlock(&vtx->mutex);
+
+		pthread_join(vtx->tid, NULL);
+	}
+	pthread_cond_destroy(&vtx->cond);
+	pthread_mutex_destroy(&vtx->mutex);
+#endif
+	mem_deref(vtx->mbox);
+	mem_deref(vtx->work);
 	lock_write_get(vtx->lock);
 	mem_deref(vtx->frame);
 	mem_deref(vtx->mute_frame);
 	mem_deref(vtx->enc);
+	mem_deref(vtx->enc_fmtp);
 	mem_deref(vtx->mb);
 	lock_rel(vtx->lock);
 	mem_deref(vtx->lock);
 
 	/* receive */
+	mem_deref(vrx->mq);
 	lock_write_get(vrx->lock);
 	mem_deref(vrx->dec);
 	mem_deref(vrx->vidisp);
+	mem_deref(vrx->disp);
 	lock_rel(vrx->lock);
 	mem_deref(vrx->lock);
 
@@ -143,6 +214,13 @@ static void video_destructor(void *arg)
 }
 
 
+/* The monotonic clock in RTP timestamp units */
+static uint32_t ts_clock(void)
+{
+	return (uint32_t)(realtime_usec() * (SRATE/1000) / 1000);
+}
+
+
 #if ENABLE_ENCODER
 static int get_fps(const struct video *v)
 {
@@ -185,11 +263,18 @@ static int packet_handler(bool marker, const uint8_t *hdr, size_t hdr_len,
 /**
  * Encode video and send via RTP stream
  *
+ * @param vtx   Video transmitter
+ * @param frame Video frame
+ * @param ts    RTP timestamp of the capture time
+ *
  * @note This function has REAL-TIME properties
  */
-static void encode_rtp_send(struct vtx *vtx, const struct vidframe *frame)
+static void encode_rtp_send(struct vtx *vtx, const struct vidframe *frame,
+			    uint32_t ts)
 {
 	struct le *le;
+	uint64_t start = 0;
+	uint32_t usec;
 	int err = 0;
 
 	if (!vtx->enc)
@@ -197,6 +282,8 @@ static void encode_rtp_send(struct vtx *vtx, const struct vidframe *frame)
 
 	lock_write_get(vtx->lock);
 
+	vtx->ts_tx = ts;
+
 	/* Convert image */
 	if (frame->fmt != VID_FMT_YUV420P ||
 	    !vidsz_cmp(&frame->size, &vtx->vsrc_size)) {
@@ -222,24 +309,107 @@ static void encode_rtp_send(struct vtx *vtx, const struct vidframe *frame)
 			err |= st->vf->ench(st, (struct vidframe *)frame);
 	}
 
- unlock:
-	lock_rel(vtx->lock);
-
 	if (err)
-		return;
+		goto unlock;
+
+	/* Encode the whole picture frame, and send all packets at once.
+	 * The lock is held so that the encoder cannot be replaced while
+	 * the encoder thread is using it.
+	 */
+	start = realtime_usec();
 
-	/* Encode the whole picture frame */
+	stream_tx_begin(vtx->video->strm);
 	err = vtx->vc->ench(vtx->enc, vtx->picup, frame, packet_handler, vtx);
+	stream_tx_flush(vtx->video->strm);
+
+ unlock:
+	lock_rel(vtx->lock);
+
 	if (err) {
 		DEBUG_WARNING("encode: %m\n", err);
 		return;
 	}
 
-	vtx->ts_tx += (SRATE/vtx->vsrc_prm.fps);
+	usec = (uint32_t)(realtime_usec() - start);
+
+	load_add(usec);
+
+	++vtx->stats.n_enc;
+	++vtx->stats.frames;
+	vtx->stats.usec    += usec;
+	vtx->stats.usec_max = max(vtx->stats.usec_max, usec);
+
 	vtx->picup = false;
 }
 
 
+#ifdef HAVE_PTHREAD
+static void *enc_thread(void *arg)
+{
+	struct vtx *vtx = arg;
+
+	pthread_mutex_lock(&vtx->mutex);
+
+	while (vtx->run) {
+
+		struct vidframe *frame;
+		uint32_t ts;
+
+		if (!vtx->mbox_full) {
+			pthread_cond_wait(&vtx->cond, &vtx->mutex);
+			continue;
+		}
+
+		/* take the latest frame, the mailbox gets the old buffer */
+		frame          = vtx->mbox;
+		vtx->mbox      = vtx->work;
+		vtx->work      = frame;
+		vtx->mbox_full = false;
+		ts             = vtx->ts_mbox;
+
+		pthread_mutex_unlock(&vtx->mutex);
+
+		encode_rtp_send(vtx, frame, ts);
+
+		pthread_mutex_lock(&vtx->mutex);
+	}
+
+	pthread_mutex_unlock(&vtx->mutex);
+
+	return NULL;
+}
+
+
+/* Post a frame to the encoder thread, replacing any unencoded frame */
+static void enc_post(struct vtx *vtx, const struct vidframe *frame,
+		     uint32_t ts)
+{
+	pthread_mutex_lock(&vtx->mutex);
+
+	if (vtx->mbox_full)
+		++vtx->stats.n_drop;
+
+	if (!vtx->mbox || !vidsz_cmp(&vtx->mbox->size, &vtx->vsrc_size)) {
+
+		vtx->mbox = mem_deref(vtx->mbox);
+
+		if (vidframe_alloc(&vtx->mbox, VID_FMT_YUV420P,
+				   &vtx->vsrc_size))
+			goto out;
+	}
+
+	vidconv(vtx->mbox, frame, 0);
+
+	vtx->ts_mbox   = ts;
+	vtx->mbox_full = true;
+	pthread_cond_signal(&vtx->cond);
+
+ out:
+	pthread_mutex_unlock(&vtx->mutex);
+}
+#endif
+
+
 /**
  * Read frames from video source
  *
@@ -248,6 +418,7 @@ static void encode_rtp_send(struct vtx *vtx, const struct vidframe *frame)
 static void vidsrc_frame_handler(const struct vidframe *frame, void *arg)
 {
 	struct vtx *vtx = arg;
+	const uint32_t ts = vtx->ts_base + ts_clock();
 
 	++vtx->frames;
 
@@ -259,7 +430,13 @@ static void vidsrc_frame_handler(const struct vidframe *frame, void *arg)
 		return;
 
 	/* Encode and send */
-	encode_rtp_send(vtx, frame);
+#ifdef HAVE_PTHREAD
+	if (vtx->run)
+		enc_post(vtx, frame, ts);
+	else
+#endif
+		encode_rtp_send(vtx, frame, ts);
+
 	vtx->muted_frames++;
 }
 
@@ -288,12 +465,57 @@ static int vtx_alloc(struct vtx *vtx, struct video *video)
 		return ENOMEM;
 
 	vtx->video = video;
-	vtx->ts_tx = 160;
+
+	/* the RTP timestamps follow the capture time, starting at 160 */
+	vtx->ts_base = 160 - ts_clock();
+	vtx->ts_tx   = 160;
+
+#if ENABLE_ENCODER && defined(HAVE_PTHREAD)
+	vtx->run = true;
+	err = pthread_create(&vtx->tid, NULL, enc_thread, vtx);
+	if (err) {
+		vtx->run = false;
+		return err;
+	}
+#endif
 
 	return err;
 }
 
 
+/*
+ * The display and RTCP must only be used from the main thread. When the
+ * decoder runs on a media worker thread, it posts the requests here.
+ */
+static void vrx_mqueue_handler(int id, void *data, void *arg)
+{
+	struct vrx *vrx = arg;
+	struct video *v = vrx->video;
+	(void)data;
+
+	switch (id) {
+
+	case VRX_FIR:
+		stream_send_fir(v->strm, v->nack_pli);
+		break;
+
+	case VRX_DISPLAY:
+		lock_write_get(vrx->lock);
+
+		if (vrx->disp_full) {
+			(void)vidisp_display(vrx->vidisp, v->peer, vrx->disp);
+			vrx->disp_full = false;
+		}
+
+		lock_rel(vrx->lock);
+		break;
+
+	default:
+		break;
+	}
+}
+
+
 static int vrx_alloc(struct vrx *vrx, struct video *video)
 {
 	int err;
@@ -302,6 +524,12 @@ static int vrx_alloc(struct vrx *vrx, struct video *video)
 	if (err)
 		goto out;
 
+	if (stream_rx_async(video->strm)) {
+		err = mqueue_alloc(&vrx->mq, vrx_mqueue_handler, vrx);
+		if (err)
+			goto out;
+	}
+
 	vrx->video  = video;
 	vrx->pt_rx  = -1;
 	vrx->orient = VIDORIENT_PORTRAIT;
@@ -312,6 +540,52 @@ static int vrx_alloc(struct vrx *vrx, struct video *video)
 
 
 #if ENABLE_DECODER
+static void dec_stats_add(struct vrx *vrx, uint32_t usec)
+{
+	size_t i;
+
+	for (i=0; i<ARRAY_SIZE(dec_histv); i++) {
+		if (usec < dec_histv[i])
+			break;
+	}
+
+	++vrx->stats.hist[i];
+	++vrx->stats.n_dec;
+	vrx->stats.usec    += usec;
+	vrx->stats.usec_max = max(vrx->stats.usec_max, usec);
+}
+
+
+/*
+ * Copy the decoded frame for the main thread, the decoder owns the
+ * picture buffer. If the previous frame is not displayed yet, it is
+ * replaced by the new one.
+ */
+static int vrx_post_frame(struct vrx *vrx, const struct vidframe *frame)
+{
+	int err;
+
+	if (!vrx->disp || !vidsz_cmp(&vrx->disp->size, &frame->size)) {
+
+		vrx->disp = mem_deref(vrx->disp);
+
+		err = vidframe_alloc(&vrx->disp, VID_FMT_YUV420P,
+				     &frame->size);
+		if (err)
+			return err;
+	}
+
+	vidconv(vrx->disp, frame, NULL);
+
+	if (vrx->disp_full)
+		return 0;
+
+	vrx->disp_full = true;
+
+	return mqueue_push(vrx->mq, VRX_DISPLAY, NULL);
+}
+
+
 /**
  * Decode incoming RTP packets using the Video decoder
  *
@@ -323,6 +597,8 @@ static int video_stream_decode(struct vrx *vrx, const struct rtp_header *hdr,
 	struct video *v = vrx->video;
 	struct vidframe frame;
 	struct le *le;
+	uint64_t start;
+	uint32_t usec;
 	int err = 0;
 
 	if (!hdr || !mbuf_get_left(mb))
@@ -337,7 +613,17 @@ static int video_stream_decode(struct vrx *vrx, const struct rtp_header *hdr,
 	}
 
 	frame.data[0] = NULL;
+
+	start = realtime_usec();
 	err = vrx->vc->dech(vrx->dec, &frame, hdr->m, hdr->seq, mb);
+	usec = (uint32_t)(realtime_usec() - start);
+
+	load_add(usec);
+
+	/* The picture is decoded when the last packet arrives */
+	if (hdr->m)
+		dec_stats_add(vrx, usec);
+
 	if (err) {
 
 		if (err != EPROTO) {
@@ -348,7 +634,10 @@ static int video_stream_decode(struct vrx *vrx, const struct rtp_header *hdr,
 		}
 
 		/* send RTCP FIR to peer */
-		stream_send_fir(v->strm, v->nack_pli);
+		if (vrx->mq)
+			(void)mqueue_push(vrx->mq, VRX_FIR, NULL);
+		else
+			stream_send_fir(v->strm, v->nack_pli);
 
 		/* XXX: if RTCP is not enabled, send XML in SIP INFO ? */
 
@@ -368,7 +657,10 @@ static int video_stream_decode(struct vrx *vrx, const struct rtp_header *hdr,
 			err |= st->vf->dech(st, &frame);
 	}
 
-	err = vidisp_display(vrx->vidisp, v->peer, &frame);
+	if (vrx->mq)
+		err = vrx_post_frame(vrx, &frame);
+	else
+		err = vidisp_display(vrx->vidisp, v->peer, &frame);
 
 	++vrx->frames;
 
@@ -471,6 +763,10 @@ int video_alloc(struct video **vp, struct call *call,
 	MAGIC_INIT(v);
 
 	tmr_init(&v->tmr);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&v->vtx.mutex, NULL);
+	pthread_cond_init(&v->vtx.cond, NULL);
+#endif
 
 	err = stream_alloc(&v->strm, call, sdp_sess, "video", label,
 			   mnat, mnat_sess, menc, menc_sess,
@@ -626,9 +922,11 @@ static void tmr_handler(void *arg)
 	/* Estimate framerates */
 	v->vtx.efps = v->vtx.frames / TMR_INTERVAL;
 	v->vrx.efps = v->vrx.frames / TMR_INTERVAL;
+	v->vtx.stats.efps = v->vtx.stats.frames / TMR_INTERVAL;
 
 	v->vtx.frames = 0;
 	v->vrx.frames = 0;
+	v->vtx.stats.frames = 0;
 }
 
 
@@ -776,6 +1074,19 @@ int video_set_orient(struct video *v, int orient)
 
 
 #if ENABLE_ENCODER
+/* Configured bitrate, limited by the bandwidth of the peer (b=AS) */
+static uint32_t enc_bitrate(const struct video *v)
+{
+	const int32_t as = sdp_media_rbandwidth(stream_sdpmedia(v->strm),
+						SDP_BANDWIDTH_AS);
+
+	if (as > 0)
+		return min(config.video.bitrate, (uint32_t)as * 1024);
+
+	return config.video.bitrate;
+}
+
+
 int video_encoder_set(struct video *v, struct vidcodec *vc,
 		      int pt_tx, const char *params)
 {
@@ -791,7 +1102,7 @@ int video_encoder_set(struct video *v, struct vidcodec *vc,
 
 		struct videnc_param prm;
 
-		prm.bitrate = config.video.bitrate;
+		prm.bitrate = enc_bitrate(v);
 		prm.pktsize = 1300;
 		prm.fps     = get_fps(v);
 		prm.max_fs  = -1;
@@ -801,20 +1112,80 @@ int video_encoder_set(struct video *v, struct vidcodec *vc,
 				 vc->name, vc->variant,
 				 prm.bitrate, prm.fps);
 
+		lock_write_get(vtx->lock);
+
 		vtx->enc = mem_deref(vtx->enc);
+		vtx->enc_fmtp = mem_deref(vtx->enc_fmtp);
+
 		err = vc->encupdh(&vtx->enc, vc, &prm, params);
+		if (!err && params)
+			err = str_dup(&vtx->enc_fmtp, params);
+		if (!err) {
+			vtx->vc = vc;
+			vtx->enc_prm = prm;
+		}
+
+		lock_rel(vtx->lock);
+
 		if (err) {
 			DEBUG_WARNING("encoder alloc: %m\n", err);
 			return err;
 		}
+	}
+	else if (enc_bitrate(v) != vtx->enc_prm.bitrate) {
 
-		vtx->vc = vc;
+		/* the peer changed its bandwidth, e.g. in a re-INVITE */
+		err = video_set_bitrate(v, enc_bitrate(v));
+		if (err) {
+			DEBUG_WARNING("encoder bitrate: %m\n", err);
+		}
 	}
 
 	stream_update_encoder(v->strm, pt_tx);
 
 	return err;
 }
+
+
+/**
+ * Change the bitrate of the running video encoder, for example when the
+ * peer changes its bandwidth (b=AS). The other encoder parameters and the
+ * fmtp are the ones negotiated when the encoder was set. Encoders that
+ * support it keep their state, so that no new keyframe is needed.
+ *
+ * @param v       Video stream
+ * @param bitrate Encoder bitrate in [bit/s]
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int video_set_bitrate(struct video *v, unsigned bitrate)
+{
+	struct videnc_param prm;
+	struct vtx *vtx;
+	int err = 0;
+
+	if (!v || !bitrate)
+		return EINVAL;
+
+	vtx = &v->vtx;
+
+	lock_write_get(vtx->lock);
+
+	if (vtx->vc && vtx->enc) {
+
+		prm = vtx->enc_prm;
+		prm.bitrate = bitrate;
+
+		err = vtx->vc->encupdh(&vtx->enc, vtx->vc, &prm,
+				       vtx->enc_fmtp);
+		if (!err)
+			vtx->enc_prm.bitrate = bitrate;
+	}
+
+	lock_rel(vtx->lock);
+
+	return err;
+}
 #else
 int video_encoder_set(struct video *v, struct vidcodec *vc,
 		      int pt_tx, const char *params)
@@ -826,6 +1197,15 @@ int video_encoder_set(struct video *v, struct vidcodec *vc,
 
 	return 0;
 }
+
+
+int video_set_bitrate(struct video *v, unsigned bitrate)
+{
+	(void)v;
+	(void)bitrate;
+
+	return 0;
+}
 #endif
 
 
@@ -843,6 +1223,8 @@ int video_decoder_set(struct video *v, struct vidcodec *vc, int pt_rx,
 
 	vrx = &v->vrx;
 
+	stream_rx_sync(v->strm);
+
 #if ENABLE_DECODER
 	vrx->pt_rx = pt_rx;
 
@@ -934,6 +1316,7 @@ int video_debug(struct re_printf *pf, const struct video *v)
 {
 	const struct vtx *vtx;
 	const struct vrx *vrx;
+	size_t i;
 	int err;
 
 	if (!v)
@@ -946,7 +1329,32 @@ int video_debug(struct re_printf *pf, const struct video *v)
 	err |= re_hprintf(pf, " tx: %d x %d, fps=%d\n",
 			  vtx->vsrc_size.w,
 			  vtx->vsrc_size.h, vtx->vsrc_prm.fps);
+	err |= re_hprintf(pf, "     encoder: efps=%d/%d (source/encoded)"
+			  " encode=%u us/frame (max %u us)"
+			  " dropped=%u/%u frames\n",
+			  vtx->efps, vtx->stats.efps,
+			  vtx->stats.n_enc ?
+			  (uint32_t)(vtx->stats.usec / vtx->stats.n_enc) : 0,
+			  vtx->stats.usec_max,
+			  vtx->stats.n_drop,
+			  vtx->stats.n_enc + vtx->stats.n_drop);
 	err |= re_hprintf(pf, " rx: pt=%d\n", vrx->pt_rx);
+	err |= re_hprintf(pf, "     decoder: decode=%u us/frame (max %u us)\n",
+			  vrx->stats.n_dec ?
+			  (uint32_t)(vrx->stats.usec / vrx->stats.n_dec) : 0,
+			  vrx->stats.usec_max);
+	err |= re_hprintf(pf, "     decode-time [ms]:");
+	for (i=0; i<DEC_HIST_N; i++) {
+
+		if (i < ARRAY_SIZE(dec_histv))
+			err |= re_hprintf(pf, " <%u=%u",
+					  dec_histv[i] / 1000,
+					  vrx->stats.hist[i]);
+		else
+			err |= re_hprintf(pf, " >=%u=%u\n",
+					  dec_histv[i-1] / 1000,
+					  vrx->stats.hist[i]);
+	}
 
 	err |= stream_debug(pf, v->strm);
 